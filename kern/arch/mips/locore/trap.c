@@ -39,7 +39,9 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <proc.h>
 
+#include "opt-A2.h"
 #include "opt-A3.h"
 
 /* in exception.S */
@@ -201,6 +203,13 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+#if OPT_A2
+		/* another thread called _exit: follow it out */
+		if (!iskern && curproc->p_dying) {
+			uthread_exit(0);
+		}
+#endif
 		goto done2;
 	}
 
@@ -321,6 +330,13 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#if OPT_A2
+	/* another thread called _exit: follow it out */
+	if (!iskern && curproc->p_dying) {
+		uthread_exit(0);
+	}
+#endif
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
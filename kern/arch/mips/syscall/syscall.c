@@ -37,6 +37,9 @@
 #include <syscall.h>
 
 #include "opt-A2.h"
+#if OPT_A2
+#include <copyinout.h>
+#endif
 
 /*
  * System call dispatcher.
@@ -85,6 +88,9 @@ syscall(struct trapframe *tf)
 #if OPT_A2
 	const_userptr_t progname;
 	userptr_t *args;
+	off_t pos, retval64;
+	int whence;
+	bool is64 = false;
 #endif
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -145,6 +151,106 @@ syscall(struct trapframe *tf)
 		args = (userptr_t *)tf->tf_a1;
 		err = sys_execv(progname, args);
 		break;
+	case SYS_vfork:
+		err = sys_vfork(tf, (pid_t *)&retval);
+		break;
+	case SYS_spawn:
+		err = sys_spawn((const_userptr_t)tf->tf_a0,
+				(userptr_t *)tf->tf_a1,
+				(pid_t *)&retval);
+		break;
+	case SYS___thread_create:
+		err = sys_thread_create(tf,
+					(userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1,
+					(userptr_t)tf->tf_a2,
+					&retval);
+		break;
+	case SYS_thread_join:
+		err = sys_thread_join((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+	case SYS_thread_exit:
+		sys_thread_exit((userptr_t)tf->tf_a0);
+		panic("unexpected return from sys_thread_exit");
+		break;
+	case SYS_futex:
+		err = sys_futex((userptr_t)tf->tf_a0,
+				(int)tf->tf_a1,
+				(int)tf->tf_a2,
+				&retval);
+		break;
+	case SYS_open:
+		err = sys_open((userptr_t)tf->tf_a0,
+			       (int)tf->tf_a1,
+			       (mode_t)tf->tf_a2,
+			       (int *)&retval);
+		break;
+	case SYS_read:
+		err = sys_read((int)tf->tf_a0,
+			       (userptr_t)tf->tf_a1,
+			       (int)tf->tf_a2,
+			       (int *)&retval);
+		break;
+	case SYS_pread:
+	case SYS_pwrite:
+		/* 64-bit pos is in the aligned stack slot after a0-a3 */
+		err = copyin((const_userptr_t)(tf->tf_sp + 16),
+			     &pos, sizeof(pos));
+		if (err) {
+			break;
+		}
+		if (callno == SYS_pread) {
+			err = sys_pread((int)tf->tf_a0,
+					(userptr_t)tf->tf_a1,
+					(size_t)tf->tf_a2,
+					pos, (int *)&retval);
+		} else {
+			err = sys_pwrite((int)tf->tf_a0,
+					 (userptr_t)tf->tf_a1,
+					 (size_t)tf->tf_a2,
+					 pos, (int *)&retval);
+		}
+		break;
+	case SYS_readv:
+		err = sys_readv((int)tf->tf_a0,
+				(const_userptr_t)tf->tf_a1,
+				(int)tf->tf_a2,
+				(int *)&retval);
+		break;
+	case SYS_writev:
+		err = sys_writev((int)tf->tf_a0,
+				 (const_userptr_t)tf->tf_a1,
+				 (int)tf->tf_a2,
+				 (int *)&retval);
+		break;
+	case SYS_close:
+		err = sys_close((int)tf->tf_a0);
+		break;
+	case SYS_lseek:
+		/* 64-bit pos is in the aligned pair a2/a3; whence is on the stack */
+		pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+		err = copyin((const_userptr_t)(tf->tf_sp + 16),
+			     &whence, sizeof(whence));
+		if (err) {
+			break;
+		}
+		err = sys_lseek((int)tf->tf_a0, pos, whence, &retval64);
+		is64 = true;
+		break;
+	case SYS_pipe:
+		err = sys_pipe((userptr_t)tf->tf_a0, (int *)&retval);
+		break;
+	case SYS_poll:
+		err = sys_poll((userptr_t)tf->tf_a0,
+			       (unsigned)tf->tf_a1,
+			       (int)tf->tf_a2,
+			       (int *)&retval);
+		break;
+	case SYS_dup2:
+		err = sys_dup2((int)tf->tf_a0,
+			       (int)tf->tf_a1,
+			       (int *)&retval);
+		break;
 #endif
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
@@ -162,6 +268,14 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+#if OPT_A2
+	else if (is64) {
+		/* Success, with a 64-bit return value in v0/v1. */
+		tf->tf_v0 = (uint32_t)(retval64 >> 32);
+		tf->tf_v1 = (uint32_t)retval64;
+		tf->tf_a3 = 0;      /* signal no error */
+	}
+#endif
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
@@ -205,3 +319,19 @@ enter_forked_process(struct trapframe *tf)
 	(void)tf;
 #endif
 }
+
+#if OPT_A2
+/*
+ * Enter user mode in a new user thread. TF was built by
+ * sys_thread_create; like mips_usermode needs, it goes on our own
+ * stack first.
+ */
+void
+enter_new_thread(struct trapframe *tf)
+{
+	struct trapframe tf_c = *tf;
+
+	kfree(tf);
+	mips_usermode(&tf_c);
+}
+#endif
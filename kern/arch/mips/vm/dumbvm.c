@@ -38,6 +38,7 @@
 #include <addrspace.h>
 #include <vm.h>
 
+#include "opt-A2.h"
 #include "opt-A3.h"
 #if OPT_A3
 #include <mips/trapframe.h>
@@ -51,6 +52,18 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+#if OPT_A2
+/*
+ * Stacks for additional user threads sit below the main stack, each
+ * with an unmapped guard page under it. Slot N (from 0) spans
+ * [DUMBVM_TSTACKTOP(N) - DUMBVM_TSTACKPAGES pages, DUMBVM_TSTACKTOP(N)).
+ */
+#define DUMBVM_TSTACKPAGES   8
+#define DUMBVM_TSTACKTOP(n) \
+	(USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE - PAGE_SIZE - \
+	 (n) * (DUMBVM_TSTACKPAGES + 1) * PAGE_SIZE)
+#endif
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
@@ -290,6 +303,25 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+#if OPT_A2
+	else if (faultaddress < DUMBVM_TSTACKTOP(0) &&
+		 faultaddress >= DUMBVM_TSTACKTOP(AS_MAXTSTACKS - 1)
+		 - DUMBVM_TSTACKPAGES * PAGE_SIZE) {
+		/* thread stacks: find the slot, skipping guard pages */
+		unsigned slot;
+		vaddr_t top;
+
+		slot = (DUMBVM_TSTACKTOP(0) - faultaddress - 1)
+			/ ((DUMBVM_TSTACKPAGES + 1) * PAGE_SIZE);
+		top = DUMBVM_TSTACKTOP(slot);
+		if (faultaddress < top - DUMBVM_TSTACKPAGES * PAGE_SIZE ||
+		    faultaddress >= top || as->as_tspbase[slot] == 0) {
+			return EFAULT;
+		}
+		paddr = faultaddress - (top - DUMBVM_TSTACKPAGES * PAGE_SIZE)
+			+ as->as_tspbase[slot];
+	}
+#endif
 	else {
 		return EFAULT;
 	}
@@ -360,6 +392,13 @@ as_create(void)
 #if OPT_A3
 	as->is_load_elf_done = false;
 #endif
+#if OPT_A2
+	spinlock_init(&as->as_tslock);
+	as->as_tsused = 0;
+	for (unsigned i = 0; i < AS_MAXTSTACKS; i++) {
+		as->as_tspbase[i] = 0;
+	}
+#endif
 
 	return as;
 }
@@ -367,6 +406,9 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+#if OPT_A2
+	spinlock_cleanup(&as->as_tslock);
+#endif
 	kfree(as);
 }
 
@@ -491,6 +533,70 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+#if OPT_A2
+int
+as_define_threadstack(struct addrspace *as, unsigned *slot,
+		      vaddr_t *stackptr)
+{
+	unsigned i;
+	paddr_t pa;
+
+	spinlock_acquire(&as->as_tslock);
+	for (i = 0; i < AS_MAXTSTACKS; i++) {
+		if ((as->as_tsused & (1U << i)) == 0) {
+			break;
+		}
+	}
+	if (i == AS_MAXTSTACKS) {
+		spinlock_release(&as->as_tslock);
+		return EAGAIN;
+	}
+	as->as_tsused |= 1U << i;
+	spinlock_release(&as->as_tslock);
+
+	/*
+	 * The slot is ours now. Its memory is kept when the slot is
+	 * released, so only the first thread to use it pays for it.
+	 */
+	if (as->as_tspbase[i] == 0) {
+		pa = getppages(DUMBVM_TSTACKPAGES);
+		if (pa == 0) {
+			as_release_threadstack(as, i);
+			return ENOMEM;
+		}
+		as_zero_region(pa, DUMBVM_TSTACKPAGES);
+		as->as_tspbase[i] = pa;
+	}
+
+	*slot = i;
+	*stackptr = DUMBVM_TSTACKTOP(i);
+	return 0;
+}
+
+void
+as_release_threadstack(struct addrspace *as, unsigned slot)
+{
+	KASSERT(slot < AS_MAXTSTACKS);
+
+	spinlock_acquire(&as->as_tslock);
+	KASSERT(as->as_tsused & (1U << slot));
+	as->as_tsused &= ~(1U << slot);
+	spinlock_release(&as->as_tslock);
+}
+
+void
+as_claim_threadstack(struct addrspace *as, unsigned slot)
+{
+	KASSERT(slot < AS_MAXTSTACKS);
+	KASSERT(as->as_tspbase[slot] != 0);
+
+	spinlock_acquire(&as->as_tslock);
+	KASSERT((as->as_tsused & (1U << slot)) == 0);
+	as->as_tsused |= 1U << slot;
+	spinlock_release(&as->as_tslock);
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -527,6 +633,28 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+#if OPT_A2
+	/*
+	 * Copy every thread stack that has memory; the forking thread
+	 * may be running on one of them. None of the slots is in use
+	 * in the copy: the threads using them weren't copied, and fork
+	 * claims the one its caller is on.
+	 */
+	for (unsigned i = 0; i < AS_MAXTSTACKS; i++) {
+		if (old->as_tspbase[i] == 0) {
+			continue;
+		}
+		new->as_tspbase[i] = getppages(DUMBVM_TSTACKPAGES);
+		if (new->as_tspbase[i] == 0) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(new->as_tspbase[i]),
+			(const void *)PADDR_TO_KVADDR(old->as_tspbase[i]),
+			DUMBVM_TSTACKPAGES*PAGE_SIZE);
+	}
+#endif
 	
 	*ret = new;
 	return 0;
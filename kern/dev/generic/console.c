@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -194,6 +195,7 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars_head = nexthead;
 		
 	V(cs->cs_rsem);
+	pollqueue_wakeup(&cs->cs_readpoll);
 }
 
 /*
@@ -360,6 +362,30 @@ con_ioctl(struct device *dev, int op, userptr_t data)
 	return EINVAL;
 }
 
+/*
+ * Readable if there is buffered input; output never blocks for long.
+ */
+static
+int
+con_poll(struct device *dev, int events, struct pollwaiter *pw, int *revents)
+{
+	struct con_softc *cs = dev->d_data;
+	int result;
+
+	if (pw != NULL) {
+		result = pollwaiter_register(pw, &cs->cs_readpoll);
+		if (result) {
+			return result;
+		}
+	}
+
+	*revents = events & (POLLOUT | POLLWRNORM);
+	if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		*revents |= events & (POLLIN | POLLRDNORM);
+	}
+	return 0;
+}
+
 static
 int
 attach_console_to_vfs(struct con_softc *cs)
@@ -376,6 +402,8 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_close = con_close;
 	dev->d_io = con_io;
 	dev->d_ioctl = con_ioctl;
+	dev->d_poll = con_poll;
+	dev->d_strategy = NULL;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
@@ -441,6 +469,7 @@ config_con(struct con_softc *cs, int unit)
 	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	pollqueue_init(&cs->cs_readpoll);
 
 	the_console = cs;
 	con_userlock_read = rlk;
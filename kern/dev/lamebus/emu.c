@@ -42,6 +42,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
@@ -479,11 +480,18 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	/* Someone may have picked it up again; see vnode_decref */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -629,6 +637,20 @@ emufs_ioctl(struct vnode *v, int op, userptr_t data)
 	return EINVAL;
 }
 
+/*
+ * Called for poll(). Files and directories are always ready.
+ */
+static
+int
+emufs_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	(void)v;
+	(void)pw;
+
+	*revents = events & (POLLIN | POLLRDNORM | POLLOUT);
+	return 0;
+}
+
 /*
  * VOP_STAT
  */
@@ -1085,6 +1107,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_uio_op_notdir, /* getdirentry */
 	emufs_write,
 	emufs_ioctl,
+	emufs_poll,
 	emufs_stat,
 	emufs_file_gettype,
 	emufs_tryseek,
@@ -1120,6 +1143,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_getdirentry,
 	emufs_uio_op_isdir,   /* write */
 	emufs_ioctl,
+	emufs_poll,
 	emufs_stat,
 	emufs_dir_gettype,
 	emufs_dir_tryseek,
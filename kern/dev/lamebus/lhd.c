@@ -35,7 +35,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <bio.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,40 +96,206 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Requests waiting for the disk are kept in lh_queue, sorted by
+ * starting sector. A request that begins where a queued request of
+ * the same direction ends (or ends where one begins) is merged into
+ * it: the merged requests form a run, chained through bio_runnext,
+ * that is issued as one unit. Runs are served in C-LOOK order: the
+ * next run is the first one at or beyond the last sector issued,
+ * wrapping around to the lowest sector when there are none.
+ *
+ * Each sector of the run in progress is started from the interrupt
+ * handler as soon as the previous one finishes, so the disk stays
+ * busy while there is work queued, and submitters don't wait.
+ */
+
+/* Limit on merged run length, so one run can't hog the disk. */
+#define LHD_MAXRUN	64
+
+/*
+ * Start the next sector of the current request. Called with lh_lock
+ * held and the device idle.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startsect(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct bio *bio = lh->lh_cur;
+	uint32_t sector = bio->bio_block + lh->lh_cursect;
+	uint32_t statval = LHD_WORKING;
+
+	if (bio->bio_rw == UIO_WRITE) {
+		memcpy(lh->lh_buf,
+		       (char *)bio->bio_data + lh->lh_cursect * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+	lh->lh_headpos = sector;
+}
+
+/*
+ * Take the next run off the queue, in C-LOOK order, and start it.
+ * Called with lh_lock held and the device idle.
+ */
+static
+void
+lhd_startrun(struct lhd_softc *lh)
+{
+	struct bio **bp, **pick;
+
+	KASSERT(lh->lh_cur == NULL);
+	if (lh->lh_queue == NULL) {
+		return;
+	}
+
+	pick = &lh->lh_queue;
+	for (bp = &lh->lh_queue; *bp != NULL; bp = &(*bp)->bio_qnext) {
+		if ((*bp)->bio_block >= lh->lh_headpos) {
+			pick = bp;
+			break;
+		}
+	}
+
+	lh->lh_cur = *pick;
+	*pick = lh->lh_cur->bio_qnext;
+	lh->lh_cur->bio_qnext = NULL;
+	lh->lh_cursect = 0;
+	lhd_startsect(lh);
+}
+
+/*
+ * Put a request in the queue, merging it with an adjacent run if
+ * possible. Called with lh_lock held.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct bio *bio)
+{
+	struct bio **bp, *run, *next, *tail;
+	uint32_t start = bio->bio_block;
+	uint32_t end = bio->bio_block + bio->bio_nblocks;
+
+	bio->bio_qnext = NULL;
+	bio->bio_runnext = NULL;
+	bio->bio_runend = end;
+
+	for (bp = &lh->lh_queue; *bp != NULL; bp = &(*bp)->bio_qnext) {
+		run = *bp;
+		if (run->bio_rw != bio->bio_rw ||
+		    run->bio_runend - run->bio_block + bio->bio_nblocks
+		    > LHD_MAXRUN) {
+			if (run->bio_block > start) {
+				break;
+			}
+			continue;
+		}
+
+		if (run->bio_runend == start) {
+			/* append to the run */
+			for (tail = run; tail->bio_runnext != NULL;
+			     tail = tail->bio_runnext) ;
+			tail->bio_runnext = bio;
+			run->bio_runend = end;
+
+			/* and maybe close the gap to the next run */
+			next = run->bio_qnext;
+			if (next != NULL && next->bio_rw == run->bio_rw &&
+			    next->bio_block == end &&
+			    next->bio_runend - run->bio_block <= LHD_MAXRUN) {
+				bio->bio_runnext = next;
+				run->bio_runend = next->bio_runend;
+				run->bio_qnext = next->bio_qnext;
+				next->bio_qnext = NULL;
+			}
+			return;
+		}
+		if (run->bio_block == end) {
+			/* prepend; the run keeps its place in the queue */
+			bio->bio_runnext = run;
+			bio->bio_runend = run->bio_runend;
+			bio->bio_qnext = run->bio_qnext;
+			run->bio_qnext = NULL;
+			*bp = bio;
+			return;
+		}
+		if (run->bio_block > start) {
+			break;
+		}
+	}
+
+	bio->bio_qnext = *bp;
+	*bp = bio;
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, account for the sector, and start the next one. Requests
+ * that are now finished are completed after dropping the lock.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct bio *bio, *done = NULL;
 	uint32_t val;
-	
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	bio = lh->lh_cur;
+	if (bio == NULL) {
+		/* nothing was running; ignore it */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	result = lhd_code_to_errno(lh, val);
+	if (result == 0 && bio->bio_rw == UIO_READ) {
+		memcpy((char *)bio->bio_data + lh->lh_cursect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_cursect++;
+
+	if (result != 0 || lh->lh_cursect == bio->bio_nblocks) {
+		/* this request is finished; on to the next in the run */
+		bio->bio_result = result;
+		lh->lh_cur = bio->bio_runnext;
+		lh->lh_cursect = 0;
+		bio->bio_runnext = NULL;
+		bio->bio_qnext = done;
+		done = bio;
+	}
+
+	if (lh->lh_cur != NULL) {
+		lhd_startsect(lh);
+	}
+	else {
+		lhd_startrun(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	while (done != NULL) {
+		bio = done;
+		done = bio->bio_qnext;
+		bio->bio_qnext = NULL;
+		bio_complete(bio, bio->bio_result);
 	}
 }
 
@@ -193,8 +360,41 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a block request.
+ */
+static
+int
+lhd_strategy(struct device *d, struct bio *bio)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (bio->bio_nblocks == 0 ||
+	    bio->bio_block >= lh->lh_dev.d_blocks ||
+	    bio->bio_nblocks > lh->lh_dev.d_blocks - bio->bio_block) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, bio);
+	if (lh->lh_cur == NULL) {
+		lhd_startrun(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/* Largest piece of a uio transferred per request. */
+#define LHD_IOCHUNK	(8 * LHD_SECTSIZE)
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * The uio may point at user memory, which we can't touch from the
+ * interrupt handler, so it is moved through a kernel buffer and
+ * issued as queued requests of up to LHD_IOCHUNK bytes.
  */
 static
 int
@@ -206,9 +406,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	struct bio bio;
+	size_t chunk;
+	void *kbuf;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -220,59 +421,49 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	kbuf = kmalloc(len * LHD_SECTSIZE < LHD_IOCHUNK ?
+		       len * LHD_SECTSIZE : LHD_IOCHUNK);
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	while (uio->uio_resid > 0) {
+		chunk = uio->uio_resid < LHD_IOCHUNK ?
+			uio->uio_resid : LHD_IOCHUNK;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = uiomove(kbuf, chunk, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		bio.bio_block = sector;
+		bio.bio_nblocks = chunk / LHD_SECTSIZE;
+		bio.bio_data = kbuf;
+		bio.bio_rw = uio->uio_rw;
+		bio.bio_done = NULL;
+		bio.bio_arg = NULL;
+		result = bio_io(d, &bio);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(kbuf, chunk, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += chunk / LHD_SECTSIZE;
 	}
 
-	return 0;
+	kfree(kbuf);
+	return result;
 }
 
 /*
@@ -289,23 +480,19 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_cursect = 0;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_poll = NULL;
+	lh->lh_dev.d_strategy = lhd_strategy;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
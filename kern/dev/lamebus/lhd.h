@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct bio *lh_queue;		/* Waiting requests, by sector */
+	struct bio *lh_cur;		/* Request in progress, or NULL */
+	uint32_t lh_cursect;		/* Sector within lh_cur */
+	uint32_t lh_headpos;		/* Sector last issued */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * In-memory index of a directory: its names hashed to their inode
+ * and slot numbers, and a list of the free slots. Built on first
+ * use and kept up to date by sfs_dir_link and sfs_dir_unlink. An
+ * index is either exact or thrown away; if memory runs out while
+ * updating one, the caller destroys it and it is rebuilt later.
+ *
+ * The directory's sv_lock must be held for all of these.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <sfs.h>
+
+/* Initial number of buckets; must be a power of 2. */
+#define DIRINDEX_INITSIZE  16
+
+/* Grow when there are more than this many names per bucket. */
+#define DIRINDEX_LOAD      2
+
+struct sfs_direntry {
+	char *de_name;
+	uint32_t de_ino;
+	int de_slot;
+	struct sfs_direntry *de_next;
+};
+
+struct sfs_dirindex {
+	struct sfs_direntry **di_hash;
+	unsigned di_hashsize;
+	unsigned di_nentries;
+
+	int *di_free;			/* free slots, used last-in first */
+	unsigned di_nfree;
+	unsigned di_maxfree;
+};
+
+/* djb2 */
+static
+unsigned
+dirindex_hashfn(const char *name, unsigned size)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h & (size - 1);
+}
+
+static
+void
+dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_direntry **newhash, *de, *next;
+	unsigned newsize, i, b;
+
+	newsize = di->di_hashsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_direntry *));
+	if (newhash == NULL) {
+		/* just run with longer chains */
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	for (i=0; i<di->di_hashsize; i++) {
+		for (de = di->di_hash[i]; de != NULL; de = next) {
+			next = de->de_next;
+			b = dirindex_hashfn(de->de_name, newsize);
+			de->de_next = newhash[b];
+			newhash[b] = de;
+		}
+	}
+
+	kfree(di->di_hash);
+	di->di_hash = newhash;
+	di->di_hashsize = newsize;
+}
+
+struct sfs_dirindex *
+sfs_dirindex_create(void)
+{
+	struct sfs_dirindex *di;
+	unsigned i;
+
+	di = kmalloc(sizeof(struct sfs_dirindex));
+	if (di == NULL) {
+		return NULL;
+	}
+	di->di_hash = kmalloc(DIRINDEX_INITSIZE * sizeof(struct sfs_direntry *));
+	if (di->di_hash == NULL) {
+		kfree(di);
+		return NULL;
+	}
+	for (i=0; i<DIRINDEX_INITSIZE; i++) {
+		di->di_hash[i] = NULL;
+	}
+	di->di_hashsize = DIRINDEX_INITSIZE;
+	di->di_nentries = 0;
+	di->di_free = NULL;
+	di->di_nfree = 0;
+	di->di_maxfree = 0;
+	return di;
+}
+
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	struct sfs_direntry *de, *next;
+	unsigned i;
+
+	for (i=0; i<di->di_hashsize; i++) {
+		for (de = di->di_hash[i]; de != NULL; de = next) {
+			next = de->de_next;
+			kfree(de->de_name);
+			kfree(de);
+		}
+	}
+	kfree(di->di_hash);
+	if (di->di_free != NULL) {
+		kfree(di->di_free);
+	}
+	kfree(di);
+}
+
+/*
+ * Look up NAME; hand back its inode and slot number.
+ */
+int
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name,
+		  uint32_t *ino, int *slot)
+{
+	struct sfs_direntry *de;
+
+	de = di->di_hash[dirindex_hashfn(name, di->di_hashsize)];
+	for (; de != NULL; de = de->de_next) {
+		if (!strcmp(de->de_name, name)) {
+			if (ino != NULL) {
+				*ino = de->de_ino;
+			}
+			if (slot != NULL) {
+				*slot = de->de_slot;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Enter NAME, which must not already be present.
+ */
+int
+sfs_dirindex_add(struct sfs_dirindex *di, const char *name,
+		 uint32_t ino, int slot)
+{
+	struct sfs_direntry *de;
+	unsigned b;
+
+	KASSERT(sfs_dirindex_find(di, name, NULL, NULL) == ENOENT);
+
+	de = kmalloc(sizeof(struct sfs_direntry));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_name = kstrdup(name);
+	if (de->de_name == NULL) {
+		kfree(de);
+		return ENOMEM;
+	}
+	de->de_ino = ino;
+	de->de_slot = slot;
+
+	if (di->di_nentries >= di->di_hashsize * DIRINDEX_LOAD) {
+		dirindex_grow(di);
+	}
+
+	b = dirindex_hashfn(name, di->di_hashsize);
+	de->de_next = di->di_hash[b];
+	di->di_hash[b] = de;
+	di->di_nentries++;
+	return 0;
+}
+
+/*
+ * Remove NAME, which must be present.
+ */
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_direntry **dep, *de;
+
+	dep = &di->di_hash[dirindex_hashfn(name, di->di_hashsize)];
+	while (strcmp((*dep)->de_name, name)) {
+		dep = &(*dep)->de_next;
+		KASSERT(*dep != NULL);
+	}
+	de = *dep;
+	*dep = de->de_next;
+	kfree(de->de_name);
+	kfree(de);
+
+	KASSERT(di->di_nentries > 0);
+	di->di_nentries--;
+}
+
+/*
+ * Remember that SLOT is free.
+ */
+int
+sfs_dirindex_addfree(struct sfs_dirindex *di, int slot)
+{
+	int *newfree;
+	unsigned newmax;
+
+	if (di->di_nfree == di->di_maxfree) {
+		newmax = di->di_maxfree ? di->di_maxfree * 2 : 8;
+		newfree = kmalloc(newmax * sizeof(int));
+		if (newfree == NULL) {
+			return ENOMEM;
+		}
+		if (di->di_free != NULL) {
+			memcpy(newfree, di->di_free, di->di_nfree * sizeof(int));
+			kfree(di->di_free);
+		}
+		di->di_free = newfree;
+		di->di_maxfree = newmax;
+	}
+	di->di_free[di->di_nfree++] = slot;
+	return 0;
+}
+
+/*
+ * Return a free slot, or -1 if there are none. The slot stays on
+ * the list until sfs_dirindex_usefree.
+ */
+int
+sfs_dirindex_getfree(struct sfs_dirindex *di)
+{
+	if (di->di_nfree == 0) {
+		return -1;
+	}
+	return di->di_free[di->di_nfree - 1];
+}
+
+/*
+ * The slot from sfs_dirindex_getfree is now in use.
+ */
+void
+sfs_dirindex_usefree(struct sfs_dirindex *di)
+{
+	KASSERT(di->di_nfree > 0);
+	di->di_nfree--;
+}
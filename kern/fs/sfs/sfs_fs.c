@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -111,11 +113,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	struct vnode **vns;
+	unsigned i, b, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +150,47 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Go over the table of loaded vnodes, syncing as we go. The
+	 * directory's lock comes before the table lock, so grab
+	 * references under the table lock and sync after dropping it.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	vns = NULL;
+	if (num > 0) {
+		vns = kmalloc(num * sizeof(struct vnode *));
+		if (vns == NULL) {
+			lock_release(sfs->sfs_vnlock);
+			return ENOMEM;
+		}
+	}
+	i = 0;
+	for (b=0; b<sfs->sfs_vnhashsize; b++) {
+		for (sv = sfs->sfs_vnhash[b]; sv != NULL; sv = sv->sv_hnext) {
+			vns[i++] = &sv->sv_v;
+			VOP_INCREF(&sv->sv_v);
+		}
+	}
+	KASSERT(i == num);
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		/* just into the cache; buf_sync below writes it all */
+		sfs_syncvnode(vns[i]->vn_data);
+		VOP_DECREF(vns[i]);
 	}
+	if (vns != NULL) {
+		kfree(vns);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,14 +200,16 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Now push everything queued in the buffer cache to disk. */
+	return buf_sync(sfs->sfs_device);
 }
 
 /*
@@ -191,9 +224,8 @@ sfs_getvolname(struct fs *fs)
 	struct sfs_fs *sfs = fs->fs_data;
 	const char *ret;
 
-	vfs_biglock_acquire();
+	/* Doesn't change while mounted */
 	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
 	return ret;
 }
@@ -209,30 +241,39 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer's lock keeps anyone from newly finding this fs.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* With no vnodes left, no delayed blocks are either. */
+	KASSERT(sfs->sfs_nreserved == 0);
+
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
 	
-	/* The vfs layer takes care of the device for us */
-	(void)sfs->sfs_device;
+	/* Drop our (clean) blocks from the buffer cache */
+	buf_invalidate(sfs->sfs_device);
+
+	/* The vfs layer takes care of the device itself for us */
 
 	/* Destroy the fs object */
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -256,8 +297,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	uint32_t i;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -278,24 +318,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate locks */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs);
+		return ENOMEM;
+	}
+
+	/* Allocate vnode table */
+	result = sfs_vnhash_init(sfs);
+	if (result) {
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs);
+		return result;
+	}
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -303,9 +355,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +369,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buf_invalidate(dev);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -333,20 +388,33 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buf_invalidate(dev);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buf_invalidate(dev);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Count the free blocks; none are reserved yet */
+	sfs->sfs_nfree = 0;
+	for (i=0; i<sfs->sfs_super.sp_nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_nfree++;
+		}
+	}
+	sfs->sfs_nreserved = 0;
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -361,7 +429,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
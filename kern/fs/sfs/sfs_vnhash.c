@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Table of loaded vnodes, hashed by inode number. The table doubles
+ * as it fills, so lookups stay short however many files are in use.
+ *
+ * All of these must be called with sfs_vnlock held.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <sfs.h>
+
+/* Initial number of buckets; must be a power of 2. */
+#define SFS_VNHASH_INITSIZE  64
+
+/* Grow when there are more than this many vnodes per bucket. */
+#define SFS_VNHASH_LOAD      2
+
+static
+unsigned
+sfs_vnhash_bucket(unsigned size, uint32_t ino)
+{
+	return ino & (size - 1);
+}
+
+/*
+ * Double the number of buckets. If we can't get the memory, carry
+ * on with longer chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newtab, *sv, *next;
+	unsigned newsize, i, b;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newtab = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newtab == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtab[i] = NULL;
+	}
+
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = next) {
+			next = sv->sv_hnext;
+			b = sfs_vnhash_bucket(newsize, sv->sv_ino);
+			sv->sv_hnext = newtab[b];
+			newtab[b] = sv;
+		}
+	}
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = newtab;
+	sfs->sfs_vnhashsize = newsize;
+}
+
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vnremoved = 0;
+	return 0;
+}
+
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+	sfs->sfs_vnhashsize = 0;
+}
+
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	b = sfs_vnhash_bucket(sfs->sfs_vnhashsize, ino);
+	for (sv = sfs->sfs_vnhash[b]; sv != NULL; sv = sv->sv_hnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sfs_vnhash_find(sfs, sv->sv_ino) == NULL);
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnhashsize * SFS_VNHASH_LOAD) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	b = sfs_vnhash_bucket(sfs->sfs_vnhashsize, sv->sv_ino);
+	sv->sv_hnext = sfs->sfs_vnhash[b];
+	sfs->sfs_vnhash[b] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	b = sfs_vnhash_bucket(sfs->sfs_vnhashsize, sv->sv_ino);
+	for (svp = &sfs->sfs_vnhash[b]; *svp != sv; svp = &(*svp)->sv_hnext) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hnext;
+	sv->sv_hnext = NULL;
+
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+	/* lets sfs_loadvnode see that the table changed under it */
+	sfs->sfs_vnremoved++;
+}
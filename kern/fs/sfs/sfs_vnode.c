@@ -34,6 +34,7 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
@@ -43,12 +44,16 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With the vnode ops */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,9 +63,17 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buf_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(b->b_data, SFS_BLOCKSIZE);
+	buf_markdirty(b);
+	buf_release(b);
+	return 0;
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -68,6 +81,8 @@ static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
@@ -84,19 +99,38 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block. If RESERVED is set, the block comes out of one of
+ * the caller's reservations (see sfs_breserve), which is used up in
+ * the same step.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_doballoc(struct sfs_fs *sfs, bool reserved, uint32_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
+	if (reserved) {
+		KASSERT(sfs->sfs_nreserved > 0);
+	}
+	else if (sfs->sfs_nfree <= sfs->sfs_nreserved) {
+		/* the rest are promised to delayed blocks */
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		/* a reservation guarantees a free block */
+		KASSERT(!reserved);
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
+	if (reserved) {
+		sfs->sfs_nreserved--;
+	}
+	sfs->sfs_nfree--;
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -106,6 +140,16 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Allocate a block that nobody reserved.
+ */
+static
+int
+sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+{
+	return sfs_doballoc(sfs, false, diskblock);
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +157,100 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	sfs->sfs_nfree++;
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Set aside a free block for a delayed block, so that allocating it
+ * later can't run out of space.
+ */
+static
+int
+sfs_breserve(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_nfree <= sfs->sfs_nreserved) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	sfs->sfs_nreserved++;
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
+/*
+ * Give back NUM reservations.
+ */
+static
+void
+sfs_bunreserve(struct sfs_fs *sfs, uint32_t num)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_nreserved >= num);
+	sfs->sfs_nreserved -= num;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate up to WANT contiguous blocks out of the caller's
+ * reservations, returning the first in *START and the number in
+ * *GOT. We look for the first free run of WANT blocks at or after
+ * GOAL (wrapping around), and failing that take the longest run
+ * seen. The blocks are not cleared; the caller fills them.
+ * The reservations guarantee there is at least one.
+ */
+static
+void
+sfs_ballocrun(struct sfs_fs *sfs, uint32_t goal, uint32_t want,
+	      uint32_t *start, uint32_t *got)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t n, b, runstart = 0, runlen = 0, best = 0, bestlen = 0;
+
+	KASSERT(want > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_nreserved >= want);
+
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+	for (n = 0; n < nblocks; n++) {
+		b = (goal + n) % nblocks;
+		if (bitmap_isset(sfs->sfs_freemap, b)) {
+			/* (block 0 is the superblock, so runs don't wrap) */
+			runlen = 0;
+			continue;
+		}
+		if (runlen == 0) {
+			runstart = b;
+		}
+		runlen++;
+		if (runlen > bestlen) {
+			best = runstart;
+			bestlen = runlen;
+		}
+		if (runlen == want) {
+			break;
+		}
+	}
+
+	KASSERT(bestlen > 0);
+
+	for (n = 0; n < bestlen; n++) {
+		bitmap_mark(sfs->sfs_freemap, best + n);
+	}
+	sfs->sfs_nfree -= bestlen;
+	sfs->sfs_nreserved -= bestlen;
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+
+	*start = best;
+	*got = bestlen;
 }
 
 /*
@@ -124,17 +260,179 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Allocate an indirect block for SV. If the vnode set a block aside
+ * for this (see sfs_da_add), use that reservation.
+ */
+static
+int
+sfs_bmeta(struct sfs_vnode *sv, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_dameta == 0) {
+		return sfs_balloc(sfs, diskblock);
+	}
+	/* the reservation is used up even if clearing the block fails */
+	sv->sv_dameta--;
+	return sfs_doballoc(sfs, true, diskblock);
+}
+
+/*
+ * Get entry IDX of indirect block IDBLOCK. If DOALLOC is set and it
+ * is empty, allocate a block for it.
+ */
+static
+int
+sfs_iget(struct sfs_vnode *sv, uint32_t idblock, uint32_t idx, int doalloc,
+	 uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t block;
+	int result;
+
+	KASSERT(idblock != 0);
+	KASSERT(idx < SFS_DBPERIDB);
+
+	result = buf_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = idbuf->b_data;
+
+	block = idptrs[idx];
+	if (block == 0 && doalloc) {
+		result = sfs_bmeta(sv, &block);
+		if (result) {
+			buf_release(idbuf);
+			return result;
+		}
+		idptrs[idx] = block;
+		buf_markdirty(idbuf);
+	}
+	buf_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * Set entry IDX of indirect block IDBLOCK, which must be empty.
+ */
+static
+int
+sfs_iset(struct sfs_vnode *sv, uint32_t idblock, uint32_t idx, uint32_t block)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *idptrs;
+	int result;
+
+	result = buf_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = idbuf->b_data;
+	KASSERT(idptrs[idx] == 0);
+	idptrs[idx] = block;
+	buf_markdirty(idbuf);
+	buf_release(idbuf);
+	return 0;
+}
+
+/*
+ * Get an indirect block number kept in the inode (sfi_indirect or
+ * sfi_dindirect), allocating it if DOALLOC is set and it is missing.
+ */
+static
+int
+sfs_iroot(struct sfs_vnode *sv, uint32_t *slot, int doalloc, uint32_t *ret)
+{
+	uint32_t block;
+	int result;
+
+	if (*slot == 0 && doalloc) {
+		result = sfs_bmeta(sv, &block);
+		if (result) {
+			return result;
+		}
+		*slot = block;
+		sv->sv_dirty = true;
+	}
+	*ret = *slot;
+	return 0;
+}
+
+/*
+ * For a file block past the direct blocks, find the indirect block
+ * that holds its number (*IDBLOCK) and the index in it (*IDOFF).
+ * Missing indirect blocks are allocated if DOALLOC is set; otherwise
+ * *IDBLOCK comes back 0. This reads at most the double indirect
+ * block, so with both levels cached it costs no I/O.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+		  uint32_t *idblock, uint32_t *idoff)
+{
+	uint32_t dblock;
+	int result;
+
+	KASSERT(fileblock >= SFS_NDIRECT);
+
+	/*
+	 * Subtract off the number of direct blocks, so FILEBLOCK is
+	 * now the offset into the indirect block space.
+	 */
+	fileblock -= SFS_NDIRECT;
+
+	if (fileblock < SFS_DBPERIDB) {
+		/* It's in the single indirect block. */
+		*idoff = fileblock;
+		return sfs_iroot(sv, &sv->sv_i.sfi_indirect, doalloc, idblock);
+	}
+
+	/*
+	 * It's under the double indirect block, in indirect block
+	 * number FILEBLOCK / SFS_DBPERIDB.
+	 */
+	fileblock -= SFS_DBPERIDB;
+	if (fileblock >= SFS_DBPERIDB * SFS_DBPERIDB) {
+		/* Too large to handle. */
+		return EFBIG;
+	}
+	*idoff = fileblock % SFS_DBPERIDB;
+
+	result = sfs_iroot(sv, &sv->sv_i.sfi_dindirect, doalloc, &dblock);
+	if (result) {
+		return result;
+	}
+	if (dblock == 0) {
+		*idblock = 0;
+		return 0;
+	}
+	return sfs_iget(sv, dblock, fileblock / SFS_DBPERIDB, doalloc,
+			idblock);
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +444,13 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idblock, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -185,110 +474,419 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 			sv->sv_i.sfi_direct[fileblock] = block;
 			sv->sv_dirty = true;
 		}
-
+	}
+	else {
 		/*
-		 * Hand back the block
+		 * It's not a direct block; find the indirect block
+		 * it's in.
 		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
+		result = sfs_bmap_indirect(sv, fileblock, doalloc,
+					   &idblock, &idoff);
+		if (result) {
+			return result;
+		}
+
+		if (idblock == 0) {
+			/*
+			 * There's no indirect block allocated. We
+			 * weren't asked to allocate anything, so
+			 * pretend it was filled with all zeros.
+			 */
+			KASSERT(!doalloc);
+			block = 0;
+		}
+		else {
+			/* Get (or allocate) the block out of it */
+			result = sfs_iget(sv, idblock, idoff, doalloc, &block);
+			if (result) {
+				return result;
+			}
 		}
-		*diskblock = block;
-		return 0;
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * Hand back the block
 	 */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) "
+		      "marked free\n", block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
 
-	fileblock -= SFS_NDIRECT;
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+/*
+ * A regular file's new blocks are not given disk blocks when they
+ * are written. The data is kept in the vnode's sv_da (with a block
+ * reserved for it, and for any indirect blocks it will need, so
+ * there will be room) until the file is synced, truncated or
+ * reclaimed, or sv_da fills up. Then each run of consecutive file
+ * blocks is allocated as a contiguous run on disk,
+ * following the file's preceding block when possible, and written
+ * out as one batch, which the disk driver merges into one request.
+ *
+ * Directories are small and written a slot at a time; they are
+ * allocated the usual way.
+ */
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
-		return EFBIG;
-	}
+static
+bool
+sfs_delayalloc(struct sfs_vnode *sv)
+{
+	return sv->sv_i.sfi_type == SFS_TYPE_FILE;
+}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+/*
+ * Record DISKBLOCK as the place of file block FILEBLOCK, which must
+ * be unmapped, allocating indirect blocks if needed.
+ */
+static
+int
+sfs_bassign(struct sfs_vnode *sv, uint32_t fileblock, uint32_t diskblock)
+{
+	uint32_t idblock, idoff;
+	int result;
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (fileblock < SFS_NDIRECT) {
+		KASSERT(sv->sv_i.sfi_direct[fileblock] == 0);
+		sv->sv_i.sfi_direct[fileblock] = diskblock;
+		sv->sv_dirty = true;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+
+	result = sfs_bmap_indirect(sv, fileblock, 1, &idblock, &idoff);
+	if (result) {
+		return result;
+	}
+	return sfs_iset(sv, idblock, idoff, diskblock);
+}
+
+/*
+ * Find the delayed block for FILEBLOCK, or NULL.
+ */
+static
+struct sfs_dablock *
+sfs_da_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	unsigned i;
+
+	for (i=0; i<sv->sv_nda; i++) {
+		if (sv->sv_da[i].da_fileblock == fileblock) {
+			return &sv->sv_da[i];
 		}
+	}
+	return NULL;
+}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+/*
+ * Squeeze out entries whose data is gone. Once there are none left,
+ * give back any blocks still set aside for indirect blocks.
+ */
+static
+void
+sfs_da_compact(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	unsigned i, j;
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	for (i=j=0; i<sv->sv_nda; i++) {
+		if (sv->sv_da[i].da_data != NULL) {
+			sv->sv_da[j++] = sv->sv_da[i];
+		}
+	}
+	sv->sv_nda = j;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	if (sv->sv_nda == 0 && sv->sv_dameta > 0) {
+		sfs_bunreserve(sfs, sv->sv_dameta);
+		sv->sv_dameta = 0;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+}
+
+/*
+ * Give delayed blocks I through I+GOT-1, a run of file blocks, the
+ * disk blocks starting at START. On failure the blocks not used are
+ * freed and reserved again, and their entries kept.
+ */
+static
+int
+sfs_da_place(struct sfs_vnode *sv, unsigned i, uint32_t start, uint32_t got)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dablock *da;
+	struct buf *b;
+	uint32_t k;
+	int result = 0;
+
+	for (k=0; k<got; k++) {
+		da = &sv->sv_da[i+k];
+
+		result = buf_get(sfs->sfs_device, start+k, &b);
 		if (result) {
-			return result;
+			break;
+		}
+		memcpy(b->b_data, da->da_data, SFS_BLOCKSIZE);
+		buf_markdirty(b);
+		buf_release(b);
+
+		result = sfs_bassign(sv, da->da_fileblock, start+k);
+		if (result) {
+			break;
 		}
+		kfree(da->da_data);
+		da->da_data = NULL;
+	}
+
+	for (; k<got; k++) {
+		sfs_bfree(sfs, start+k);
+		/* can't fail; we just freed one */
+		sfs_breserve(sfs);
 	}
+	return result;
+}
+
+/*
+ * Allocate and write out all of a vnode's delayed blocks.
+ */
+static
+int
+sfs_da_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, n, goal, prev, start, got;
+	unsigned i;
+	int result = 0;
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	i = 0;
+	while (i < sv->sv_nda && result == 0) {
+		/* Find the run of consecutive file blocks starting here */
+		first = sv->sv_da[i].da_fileblock;
+		for (n=1; i+n < sv->sv_nda &&
+			     sv->sv_da[i+n].da_fileblock == first + n; n++) ;
+
+		/* Put it right after the block before it, if any */
+		goal = 0;
+		if (first > 0) {
+			result = sfs_bmap(sv, first - 1, 0, &prev);
+			if (result) {
+				break;
+			}
+			if (prev != 0) {
+				goal = prev + 1;
+			}
+		}
+
+		/* It may take more than one piece if the disk is fragmented */
+		while (n > 0) {
+			sfs_ballocrun(sfs, goal, n, &start, &got);
+			result = sfs_da_place(sv, i, start, got);
+			if (result) {
+				break;
+			}
+			result = buf_flush(sfs->sfs_device, start, got);
+			if (result) {
+				break;
+			}
+			i += got;
+			n -= got;
+			goal = start + got;
+		}
+	}
+
+	sfs_da_compact(sv);
+	return result;
+}
+
+/*
+ * Throw away delayed blocks at or past file block BLOCKLEN.
+ */
+static
+void
+sfs_da_drop(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	unsigned i, num = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (i=0; i<sv->sv_nda; i++) {
+		if (sv->sv_da[i].da_fileblock >= blocklen) {
+			kfree(sv->sv_da[i].da_data);
+			sv->sv_da[i].da_data = NULL;
+			num++;
+		}
+	}
+	if (num > 0) {
+		sfs_bunreserve(sfs, num);
+	}
+	sfs_da_compact(sv);
+}
+
+/*
+ * True if any delayed block lies in file blocks LO through HI-1.
+ */
+static
+bool
+sfs_da_inrange(struct sfs_vnode *sv, uint32_t lo, uint32_t hi)
+{
+	unsigned i;
+
+	for (i=0; i<sv->sv_nda; i++) {
+		if (sv->sv_da[i].da_fileblock >= lo &&
+		    sv->sv_da[i].da_fileblock < hi) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Count the indirect blocks that mapping FILEBLOCK will have to
+ * allocate and that no other delayed block has already reserved.
+ */
+static
+int
+sfs_da_metaneed(struct sfs_vnode *sv, uint32_t fileblock, unsigned *ret)
+{
+	uint32_t ibase, dbase, group, idblock;
+	int result;
+
+	*ret = 0;
+	if (fileblock < SFS_NDIRECT) {
+		return 0;
+	}
+
+	ibase = SFS_NDIRECT;
+	dbase = ibase + SFS_DBPERIDB;
+	if (fileblock < dbase) {
+		if (sv->sv_i.sfi_indirect == 0 &&
+		    !sfs_da_inrange(sv, ibase, dbase)) {
+			*ret = 1;
+		}
+		return 0;
+	}
+
+	/* The double indirect block itself */
+	if (sv->sv_i.sfi_dindirect == 0 &&
+	    !sfs_da_inrange(sv, dbase, SFS_MAXFILEBLOCKS)) {
+		(*ret)++;
+	}
+
+	/* and the indirect block under it */
+	group = (fileblock - dbase) / SFS_DBPERIDB;
+	if (!sfs_da_inrange(sv, dbase + group * SFS_DBPERIDB,
+			    dbase + (group + 1) * SFS_DBPERIDB)) {
+		idblock = 0;
+		if (sv->sv_i.sfi_dindirect != 0) {
+			result = sfs_iget(sv, sv->sv_i.sfi_dindirect, group,
+					  0, &idblock);
+			if (result) {
+				return result;
+			}
+		}
+		if (idblock == 0) {
+			(*ret)++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Get a new, zeroed delayed block for FILEBLOCK, which must not be
+ * mapped or already delayed.
+ */
+static
+int
+sfs_da_add(struct sfs_vnode *sv, uint32_t fileblock, struct sfs_dablock **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	void *data;
+	unsigned i, nmeta;
+	int result;
+
+	if (sv->sv_nda == SFS_DAMAX) {
+		result = sfs_da_flush(sv);
 		if (result) {
 			return result;
 		}
+	}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+	result = sfs_breserve(sfs);
+	if (result) {
+		return result;
+	}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+	/* make sure there will be room for its indirect blocks too */
+	result = sfs_da_metaneed(sv, fileblock, &nmeta);
+	if (result) {
+		sfs_bunreserve(sfs, 1);
+		return result;
+	}
+	for (i=0; i<nmeta; i++) {
+		result = sfs_breserve(sfs);
 		if (result) {
+			sfs_bunreserve(sfs, 1 + i);
 			return result;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
+	data = kmalloc(SFS_BLOCKSIZE);
+	if (data == NULL) {
+		sfs_bunreserve(sfs, 1 + nmeta);
+		return ENOMEM;
 	}
-	*diskblock = block;
+	bzero(data, SFS_BLOCKSIZE);
+	sv->sv_dameta += nmeta;
+
+	/* keep them sorted */
+	for (i = sv->sv_nda; i > 0 && sv->sv_da[i-1].da_fileblock > fileblock;
+	     i--) {
+		sv->sv_da[i] = sv->sv_da[i-1];
+	}
+	sv->sv_da[i].da_fileblock = fileblock;
+	sv->sv_da[i].da_data = data;
+	sv->sv_nda++;
+
+	*ret = &sv->sv_da[i];
 	return 0;
 }
 
+/*
+ * Do I/O to part of an unmapped block of a file that uses delayed
+ * allocation: it is either a delayed block or a hole.
+ */
+static
+int
+sfs_da_io(struct sfs_vnode *sv, struct uio *uio,
+	  uint32_t skipstart, uint32_t len)
+{
+	struct sfs_dablock *da;
+	int result;
+
+	da = sfs_da_find(sv, uio->uio_offset / SFS_BLOCKSIZE);
+	if (uio->uio_rw == UIO_READ) {
+		if (da == NULL) {
+			return uiomovezeros(len, uio);
+		}
+		return uiomove((char *)da->da_data + skipstart, len, uio);
+	}
+
+	if (da == NULL) {
+		result = sfs_da_add(sv, uio->uio_offset / SFS_BLOCKSIZE, &da);
+		if (result) {
+			return result;
+		}
+	}
+	return uiomove((char *)da->da_data + skipstart, len, uio);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -308,22 +906,14 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	
 	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
+	int doalloc = (uio->uio_rw==UIO_WRITE) && !sfs_delayalloc(sv);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
@@ -336,43 +926,37 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		return result;
 	}
 
+	if (diskblock == 0 && sfs_delayalloc(sv)) {
+		return sfs_da_io(sv, uio, skipstart, len);
+	}
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buf_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * Even a failed write may have changed part of it.
 	 */
+	result = uiomove((char *)iobuf->b_data + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buf_markdirty(iobuf);
 	}
+	buf_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -386,11 +970,8 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	struct buf *iobuf;
+	int doalloc = (uio->uio_rw==UIO_WRITE) && !sfs_delayalloc(sv);
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -401,6 +982,9 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return result;
 	}
 
+	if (diskblock == 0 && sfs_delayalloc(sv)) {
+		return sfs_da_io(sv, uio, 0, SFS_BLOCKSIZE);
+	}
 	if (diskblock == 0) {
 		/*
 		 * No block - fill with zeros.
@@ -412,30 +996,30 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buf_read(sfs->sfs_device, diskblock, &iobuf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(iobuf->b_data, SFS_BLOCKSIZE, uio);
+		buf_release(iobuf);
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * A whole-block write needs no read first. If the copy fails
+	 * part way, keep the buffer only if it already held the old
+	 * contents; otherwise releasing it unfilled discards it.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(iobuf->b_data, SFS_BLOCKSIZE, uio);
+	if (result == 0 || (iobuf->b_flags & B_VALID)) {
+		buf_markdirty(iobuf);
+	}
+	buf_release(iobuf);
 
 	return result;
 }
@@ -541,6 +1125,127 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Read-ahead.
+ *
+ * Reads that pick up in the block where the previous read left off,
+ * or the block after it, are sequential. While a file is being read
+ * sequentially we keep the next SV_RAWINDOW blocks being read into
+ * the buffer cache in the background, doubling the window on each
+ * sequential read up to SFS_RAMAX; any other read turns it off.
+ *
+ * Mapping a block past the direct blocks needs the indirect blocks
+ * above it. If one isn't cached yet we read it ahead instead and
+ * stop there, rather than wait for it; the next read carries on.
+ *
+ * This is tracked per vnode, since that's all VOP_READ sees. Two
+ * processes streaming the same file in step still look sequential.
+ */
+
+#define SFS_RAMIN	4	/* initial window, in blocks */
+#define SFS_RAMAX	32	/* largest window */
+
+/*
+ * Check that mapping FILEBLOCK won't have to wait for an indirect
+ * block. If it would, start reading that block and return false.
+ */
+static
+bool
+sfs_ra_mapready(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t dbase = SFS_NDIRECT + SFS_DBPERIDB;
+	uint32_t idblock, dblock;
+
+	if (fileblock < SFS_NDIRECT) {
+		return true;
+	}
+	if (fileblock < dbase) {
+		idblock = sv->sv_i.sfi_indirect;
+	}
+	else {
+		dblock = sv->sv_i.sfi_dindirect;
+		if (dblock == 0 || fileblock >= SFS_MAXFILEBLOCKS) {
+			return true;
+		}
+		if (!buf_incore(sfs->sfs_device, dblock)) {
+			buf_readahead(sfs->sfs_device, dblock);
+			return false;
+		}
+		if (sfs_iget(sv, dblock, (fileblock - dbase) / SFS_DBPERIDB,
+			     0, &idblock)) {
+			return false;
+		}
+	}
+	if (idblock != 0 && !buf_incore(sfs->sfs_device, idblock)) {
+		buf_readahead(sfs->sfs_device, idblock);
+		return false;
+	}
+	return true;
+}
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, last, fileblock, limit, nblocks;
+	uint32_t diskblock;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (endpos <= startpos) {
+		return;
+	}
+	first = startpos / SFS_BLOCKSIZE;
+	last = (endpos - 1) / SFS_BLOCKSIZE;
+
+	if (startpos != 0 &&
+	    (first == sv->sv_ralast || first == sv->sv_ralast + 1)) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_ranext = 0;
+	}
+	sv->sv_ralast = last;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	/* Blocks up to LIMIT, but not past the end of the file. */
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	limit = last + 1 + sv->sv_rawindow;
+	if (limit > nblocks) {
+		limit = nblocks;
+	}
+
+	fileblock = last + 1;
+	if (fileblock < sv->sv_ranext) {
+		/* these were started by an earlier read */
+		fileblock = sv->sv_ranext;
+	}
+
+	for (; fileblock < limit; fileblock++) {
+		if (!sfs_ra_mapready(sv, fileblock)) {
+			break;
+		}
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buf_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	sv->sv_ranext = fileblock;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
@@ -633,15 +1338,90 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 		      sv->sv_ino, size);
 	}
 
-	return size / sizeof(struct sfs_dir);
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+
+/*
+ * Throw away a directory's index, e.g. because it could not be
+ * updated. It will be rebuilt on the next lookup.
+ */
+static
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_destroy(sv->sv_dirindex);
+		sv->sv_dirindex = NULL;
+	}
+}
+
+/*
+ * Build the in-memory index of a directory, reading it a block at a
+ * time.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_dir sds[SFS_BLOCKSIZE / sizeof(struct sfs_dir)];
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	struct sfs_dirindex *di;
+	struct iovec iov;
+	struct uio ku;
+	int nentries = sfs_dir_nentries(sv);
+	int i, j, n, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = sfs_dirindex_create();
+	if (di == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<nentries; i+=n) {
+		n = nentries - i;
+		if (n > perblock) {
+			n = perblock;
+		}
+		uio_kinit(&iov, &ku, sds, n * sizeof(struct sfs_dir),
+			  i * sizeof(struct sfs_dir), UIO_READ);
+		result = sfs_io(sv, &ku);
+		if (result) {
+			sfs_dirindex_destroy(di);
+			return result;
+		}
+		if (ku.uio_resid > 0) {
+			panic("sfs: buildindex: Short read (inode %u)\n",
+			      sv->sv_ino);
+		}
+
+		for (j=0; j<n; j++) {
+			if (sds[j].sfd_ino == SFS_NOINO) {
+				result = sfs_dirindex_addfree(di, i+j);
+			}
+			else {
+				/* Ensure null termination, just in case */
+				sds[j].sfd_name[sizeof(sds[j].sfd_name)-1] = 0;
+				result = sfs_dirindex_add(di, sds[j].sfd_name,
+							  sds[j].sfd_ino, i+j);
+			}
+			if (result) {
+				sfs_dirindex_destroy(di);
+				return result;
+			}
+		}
+	}
+
+	sv->sv_dirindex = di;
+	return 0;
 }
 
-/*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
- */
-
 static
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -652,6 +1432,26 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirindex == NULL) {
+		/* If there's no memory for an index, scan the slots */
+		result = sfs_dir_buildindex(sv);
+		if (result && result != ENOMEM) {
+			return result;
+		}
+	}
+
+	if (sv->sv_dirindex != NULL) {
+		if (emptyslot != NULL) {
+			i = sfs_dirindex_getfree(sv->sv_dirindex);
+			if (i >= 0) {
+				*emptyslot = i;
+			}
+		}
+		return sfs_dirindex_find(sv->sv_dirindex, name, ino, slot);
+	}
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -697,6 +1497,7 @@ int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
+	bool reused;
 	int result;
 	struct sfs_dir sd;
 
@@ -714,7 +1515,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* If we didn't get an empty slot, add the entry at the end. */
-	if (emptyslot < 0) {
+	reused = (emptyslot >= 0);
+	if (!reused) {
 		emptyslot = sfs_dir_nentries(sv);
 	}
 
@@ -729,8 +1531,25 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+
+	/* Keep the index up to date, or throw it away. */
+	if (sv->sv_dirindex != NULL) {
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		if (reused) {
+			KASSERT(sfs_dirindex_getfree(sv->sv_dirindex)
+				== emptyslot);
+			sfs_dirindex_usefree(sv->sv_dirindex);
+		}
+		if (sfs_dirindex_add(sv->sv_dirindex, name, ino, emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+
+	return result;
 }
 
 /*
@@ -740,14 +1559,39 @@ static
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_dir sd;
+	struct sfs_dir sd, old;
+	int result;
+
+	/* If indexed, we need the old name to take it out */
+	if (sv->sv_dirindex != NULL) {
+		result = sfs_readdir(sv, &old, slot);
+		if (result) {
+			return result;
+		}
+		KASSERT(old.sfd_ino != SFS_NOINO);
+		old.sfd_name[sizeof(old.sfd_name)-1] = 0;
+	}
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+
+	/* Keep the index up to date, or throw it away. */
+	if (sv->sv_dirindex != NULL) {
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		sfs_dirindex_remove(sv->sv_dirindex, old.sfd_name);
+		if (sfs_dirindex_addfree(sv->sv_dirindex, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+
+	return result;
 }
 
 /*
@@ -764,6 +1608,8 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 	uint32_t ino;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
 	if (result) {
 		return result;
@@ -890,69 +1736,89 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * The inode and data go to disk without the vnode table lock,
+	 * so sfs_loadvnode and sfs_sync may pick the vnode up again
+	 * meanwhile. So once the I/O is done, look again under the
+	 * table lock; we're finished only when nobody else has a
+	 * reference and there's nothing more to write.
 	 */
-	if (v->vn_refcount != 1) {
+	lock_acquire(sfs->sfs_vnlock);
+	while (1) {
+		/*
+		 * Make sure someone else hasn't picked up the vnode
+		 * since the decision was made to reclaim it.
+		 */
+		spinlock_acquire(&v->vn_countlock);
+		if (v->vn_refcount != 1) {
 
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
+			/* consume the reference VOP_DECREF gave us */
+			KASSERT(v->vn_refcount>1);
+			v->vn_refcount--;
 
-		vfs_biglock_release();
-		return EBUSY;
-	}
+			spinlock_release(&v->vn_countlock);
+			lock_release(sfs->sfs_vnlock);
+			return EBUSY;
+		}
+		spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		/* No one else can reach it now, so this doesn't wait. */
+		lock_acquire(sv->sv_lock);
+		if (sv->sv_nda == 0 && !sv->sv_dirty &&
+		    (sv->sv_i.sfi_linkcount > 0 || sv->sv_i.sfi_size == 0)) {
+			break;
+		}
+		lock_release(sfs->sfs_vnlock);
+
+		/*
+		 * If there are no on-disk references to the file
+		 * either, erase it.
+		 */
+		if (sv->sv_i.sfi_linkcount==0) {
+			result = sfs_dotruncate(sv, 0);
+			if (result) {
+				lock_release(sv->sv_lock);
+				return result;
+			}
+		}
+
+		/* Give any delayed blocks a home */
+		result = sfs_da_flush(sv);
+		if (result == 0) {
+			/* Sync the inode to disk */
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-	}
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+		lock_acquire(sfs->sfs_vnlock);
 	}
+	KASSERT(sv->sv_nda == 0 && sv->sv_dameta == 0);
+	lock_release(sv->sv_lock);
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
-	/* If there are no on-disk references, discard the inode */
+	/*
+	 * If there are no on-disk references, discard the inode. Only
+	 * now, so that whoever gets the block next can't find us in the
+	 * table.
+	 */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
-
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
+	sfs_dir_dropindex(sv);
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -967,13 +1833,17 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t startpos = uio->uio_offset;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0) {
+		sfs_readahead(sv, startpos, uio->uio_offset);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1860,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1015,6 +1885,20 @@ sfs_ioctl(struct vnode *v, int op, userptr_t data)
 	return EINVAL;
 }
 
+/*
+ * Called for poll(). Files and directories are always ready.
+ */
+static
+int
+sfs_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	(void)v;
+	(void)pw;
+
+	*revents = events & (POLLIN | POLLRDNORM | POLLOUT);
+	return 0;
+}
+
 /*
  * Called for stat/fstat/lstat.
  */
@@ -1033,7 +1917,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1939,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once loaded, so needs no lock. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1092,20 +1975,135 @@ sfs_tryseek(struct vnode *v, off_t pos)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Allocate a vnode's delayed blocks and write its inode into the
+ * buffer cache, without forcing anything to disk. sfs_sync does this
+ * for every vnode and then writes back the whole cache at once.
+ */
+int
+sfs_syncvnode(struct sfs_vnode *sv)
+{
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_da_flush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	return result;
+}
+
+/*
+ * A run of consecutive disk blocks for sfs_fsync to write back.
+ */
+struct sfs_flushrun {
+	struct sfs_fs *fr_sfs;
+	uint32_t fr_start;
+	uint32_t fr_len;
+};
+
+/*
+ * Add BLOCK to RUN, writing back what's in the run if BLOCK doesn't
+ * extend it. Block 0 means a hole and is skipped.
+ */
+static
+int
+sfs_flushrun_add(struct sfs_flushrun *run, uint32_t block)
+{
+	int result;
+
+	if (block == 0) {
+		return 0;
+	}
+	if (run->fr_len > 0 && block == run->fr_start + run->fr_len) {
+		run->fr_len++;
+		return 0;
+	}
+	if (run->fr_len > 0) {
+		result = buf_flush(run->fr_sfs->sfs_device,
+				   run->fr_start, run->fr_len);
+		if (result) {
+			return result;
+		}
+	}
+	run->fr_start = block;
+	run->fr_len = 1;
+	return 0;
+}
+
+/*
+ * Add indirect block IDBLOCK of depth DEPTH, and everything under it,
+ * to RUN. The block numbers are copied out first, because buf_flush
+ * waits for busy buffers and would wait for ours.
+ */
+static
+int
+sfs_flushindirect(struct sfs_flushrun *run, uint32_t idblock, int depth)
+{
+	uint32_t *idptrs;
+	uint32_t j;
+	int result;
+
+	result = sfs_flushrun_add(run, idblock);
+	if (result) {
+		return result;
+	}
+
+	idptrs = kmalloc(SFS_BLOCKSIZE);
+	if (idptrs == NULL) {
+		return ENOMEM;
+	}
+	result = sfs_rblock(run->fr_sfs, idptrs, idblock);
+	for (j=0; j<SFS_DBPERIDB && result == 0; j++) {
+		if (depth > 1 && idptrs[j] != 0) {
+			result = sfs_flushindirect(run, idptrs[j], depth-1);
+		}
+		else {
+			result = sfs_flushrun_add(run, idptrs[j]);
+		}
+	}
+	kfree(idptrs);
+	return result;
+}
+
+/*
+ * Called for fsync(). Writes back this file's own blocks only: the
+ * inode, the data, and the indirect blocks.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_flushrun run;
+	unsigned i;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	result = sfs_syncvnode(sv);
+	if (result) {
+		return result;
+	}
+
+	run.fr_sfs = v->vn_fs->fs_data;
+	run.fr_start = 0;
+	run.fr_len = 0;
 
+	lock_acquire(sv->sv_lock);
+	result = sfs_flushrun_add(&run, sv->sv_ino);
+	for (i=0; i<SFS_NDIRECT && result == 0; i++) {
+		result = sfs_flushrun_add(&run, sv->sv_i.sfi_direct[i]);
+	}
+	if (result == 0 && sv->sv_i.sfi_indirect != 0) {
+		result = sfs_flushindirect(&run, sv->sv_i.sfi_indirect, 1);
+	}
+	if (result == 0 && sv->sv_i.sfi_dindirect != 0) {
+		result = sfs_flushindirect(&run, sv->sv_i.sfi_dindirect, 2);
+	}
+	if (result == 0 && run.fr_len > 0) {
+		result = buf_flush(run.fr_sfs->sfs_device,
+				   run.fr_start, run.fr_len);
+	}
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1121,35 +2119,93 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks at or past file block BLOCKLEN that are mapped
+ * through indirect block IDBLOCK, which maps file blocks starting at
+ * BASEBLOCK. DEPTH is 1 for an indirect block and 2 for a double
+ * indirect block. Sets *ISEMPTY if IDBLOCK maps nothing afterwards.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_itrunc(struct sfs_vnode *sv, uint32_t idblock, int depth,
+	   uint32_t baseblock, uint32_t blocklen, bool *isempty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t j, span, entrybase;
+	bool hasnonzero, iddirty, childempty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	/* File blocks mapped by each entry */
+	span = (depth == 1) ? 1 : SFS_DBPERIDB;
+
+	result = buf_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = idbuf->b_data;
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = baseblock + j*span;
+		if (idptrs[j] != 0 && entrybase + span > blocklen) {
+			/* At least part of this entry is past the new EOF */
+			if (depth > 1) {
+				result = sfs_itrunc(sv, idptrs[j], depth-1,
+						    entrybase, blocklen,
+						    &childempty);
+				if (result) {
+					buf_release(idbuf);
+					return result;
+				}
+			}
+			else {
+				childempty = true;
+			}
+			if (childempty) {
+				sfs_bfree(sfs, idptrs[j]);
+				idptrs[j] = 0;
+				iddirty = true;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptrs[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		buf_markdirty(idbuf);
+	}
+	buf_release(idbuf);
+
+	*isempty = !hasnonzero;
+	return 0;
+}
+
+/*
+ * Truncate a file; the vnode must be locked.
+ * Used by ftruncate() and sfs_reclaim.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block;
+	uint32_t ibase, dbase;
+	bool isempty;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Blocks that never made it to disk just go away. */
+	sfs_da_drop(sv, blocklen);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,53 +2220,37 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	/*
+	 * Then the blocks under the indirect block, and those under
+	 * the double indirect block, freeing either if it ends up
+	 * empty.
+	 */
+	ibase = SFS_NDIRECT;
+	dbase = ibase + SFS_DBPERIDB;
 
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+	if (sv->sv_i.sfi_indirect != 0 && blocklen < dbase) {
+		result = sfs_itrunc(sv, sv->sv_i.sfi_indirect, 1, ibase,
+				    blocklen, &isempty);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
+		if (isempty) {
+			sfs_bfree(sfs, sv->sv_i.sfi_indirect);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+	}
+
+	if (sv->sv_i.sfi_dindirect != 0 && blocklen < SFS_MAXFILEBLOCKS) {
+		result = sfs_itrunc(sv, sv->sv_i.sfi_dindirect, 2, dbase,
+				    blocklen, &isempty);
+		if (result) {
+			return result;
+		}
+		if (isempty) {
+			sfs_bfree(sfs, sv->sv_i.sfi_dindirect);
+			sv->sv_i.sfi_dindirect = 0;
+			sv->sv_dirty = true;
 		}
 	}
 
@@ -1220,10 +2260,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +2315,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2334,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2356,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +2389,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	if (f != sv) {
+		lock_acquire(f->sv_lock);
+	}
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	if (f != sv) {
+		lock_release(f->sv_lock);
+	}
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +2424,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2437,22 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		if (victim != sv) {
+			lock_acquire(victim->sv_lock);
+		}
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		if (victim != sv) {
+			lock_release(victim->sv_lock);
+		}
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,15 +2472,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +2501,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +2516,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +2540,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2564,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* sfi_type doesn't change, and we don't read the directory */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2577,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2594,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1587,6 +2658,7 @@ static const struct vnode_ops sfs_fileops = {
 	NOTDIR,  /* getdirentry */
 	sfs_write,
 	sfs_ioctl,
+	sfs_poll,
 	sfs_stat,
 	sfs_gettype,
 	sfs_tryseek,
@@ -1622,6 +2694,7 @@ static const struct vnode_ops sfs_dirops = {
 	UNIMP,   /* getdirentry */
 	ISDIR,   /* write */
 	sfs_ioctl,
+	sfs_poll,
 	sfs_stat,
 	sfs_gettype,
 	UNIMP,   /* tryseek */
@@ -1651,45 +2724,51 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
-	struct sfs_vnode *sv;
+	struct sfs_vnode *sv, *found;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned removed;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+ again:
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	found = sfs_vnhash_find(sfs, ino);
+	if (found != NULL) {
 		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
+		if (!sfs_bused(sfs, found->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
+			      found->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&found->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = found;
+		return 0;
 	}
 
-	/* Didn't have it loaded; load it */
+	/*
+	 * Didn't have it loaded; load it. Don't hold up the whole
+	 * table while we read the inode; instead, note how many vnodes
+	 * have left the table, and check again afterwards.
+	 */
+	removed = sfs->sfs_vnremoved;
+	lock_release(sfs->sfs_vnlock);
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
 		return ENOMEM;
 	}
 
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
+
 	/* Must be in an allocated block */
 	if (!sfs_bused(sfs, ino)) {
 		panic("sfs: Tried to load inode %u from unallocated block\n",
@@ -1699,12 +2778,23 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
-	/* Not dirty yet */
+	/* Not dirty yet, and not indexed yet if a directory */
 	sv->sv_dirty = false;
+	sv->sv_dirindex = NULL;
+
+	/* No reads yet */
+	sv->sv_ralast = 0;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+
+	/* Nothing written yet */
+	sv->sv_nda = 0;
+	sv->sv_dameta = 0;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -1736,6 +2826,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
@@ -1743,14 +2834,27 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
+	/*
+	 * While we were reading, someone else may have loaded the
+	 * inode too, and maybe changed it and reclaimed it again, in
+	 * which case what we read may be stale. Either way, throw ours
+	 * away and start over.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_vnremoved != removed ||
+	    sfs_vnhash_find(sfs, ino) != NULL) {
+		lock_release(sfs->sfs_vnlock);
 		VOP_CLEANUP(&sv->sv_v);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
-		return result;
+		goto again;
 	}
 
+	/* Add it to our table */
+	sfs_vnhash_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +2871,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
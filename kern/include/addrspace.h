@@ -36,10 +36,19 @@
 
 
 #include <vm.h>
+#include "opt-A2.h"
 #include "opt-A3.h"
+#if OPT_A2
+#include <spinlock.h>
+#endif
 
 struct vnode;
 
+#if OPT_A2
+/* Most stacks for additional user threads in one address space */
+#define AS_MAXTSTACKS 16
+#endif
+
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -59,6 +68,11 @@ struct addrspace {
   #if OPT_A3
   bool is_load_elf_done;
   #endif
+  #if OPT_A2
+  struct spinlock as_tslock;  /* protects as_tsused */
+  uint32_t as_tsused;         /* bitmap of thread stack slots in use */
+  paddr_t as_tspbase[AS_MAXTSTACKS]; /* 0 until the slot is first used */
+  #endif
 };
 
 /*
@@ -95,6 +109,16 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_threadstack - set up a stack for another user thread.
+ *                Hands back the slot it occupies and its initial
+ *                stack pointer.
+ *
+ *    as_release_threadstack - the thread using a stack slot is gone;
+ *                the slot may be handed out again.
+ *
+ *    as_claim_threadstack - mark a slot that as_copy copied as in use,
+ *                for a thread that starts out running on it.
  */
 
 struct addrspace *as_create(void);
@@ -111,6 +135,15 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A2
+int               as_define_threadstack(struct addrspace *as,
+                                        unsigned *slot,
+                                        vaddr_t *initstackptr);
+void              as_release_threadstack(struct addrspace *as,
+                                         unsigned slot);
+void              as_claim_threadstack(struct addrspace *as,
+                                       unsigned slot);
+#endif
 
 
 /*
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ARGBUF_H_
+#define _ARGBUF_H_
+
+/*
+ * Argument vectors for exec.
+ *
+ * An argbuf holds a program's arguments in one kernel buffer, laid
+ * out the way they will appear on the new program's stack: argc+1
+ * pointers (the last NULL) followed by the strings. The pointers are
+ * filled in only by argbuf_copyout, once the destination is known.
+ *
+ * Functions:
+ *     argbuf_init       - initialize an empty argbuf.
+ *     argbuf_cleanup    - free the buffer.
+ *     argbuf_copyin     - collect the NULL-terminated argv array at
+ *                         UARGV in user space. Fails with E2BIG if
+ *                         the pointers and strings together exceed
+ *                         ARG_MAX, or EFAULT on a bad pointer.
+ *     argbuf_fromkernel - same, from a kernel argv of ARGC strings.
+ *     argbuf_copyout    - copy the block to the top of the user stack
+ *                         at *STACKPTR with a single copyout, and
+ *                         update *STACKPTR to its (8-aligned) start,
+ *                         which is also the user address of argv.
+ */
+
+struct argbuf {
+	char *ab_buf;		/* pointer slots, then the strings */
+	size_t ab_size;		/* allocated size of ab_buf */
+	size_t ab_strlen;	/* bytes of strings, including NULs */
+	int ab_argc;
+};
+
+void argbuf_init(struct argbuf *ab);
+void argbuf_cleanup(struct argbuf *ab);
+int argbuf_copyin(struct argbuf *ab, userptr_t uargv);
+int argbuf_fromkernel(struct argbuf *ab, int argc, char **argv);
+int argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr);
+
+
+#endif /* _ARGBUF_H_ */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BIO_H_
+#define _BIO_H_
+
+/*
+ * Block I/O requests.
+ *
+ * A device with a d_strategy function queues requests and runs them
+ * asynchronously, in whatever order it likes. bio_start submits a
+ * request and returns at once; when the transfer finishes the driver
+ * calls bio_complete, which marks the request done, wakes anyone in
+ * bio_wait, and then runs the optional bio_done callback. bio_done is
+ * usually called from an interrupt handler and must not sleep. A bio
+ * with a callback must not be reused until the callback says so, even
+ * if bio_wait has already returned.
+ *
+ * For devices without d_strategy, bio_start does the transfer with
+ * d_io before returning.
+ *
+ * The data buffer is in kernel space and holds bio_nblocks device
+ * blocks. The bio must stay put until it is complete.
+ */
+
+#include <uio.h>	/* for enum uio_rw */
+
+struct device;
+
+struct bio {
+	uint32_t bio_block;		/* first block on the device */
+	uint32_t bio_nblocks;		/* number of blocks */
+	void *bio_data;			/* kernel buffer */
+	enum uio_rw bio_rw;		/* UIO_READ or UIO_WRITE */
+	void (*bio_done)(struct bio *);	/* completion callback, or NULL */
+	void *bio_arg;			/* for bio_done */
+	int bio_result;			/* errno, valid once complete */
+
+	/* for the driver's request queue */
+	struct bio *bio_qnext;		/* next request in the queue */
+	struct bio *bio_runnext;	/* next request merged with this one */
+	uint32_t bio_runend;		/* block after the merged run */
+
+	/* for bio_complete/bio_wait */
+	volatile bool bio_isdone;
+};
+
+/* Call once during system startup. */
+void bio_bootstrap(void);
+
+/* Submit a request. Returns an error if it could not be queued. */
+int bio_start(struct device *dev, struct bio *bio);
+
+/* Called by drivers when a request has finished. */
+void bio_complete(struct bio *bio, int result);
+
+/* Wait for a started request and return its result. */
+int bio_wait(struct bio *bio);
+
+/* bio_start plus bio_wait. */
+int bio_io(struct device *dev, struct bio *bio);
+
+
+#endif /* _BIO_H_ */
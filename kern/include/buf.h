@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * A fixed pool of one-block buffers, hashed by (device, block) and
+ * recycled in least-recently-used order. Filesystems get a buffer
+ * with buf_read or buf_get, which hand it back busy (no one else can
+ * touch it) until buf_release. Modified buffers are marked dirty and
+ * written back when evicted or by buf_sync.
+ *
+ * Only devices with BUF_SIZE-byte blocks may be cached.
+ */
+
+#include <bio.h>
+
+struct device;
+
+#define BUF_SIZE	512	/* bytes per buffer; the disk block size */
+#define BUF_NBUFS	128	/* buffers in the cache */
+
+struct buf {
+	struct device *b_dev;		/* NULL if unused */
+	uint32_t b_block;		/* block number on b_dev */
+	void *b_data;			/* BUF_SIZE bytes */
+	unsigned b_flags;		/* B_* below */
+	struct buf *b_hnext;		/* hash chain */
+	struct buf *b_lrunext;		/* LRU list, newest last */
+	struct buf *b_lruprev;
+	struct bio b_bio;		/* for I/O on the buffer */
+	struct buf *b_ranext;		/* finished read-ahead list */
+};
+
+#define B_VALID		0x1	/* b_data holds the block's contents */
+#define B_DIRTY		0x2	/* b_data is newer than the disk */
+#define B_BUSY		0x4	/* handed out; see buf_release */
+#define B_WRITING	0x8	/* busy in buf_sync's write batch */
+#define B_READAHEAD	0x10	/* busy being read in the background */
+
+/* Call once during system startup to allocate the buffers. */
+void buf_bootstrap(void);
+
+/* Get block BLOCK of DEV, reading it in if it is not cached. */
+int buf_read(struct device *dev, uint32_t block, struct buf **ret);
+
+/*
+ * Get block BLOCK of DEV without reading it. Unless B_VALID is set
+ * the contents are garbage, and the caller must fill in the whole
+ * block before marking it dirty.
+ */
+int buf_get(struct device *dev, uint32_t block, struct buf **ret);
+
+/*
+ * Start reading block BLOCK of DEV into the cache in the background,
+ * unless it is already cached or there is no clean buffer to spare.
+ * Never sleeps waiting for the disk.
+ */
+void buf_readahead(struct device *dev, uint32_t block);
+
+/* True if block BLOCK of DEV is cached and can be had without I/O. */
+bool buf_incore(struct device *dev, uint32_t block);
+
+/* The caller has modified the buffer (and it is now all valid). */
+void buf_markdirty(struct buf *b);
+
+/* Done with a buffer from buf_read or buf_get. */
+void buf_release(struct buf *b);
+
+/*
+ * Write back all dirty buffers for DEV. The writes are all queued at
+ * once, so the device can sort and merge them.
+ */
+int buf_sync(struct device *dev);
+
+/* The same, for just NBLOCKS blocks of DEV starting at BLOCK. */
+int buf_flush(struct device *dev, uint32_t block, uint32_t nblocks);
+
+/* Forget everything cached for DEV, which must be synced and idle. */
+void buf_invalidate(struct device *dev);
+
+
+#endif /* _BUF_H_ */
@@ -83,5 +83,12 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+/*
+ * clock_pollregister() registers a pollwaiter to be woken on every
+ * timer tick, so that poll() can notice its timeout expiring.
+ */
+struct pollwaiter;
+int clock_pollregister(struct pollwaiter *pw);
+
 
 #endif /* _CLOCK_H_ */
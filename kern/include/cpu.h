@@ -35,6 +35,7 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct kmalloc_cpucache;	/* private to kmalloc.c */
 
 /*
  * Per-cpu structure
@@ -60,6 +61,7 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct kmalloc_cpucache *c_kmcache; /* kmalloc per-cpu freelists */
 
 	/*
 	 * Accessed by other cpus.
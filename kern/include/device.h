@@ -36,16 +36,24 @@
 
 
 struct uio;  /* in <uio.h> */
+struct pollwaiter;  /* in <poll.h> */
+struct bio;  /* in <bio.h> */
 
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_poll is as for VOP_POLL; if NULL, the device is always ready.
+ * d_strategy queues a block request to run asynchronously (see
+ * <bio.h>); it is NULL for devices that only do synchronous d_io.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_poll)(struct device *, int events, struct pollwaiter *pw,
+		      int *revents);
+	int (*d_strategy)(struct device *, struct bio *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
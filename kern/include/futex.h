@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/*
+ * Futexes: user-space words that threads can sleep on.
+ *
+ * A sleeper is keyed by its address space and the user address of
+ * the word, and waits in one of a fixed table of hashed buckets.
+ * User code only calls into the kernel when a lock is contended.
+ */
+
+struct addrspace;
+
+/* Call once during system startup to create the bucket table. */
+void futex_bootstrap(void);
+
+/*
+ * Sleep while *UADDR in AS equals VAL. Returns EAGAIN if it did not,
+ * and EINTR if the process started exiting while we slept.
+ */
+int futex_wait(struct addrspace *as, userptr_t uaddr, int val);
+
+/* Wake up to N sleepers on UADDR in AS; the number woken goes in *NWOKEN. */
+void futex_wake(struct addrspace *as, userptr_t uaddr, int n, int *nwoken);
+
+/* Kick every sleeper in AS, so they notice their process is exiting. */
+void futex_wakeall(struct addrspace *as);
+
+
+#endif /* _FUTEX_H_ */
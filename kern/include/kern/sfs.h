@@ -83,9 +83,23 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_waste[128-4-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/*
+ * The inode has a double indirect block: a block of SFS_DBPERIDB
+ * indirect block numbers, mapping the SFS_DBPERIDB*SFS_DBPERIDB file
+ * blocks after those mapped by sfi_indirect. It was carved out of
+ * sfi_waste, which is zero in older volumes, so they read as having
+ * none.
+ */
+#define HAS_DIDIRECT
+
+/* Largest file, in blocks. */
+#define SFS_MAXFILEBLOCKS \
+	(SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB)
+
 /*
  * On-disk directory entry
  */
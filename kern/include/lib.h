@@ -122,10 +122,24 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kmalloc is a macro that passes the caller's file and line along so
+ * heap tracing can attribute allocations (see kheap_settrace).
+ *
+ * kheap_printstats prints per-size-class usage and fragmentation, plus
+ * per-caller totals when tracing is on; kheap_dumppages prints the
+ * raw state of every heap page. kheap_snapshot and kheap_leakreport
+ * bracket a piece of work to show what it left allocated.
  */
 void *kmalloc(size_t size);
+void *kmalloc_tagged(size_t size, const char *file, int line);
+#define kmalloc(sz) kmalloc_tagged((sz), __FILE__, __LINE__)
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_dumppages(void);
+void kheap_settrace(bool on);
+void kheap_snapshot(void);
+void kheap_leakreport(void);
 
 /*
  * C string functions. 
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _OPENFILE_H_
+#define _OPENFILE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is what open() creates: a vnode plus the state that is
+ * shared by every file descriptor that refers to it (the seek
+ * position and the open mode). Descriptors duplicated by dup2 or
+ * inherited across fork point at the same openfile, which is
+ * reference counted and closed when the last reference goes away.
+ *
+ * The seek position is protected by of_offsetlock, which is held
+ * across the I/O so that concurrent read/write calls on one openfile
+ * each see and advance a consistent offset.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	int of_flags;			/* other open flags (O_APPEND) */
+
+	struct lock *of_offsetlock;
+	off_t of_offset;
+
+	struct spinlock of_reflock;
+	unsigned of_refcount;
+};
+
+/*
+ * openfile_bootstrap - set up the openfile allocator. Called once
+ *                 during system startup.
+ * openfile_open - open PATH with FLAGS and MODE as per open(2), and
+ *                 return a new openfile with one reference. Like
+ *                 vfs_open, may destroy PATH.
+ * openfile_create - make an openfile with one reference for VN, which
+ *                 must already be open (as from vfs_open), using the
+ *                 access mode and flags in FLAGS. On success the
+ *                 openfile takes over the caller's open of VN.
+ * openfile_incref/decref - adjust the reference count; decref closes
+ *                 the file on the last reference.
+ */
+void openfile_bootstrap(void);
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+int openfile_create(struct vnode *vn, int flags, struct openfile **ret);
+void openfile_incref(struct openfile *);
+void openfile_decref(struct openfile *);
+
+/*
+ * Per-process table of descriptors. Slots hold openfile pointers, or
+ * NULL if unused. Each slot holds one reference.
+ *
+ * Functions:
+ *     filetable_create  - create an empty table. Returns NULL on error.
+ *     filetable_copy    - create a table with the same descriptors as
+ *                         another, sharing its openfiles (for fork).
+ *     filetable_destroy - close every descriptor and free the table.
+ *     filetable_get     - look up FD; returns EBADF if not open. On
+ *                         success, the caller gets a reference and
+ *                         must openfile_decref it when done, so a
+ *                         concurrent close can't pull the openfile out
+ *                         from under it.
+ *     filetable_place   - put OF in the lowest free slot and return
+ *                         the descriptor; EMFILE if full. Consumes
+ *                         the caller's reference.
+ *     filetable_placeat - put OF at FD, returning whatever was there
+ *                         before (or NULL) in OLDOF for the caller to
+ *                         decref. Consumes the caller's reference.
+ *     filetable_remove  - clear FD, returning the openfile that was
+ *                         there; EBADF if not open.
+ */
+struct filetable {
+	struct spinlock ft_lock;
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+struct filetable *filetable_create(void);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+void filetable_destroy(struct filetable *);
+int filetable_get(struct filetable *, int fd, struct openfile **ret);
+int filetable_place(struct filetable *, struct openfile *of, int *fd);
+int filetable_placeat(struct filetable *, struct openfile *of, int fd,
+		      struct openfile **oldof);
+int filetable_remove(struct filetable *, int fd, struct openfile **ret);
+
+
+#endif /* _OPENFILE_H_ */
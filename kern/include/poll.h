@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _POLL_H_
+#define _POLL_H_
+
+/*
+ * Waiting for any of several objects to become ready, for poll().
+ *
+ * Each pollable object has a pollqueue. A thread that wants to wait
+ * on several objects makes a pollwaiter and registers it on each of
+ * their queues (normally via VOP_POLL); it then sleeps on the
+ * pollwaiter alone, and is woken by whichever object becomes ready
+ * first, when that object calls pollqueue_wakeup.
+ *
+ * Registration must happen before the waiter checks whether the
+ * object is ready, and the object must update its state before
+ * calling pollqueue_wakeup; then a wakeup can't be missed.
+ *
+ * pollqueue_wakeup may be called from interrupt handlers.
+ */
+
+#include <spinlock.h>
+#include <kern/poll.h>
+
+struct wchan;
+struct pollentry;		/* private to poll.c */
+
+struct pollqueue {
+	struct spinlock pq_lock;
+	struct pollentry *volatile pq_entries;
+};
+
+struct pollwaiter {
+	struct spinlock pw_lock;
+	struct wchan *pw_wchan;
+	bool pw_ready;			/* woken since last pollwaiter_sleep */
+	struct pollentry *pw_entries;	/* our registrations */
+};
+
+/*
+ * Functions:
+ *     pollqueue_init     - initialize an empty queue.
+ *     pollqueue_cleanup  - clean up; no waiters may be registered.
+ *     pollqueue_wakeup   - wake every waiter registered on the queue.
+ *     pollwaiter_init    - initialize a waiter. Returns ENOMEM on error.
+ *     pollwaiter_cleanup - drop all registrations and clean up.
+ *     pollwaiter_register- register the waiter on a queue; it stays
+ *                          registered until pollwaiter_cleanup.
+ *     pollwaiter_sleep   - sleep until woken by any registered queue.
+ *                          Returns at once if a wakeup arrived since
+ *                          the last call.
+ */
+void pollqueue_init(struct pollqueue *pq);
+void pollqueue_cleanup(struct pollqueue *pq);
+void pollqueue_wakeup(struct pollqueue *pq);
+
+int pollwaiter_init(struct pollwaiter *pw);
+void pollwaiter_cleanup(struct pollwaiter *pw);
+int pollwaiter_register(struct pollwaiter *pw, struct pollqueue *pq);
+void pollwaiter_sleep(struct pollwaiter *pw);
+
+
+#endif /* _POLL_H_ */
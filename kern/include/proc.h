@@ -43,16 +43,32 @@
 
 struct addrspace;
 struct vnode;
+struct filetable;
 #ifdef UW
 struct semaphore;
 #endif // UW
 
 #if OPT_A2
-struct child_info { // wrapper struct to store proc, pid, and exitcode
-  pid_t pid;
-  int exitcode;
-  struct proc *proc;
+/* Most user threads a process can create (besides its first) */
+#define PROC_MAXUTHREADS 16
+
+/*
+ * A user thread created with thread_create, kept until it has been
+ * joined. ut_thread is only an identity once ut_exited is set.
+ */
+struct uthread {
+	int ut_tid;			/* 0 if this slot is free */
+	struct thread *ut_thread;	/* the kernel thread running it */
+	bool ut_exited;			/* set by uthread_exit */
+	unsigned ut_stack;		/* its stack slot in the addrspace */
+	userptr_t ut_retval;		/* value passed to thread_exit */
 };
+
+/*
+ * Protects every process's parent, children, p_childindex, p_exited,
+ * and p_exitcode, and is the lock for p_waitcv.
+ */
+extern struct lock *proc_family_lk;
 #endif
 
 /*
@@ -81,11 +97,24 @@ struct proc {
 	/* add more material here as needed */
 #if OPT_A2
   pid_t pid; // pid for process
-  struct proc *parent; // parent process
-  struct array *children; // array of child_info
-  struct trapframe *tf;
-  struct lock *children_lk; // for when children modify the parent
-  struct cv *is_exited; // for when the process calls _exit
+  struct proc *parent; // parent process, or NULL if none (or orphaned)
+  struct array *children; // array of child procs, including zombies
+  unsigned p_childindex; // our index in parent->children
+  bool p_exited; // zombie: exited but not yet waited for
+  int p_exitcode;
+  struct cv *p_waitcv; // parent sleeps here for children to exit
+  bool p_vforked; // vfork child still running in its parent's addrspace
+
+  /* user threads; all protected by p_uthread_lk */
+  struct lock *p_uthread_lk;
+  struct cv *p_uthread_cv; // joiners sleep here
+  struct uthread p_uthreads[PROC_MAXUTHREADS];
+  int p_nexttid;
+  unsigned p_nuthreads; // user threads still running, including the first
+  int p_firststack; // thread stack slot the first thread runs on, or -1
+  volatile bool p_dying; // a thread called _exit; the others must follow
+  int p_dyingcode; // exit code for the process once they have
+  struct filetable *p_filetable; // open file descriptors
 #endif /* OPT _A2 */
 
 };
@@ -102,7 +131,7 @@ extern struct semaphore *no_proc_sem;
 void proc_bootstrap(void);
 
 /* Create a fresh process for use by runprogram(). */
-struct proc *proc_create_runprogram(const char *name);
+int proc_create_runprogram(const char *name, struct proc **ret);
 
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
@@ -113,6 +142,33 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+#if OPT_A2
+/* Look up a process by PID; NULL if none. */
+struct proc *proc_lookup(pid_t pid);
+
+/* Make CHILD a child of PARENT. Call with proc_family_lk held. */
+int proc_addchild(struct proc *parent, struct proc *child);
+
+/*
+ * Called by an exiting process after its last thread has detached:
+ * close its files, reap or orphan its children, and either become a
+ * zombie for its parent to wait for or, with no parent, be destroyed.
+ */
+void proc_exit(struct proc *proc, int exitcode);
+
+/*
+ * Reap a zombie child: detach it from its parent and destroy it,
+ * freeing its PID. Call with proc_family_lk held.
+ */
+void proc_reap(struct proc *child);
+
+/*
+ * A vforked child is done with its parent's address space (it has
+ * exec'd or is exiting): let the parent run again.
+ */
+void proc_vforkdone(struct proc *proc);
+#endif
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
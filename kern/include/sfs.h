@@ -48,11 +48,50 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct sfs_dirindex;
+
+/*
+ * A block of file data that has been written but not yet given a
+ * place on disk (delayed allocation; see sfs_vnode.c). Each vnode
+ * holds up to SFS_DAMAX of these, sorted by file block.
+ */
+struct sfs_dablock {
+	uint32_t da_fileblock;          /* block number within the file */
+	void *da_data;                  /* SFS_BLOCKSIZE bytes */
+};
+
+#define SFS_DAMAX	32
+
+/*
+ * Locking. Each vnode's sv_lock covers its inode and its contents.
+ * sfs_vnlock covers the table of loaded vnodes (sfs_vnhash), and sfs_freemaplock
+ * the free block bitmap, the free block counts and the superblock. Locks are taken in this
+ * order:
+ *
+ *      directory sv_lock
+ *      sfs_vnlock
+ *      file sv_lock
+ *      sfs_freemaplock
+ *
+ * (then the buffer cache's own lock). A file's sfi_linkcount only
+ * changes with both its directory and the file itself locked.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for the rest */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hnext;     /* vnode table chain; sfs_vnlock */
+	struct sfs_dirindex *sv_dirindex; /* directory name index, or NULL */
+	uint32_t sv_ralast;             /* last file block read */
+	uint32_t sv_ranext;             /* first block not yet read ahead */
+	unsigned sv_rawindow;           /* read-ahead blocks; 0 if random */
+	struct sfs_dablock sv_da[SFS_DAMAX]; /* unallocated written blocks */
+	unsigned sv_nda;                /* entries in sv_da */
+	unsigned sv_dameta;             /* blocks reserved for indirect blocks */
 };
 
 struct sfs_fs {
@@ -60,9 +99,16 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded, hashed by ino */
+	unsigned sfs_vnhashsize;        /* buckets in sfs_vnhash */
+	unsigned sfs_nvnodes;           /* vnodes loaded */
+	unsigned sfs_vnremoved;         /* count of vnhash removals */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t sfs_nfree;             /* free blocks; sfs_freemaplock */
+	uint32_t sfs_nreserved;         /* of those, promised to sv_da */
 };
 
 /*
@@ -75,17 +121,34 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
 /* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Push a vnode's delayed blocks and inode into the buffer cache */
+int sfs_syncvnode(struct sfs_vnode *sv);
+
+/* Table of loaded vnodes (sfs_vnhash.c); hold sfs_vnlock */
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
+struct sfs_vnode *sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino);
+void sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv);
+void sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+
+/* Directory name index (sfs_dirindex.c); hold the directory's sv_lock */
+struct sfs_dirindex *sfs_dirindex_create(void);
+void sfs_dirindex_destroy(struct sfs_dirindex *di);
+int sfs_dirindex_find(struct sfs_dirindex *di, const char *name,
+		      uint32_t *ino, int *slot);
+int sfs_dirindex_add(struct sfs_dirindex *di, const char *name,
+		     uint32_t ino, int slot);
+void sfs_dirindex_remove(struct sfs_dirindex *di, const char *name);
+int sfs_dirindex_addfree(struct sfs_dirindex *di, int slot);
+int sfs_dirindex_getfree(struct sfs_dirindex *di);
+void sfs_dirindex_usefree(struct sfs_dirindex *di);
+
 
 #endif /* _SFS_H_ */
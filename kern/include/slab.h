@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches ("slab" allocator), layered on top of kmalloc's page
+ * allocator.
+ *
+ * A cache hands out objects of one fixed size. Objects are carved
+ * out of whole pages (slabs) with no per-object rounding to a
+ * power-of-two size class, and are kept in their constructed state
+ * while free: the constructor runs once when a slab is created and
+ * the destructor once when the slab's page is given back, not on
+ * every alloc/free. Callers must therefore return objects to the
+ * cache in the same state the constructor left them in.
+ *
+ * Functions:
+ *     kmem_cache_create  - create a cache for objects of SIZE bytes.
+ *                          CTOR and DTOR may be NULL. CTOR returns 0
+ *                          or an error code; on error, the slab being
+ *                          built is discarded and the allocation
+ *                          fails. Returns NULL on error.
+ *     kmem_cache_destroy - destroy a cache. All objects must have been
+ *                          freed.
+ *     kmem_cache_alloc   - get a constructed object, or NULL if out of
+ *                          memory.
+ *     kmem_cache_free    - return an object to its cache.
+ *     kmem_cache_reap    - release all completely free slabs back to
+ *                          the page allocator.
+ *
+ * Objects may be at most KMEM_CACHE_MAXOBJ bytes; bigger things
+ * should use kmalloc directly.
+ */
+
+#define KMEM_CACHE_MAXOBJ  512
+
+struct kmem_cache;  /* Opaque. */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *);
+void *kmem_cache_alloc(struct kmem_cache *);
+void kmem_cache_free(struct kmem_cache *, void *obj);
+void kmem_cache_reap(struct kmem_cache *);
+
+
+#endif /* _SLAB_H_ */
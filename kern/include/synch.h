@@ -83,11 +83,14 @@ struct lock {
         // (don't forget to mark things volatile as needed)
 };
 
+void lock_bootstrap(void);
 struct lock *lock_create(const char *name);
 void lock_acquire(struct lock *);
 
 /*
  * Operations:
+ *    lock_bootstrap - Set up the lock allocator; called once at boot,
+ *                   before the first lock_create.
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
  *    lock_release - Free the lock. Only the thread holding the lock may do
@@ -144,4 +147,73 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Counting barrier.
+ *
+ * A barrier is created for a fixed number of threads. Each thread
+ * calls barrier_wait; none of them proceeds until all of them have
+ * arrived. The barrier then resets itself so it can be reused for
+ * the next round.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct barrier {
+        char *b_name;
+        struct wchan *b_wchan;          // queue where threads wait
+        struct spinlock b_lock;         // to synch access to this struct
+        unsigned b_count;               // threads per round
+        volatile unsigned b_arrived;    // threads arrived this round
+        volatile unsigned b_generation; // bumped when a round completes
+};
+
+struct barrier *barrier_create(const char *name, unsigned count);
+void barrier_destroy(struct barrier *);
+
+/*
+ * Operations:
+ *    barrier_wait - Block until COUNT threads (including this one)
+ *                   have called barrier_wait in the current round.
+ *                   Returns true in exactly one thread per round (the
+ *                   last to arrive) and false in all the others, so
+ *                   one thread can be picked to do per-round work.
+ */
+bool barrier_wait(struct barrier *);
+
+
+/*
+ * One-shot completion.
+ *
+ * A completion starts out not done. Any number of threads may wait
+ * for it; once some thread calls complete, all current and future
+ * waiters proceed immediately. It is the cheap way for a parent to
+ * wait for a piece of work handed to another thread, or for many
+ * threads to wait for one initialization step.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct completion {
+        char *c_name;
+        struct wchan *c_wchan;          // queue where threads wait
+        struct spinlock c_lock;         // to synch access to this struct
+        volatile bool c_done;           // set once by complete
+};
+
+struct completion *completion_create(const char *name);
+void completion_destroy(struct completion *);
+
+/*
+ * Operations:
+ *    complete        - Mark the completion done and wake all waiters.
+ *                      May be called from an interrupt handler.
+ *    completion_wait - Block until the completion is done.
+ *    completion_done - Return true if complete has been called;
+ *                      does not block.
+ */
+void complete(struct completion *);
+void completion_wait(struct completion *);
+bool completion_done(struct completion *);
+
+
 #endif /* _SYNCH_H_ */
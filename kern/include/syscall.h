@@ -48,6 +48,11 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+#if OPT_A2
+/* Start a new user thread from a kmalloc'd trapframe, which it frees. */
+void enter_new_thread(struct trapframe *tf);
+#endif
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -65,6 +70,30 @@ int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 #if OPT_A2
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(const_userptr_t progname, userptr_t *args);
+int sys_vfork(struct trapframe *tf, pid_t *retval);
+int sys_spawn(const_userptr_t progname, userptr_t *args, pid_t *retval);
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_readv(int fdesc, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fdesc, const_userptr_t iov, int iovcnt, int *retval);
+int sys_close(int fdesc);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_pipe(userptr_t fds, int *retval);
+int sys_poll(userptr_t fds, unsigned nfds, int timeout, int *retval);
+int sys_thread_create(struct trapframe *tf, userptr_t start, userptr_t func,
+		      userptr_t arg, int *retval);
+int sys_thread_join(int tid, userptr_t retvalp);
+void sys_thread_exit(userptr_t retval);
+int sys_futex(userptr_t uaddr, int op, int val, int *retval);
+/* Exit the current user thread; the last one out exits the process. */
+void uthread_exit(int exitcode);
+/* The thread stack slot curthread runs on, or -1 for the main stack. */
+int uthread_stackslot(void);
+/* curthread, the process's only thread, has exec'd a new image. */
+void uthread_exec(void);
 #endif
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
@@ -62,6 +62,7 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int bartest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -76,11 +77,19 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int cachestress(int, char **);
+int vnodestress(int, char **);
+int dirstress(int, char **);
+int renametest(int, char **);
+int iostress(int, char **);
+int rastress(int, char **);
+int dalloctest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int slabtest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
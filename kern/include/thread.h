@@ -144,6 +144,16 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * The same, but also hand back the new thread in *RET. The caller
+ * must make sure the thread can't exit while the pointer is in use,
+ * e.g. by holding a lock the thread takes on its way out.
+ */
+int thread_fork_ret(const char *name, struct proc *proc,
+                    void (*func)(void *, unsigned long),
+                    void *data1, unsigned long data2,
+                    struct thread **ret);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
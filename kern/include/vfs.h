@@ -174,6 +174,27 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Name cache (vfsdcache.c), used by path lookup.
+ *
+ *    vfs_dcache_lookup     - Look up one name in a directory. True on
+ *                            a hit, with a vnode reference, or NULL
+ *                            if the name is known not to exist.
+ *    vfs_dcache_enter      - Record the outcome of a lookup that
+ *                            missed, using the generation it returned.
+ *    vfs_dcache_invalidate - Call after a name in a directory on FS is
+ *                            created, removed or renamed.
+ *    vfs_dcache_purgefs    - Drop everything for FS (before unmount).
+ */
+
+void vfs_dcache_bootstrap(void);
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret, unsigned *gen);
+void vfs_dcache_enter(struct vnode *dir, const char *name,
+		      struct vnode *vn, unsigned gen);
+void vfs_dcache_invalidate(struct fs *fs, const char *name);
+void vfs_dcache_purgefs(struct fs *fs);
+
 /*
  * Array of vnodes.
  */
@@ -185,8 +206,8 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Lock for the VFS mount table and the boot filesystem vnode; also
+ * used by emufs in place of locking of its own. Recursive.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -30,9 +30,11 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
+struct pollwaiter;
 
 /*
  * A struct vnode is an abstract representation of a file.
@@ -50,8 +52,13 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_countlock protects both counts. Filesystems must take it in
+ * VOP_RECLAIM when checking whether the vnode was picked up again
+ * after the refcount was seen to drop to one.
  */
 struct vnode {
+	struct spinlock vn_countlock;   /* Lock for the counts */
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
 
@@ -120,6 +127,12 @@ struct vnode {
  *                      DATA. The interpretation of the data is specific
  *                      to each ioctl.
  *
+ *    vop_poll        - Check which of the poll events in EVENTS (see
+ *                      kern/poll.h) are currently true of the object,
+ *                      and return them in REVENTS. If PW is not NULL,
+ *                      first register it (see poll.h) so that it is
+ *                      woken when the object's readiness may change.
+ *
  *    vop_stat        - Return info about a file. The pointer is a 
  *                      pointer to struct stat; see kern/stat.h.
  *
@@ -205,6 +218,8 @@ struct vnode_ops {
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
 	int (*vop_ioctl)(struct vnode *object, int op, userptr_t data);
+	int (*vop_poll)(struct vnode *object, int events,
+			struct pollwaiter *pw, int *revents);
 	int (*vop_stat)(struct vnode *object, struct stat *statbuf);
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	int (*vop_tryseek)(struct vnode *object, off_t pos);
@@ -250,6 +265,7 @@ struct vnode_ops {
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
+#define VOP_POLL(vn, ev, pw, rev)       (__VOP(vn, poll)(vn, ev, pw, rev))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_TRYSEEK(vn, pos)            (__VOP(vn, tryseek)(vn, pos))
@@ -43,13 +43,17 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <slab.h>
+#include <openfile.h>
 #include <kern/fcntl.h>
+#include <limits.h>
 #include "opt-A2.h"
 
 /*
@@ -72,33 +76,201 @@ struct semaphore *no_proc_sem;
 
 
 #if OPT_A2
-	static volatile pid_t pid_ctr; // global pid counter
-	static struct lock *pid_ctr_lock;
-	static bool is_kernel_init; // to tell if kernel is already initialized
+	struct lock *proc_family_lk; // parent/child links and exit status
 #endif		
 
+#if OPT_A2
 /*
- * Create a proc structure.
+ * PID table.
+ *
+ * A full array indexed by PID would cost 128K for PID_MAX = 32767,
+ * which is too much for the small memories we run in. Instead there
+ * are PIDSLOTS slots, and a PID lives in slot PID % PIDSLOTS; each
+ * slot hands out PIDs with its residue in turn (pid, pid + PIDSLOTS,
+ * ...), wrapping around within [PID_MIN, PID_MAX]. Free slots are
+ * kept in a FIFO, so allocation, freeing, and lookup are all O(1),
+ * and a PID is not reused until every other slot has been used and
+ * its slot has come around PID_MAX / PIDSLOTS more times.
+ *
+ * This bounds the number of live processes at PIDSLOTS (less the
+ * PIDs below PID_MIN, which are never issued).
+ *
+ * The kernel process is not in the table; it gets KPROC_PID, just
+ * below the range user processes are given, so the first of those
+ * is PID_MIN.
  */
+#define PIDSLOTS 1024
+#define KPROC_PID (PID_MIN - 1)
+
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+static struct proc *pid_procs[PIDSLOTS];	/* owner of each slot */
+static pid_t pid_next[PIDSLOTS];		/* next PID each slot issues */
+static unsigned pid_freeq[PIDSLOTS];		/* FIFO of free slots */
+static unsigned pid_freehead, pid_freecount;
+
+static
+void
+pid_bootstrap(void)
+{
+	unsigned i, slot;
+
+	pid_freehead = 0;
+	pid_freecount = 0;
+	/* queue the slots so the first PIDs issued are PID_MIN, PID_MIN+1, ... */
+	for (i = 0; i < PIDSLOTS; i++) {
+		slot = (PID_MIN + i) % PIDSLOTS;
+		pid_procs[slot] = NULL;
+		pid_next[slot] = PID_MIN + i;
+		if (pid_next[slot] <= PID_MAX) {
+			pid_freeq[pid_freecount++] = slot;
+		}
+	}
+}
+
+/* Assign PROC a PID. Returns ENPROC if none is free. */
+static
+int
+pid_alloc(struct proc *proc)
+{
+	unsigned slot;
+
+	spinlock_acquire(&pid_lock);
+	if (pid_freecount == 0) {
+		spinlock_release(&pid_lock);
+		return ENPROC;
+	}
+	slot = pid_freeq[pid_freehead];
+	pid_freehead = (pid_freehead + 1) % PIDSLOTS;
+	pid_freecount--;
+
+	KASSERT(pid_procs[slot] == NULL);
+	pid_procs[slot] = proc;
+	proc->pid = pid_next[slot];
+	spinlock_release(&pid_lock);
+	return 0;
+}
+
+/* Release PID for reuse. */
 static
+void
+pid_free(pid_t pid)
+{
+	unsigned slot = pid % PIDSLOTS;
+
+	spinlock_acquire(&pid_lock);
+	KASSERT(pid_procs[slot] != NULL && pid_next[slot] == pid);
+	pid_procs[slot] = NULL;
+	pid_next[slot] = pid + PIDSLOTS;
+	if (pid_next[slot] > PID_MAX) {
+		pid_next[slot] = slot >= PID_MIN ? slot : slot + PIDSLOTS;
+	}
+	pid_freeq[(pid_freehead + pid_freecount) % PIDSLOTS] = slot;
+	pid_freecount++;
+	spinlock_release(&pid_lock);
+}
+
+/*
+ * Look up a process by PID. Returns NULL if there is none. The caller
+ * must ensure the process can't be destroyed while it's using the
+ * result.
+ */
 struct proc *
-proc_create(const char *name)
+proc_lookup(pid_t pid)
 {
+	struct proc *proc;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	spinlock_acquire(&pid_lock);
+	proc = pid_procs[pid % PIDSLOTS];
+	if (proc != NULL && proc->pid != pid) {
+		proc = NULL;
+	}
+	spinlock_release(&pid_lock);
+	return proc;
+}
+#endif /* OPT_A2 */
 
+/*
+ * Cache of proc structures. The per-proc synchronization objects are
+ * set up by the constructor and survive across proc_destroy, so
+ * fork/exit churn does not rebuild them every time.
+ */
+static struct kmem_cache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+#if OPT_A2
+	struct proc *proc = obj;
+
+	proc->children = array_create();
+	if (proc->children == NULL) {
+		return ENOMEM;
+	}
+	proc->p_waitcv = cv_create("p_waitcv");
+	if (proc->p_waitcv == NULL) {
+		array_destroy(proc->children);
+		return ENOMEM;
+	}
+	proc->p_uthread_lk = lock_create("p_uthread_lk");
+	if (proc->p_uthread_lk == NULL) {
+		cv_destroy(proc->p_waitcv);
+		array_destroy(proc->children);
+		return ENOMEM;
+	}
+	proc->p_uthread_cv = cv_create("p_uthread_cv");
+	if (proc->p_uthread_cv == NULL) {
+		lock_destroy(proc->p_uthread_lk);
+		cv_destroy(proc->p_waitcv);
+		array_destroy(proc->children);
+		return ENOMEM;
+	}
+#else
+	(void)obj;
+#endif
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
 #if OPT_A2
-	KASSERT(pid_ctr > 0);
+	struct proc *proc = obj;
+
+	cv_destroy(proc->p_uthread_cv);
+	lock_destroy(proc->p_uthread_lk);
+	cv_destroy(proc->p_waitcv);
+	array_destroy(proc->children);
+#else
+	(void)obj;
 #endif
+}
 
+/*
+ * Create a proc structure. Fails with ENOMEM, or ENPROC if there is
+ * no PID to give it.
+ */
+static
+int
+proc_create(const char *name, struct proc **ret)
+{
 	struct proc *proc;
+#if OPT_A2
+	int result;
+#endif
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
-		return NULL;
+		return ENOMEM;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
-		return NULL;
+		kmem_cache_free(proc_cache, proc);
+		return ENOMEM;
 	}
 
 	threadarray_init(&proc->p_threads);
@@ -115,24 +287,39 @@ proc_create(const char *name)
 #endif // UW
 
 #if OPT_A2
-	if (!is_kernel_init) {
-		proc->pid = pid_ctr;
-		pid_ctr++;	
-	} else {
-		lock_acquire(pid_ctr_lock);
-		proc->pid = pid_ctr;
-		pid_ctr++;
-		lock_release(pid_ctr_lock);
+	if (kproc == NULL) {
+		/* we are making kproc */
+		proc->pid = KPROC_PID;
+	}
+	else {
+		result = pid_alloc(proc);
+		if (result) {
+			kfree(proc->p_name);
+			kmem_cache_free(proc_cache, proc);
+			return result;
+		}
 	}
 	proc->parent = NULL;
-	proc->children = array_create(); // init children array
-	proc->children_lk = lock_create(proc->p_name); // init children lock
-	if (proc->children_lk == NULL) panic("could not create child lock");
-	proc->is_exited = cv_create("is_exited");
-	if (proc->is_exited == NULL) panic("could not create cv is_exited");
+	proc->p_exited = false;
+	proc->p_exitcode = 0;
+	proc->p_vforked = false;
+	for (unsigned i = 0; i < PROC_MAXUTHREADS; i++) {
+		proc->p_uthreads[i].ut_tid = 0;
+		proc->p_uthreads[i].ut_thread = NULL;
+		proc->p_uthreads[i].ut_exited = false;
+	}
+	proc->p_nexttid = 1;
+	proc->p_nuthreads = 1;
+	proc->p_firststack = -1;
+	proc->p_dying = false;
+	proc->p_dyingcode = 0;
+	/* children and the cvs and locks come from proc_ctor */
+	KASSERT(array_num(proc->children) == 0);
+	proc->p_filetable = NULL;
 #endif
 
-	return proc;
+	*ret = proc;
+	return 0;
 }
 
 /*
@@ -154,18 +341,9 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != kproc);
 
 #if OPT_A2
-	// free each alloc. child_info
-	lock_acquire(proc->children_lk);
-	for (int i = array_num(proc->children) - 1; i >= 0; --i) {
-		struct child_info *ci = array_get(proc->children, i);
-		ci->proc->parent = NULL;
-		kfree(ci);
-		array_remove(proc->children, i);
-	}
-	array_destroy(proc->children); // clean up ext alloc. children arr.
-	lock_release(proc->children_lk);
-	cv_destroy(proc->is_exited);
-	lock_destroy(proc->children_lk); // destory the child lock
+	/* proc_exit has reaped or orphaned any children */
+	KASSERT(array_num(proc->children) == 0);
+	KASSERT(proc->parent == NULL);
 #endif
 
 	/*
@@ -179,6 +357,12 @@ proc_destroy(struct proc *proc)
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
+#if OPT_A2
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
+#endif
 
 
 #ifndef UW  // in the UW version, space destruction occurs in sys_exit, not here
@@ -210,8 +394,12 @@ proc_destroy(struct proc *proc)
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
+#if OPT_A2
+	pid_free(proc->pid);
+#endif
+
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -231,6 +419,105 @@ proc_destroy(struct proc *proc)
 
 }
 
+#if OPT_A2
+int
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(proc_family_lk));
+	KASSERT(child->parent == NULL);
+
+	result = array_add(parent->children, child, &child->p_childindex);
+	if (result) {
+		return result;
+	}
+	child->parent = parent;
+	return 0;
+}
+
+void
+proc_reap(struct proc *child)
+{
+	struct proc *parent = child->parent;
+	struct proc *last;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(proc_family_lk));
+	KASSERT(child->p_exited);
+	KASSERT(parent != NULL);
+
+	/* swap the last child into our slot */
+	n = array_num(parent->children);
+	KASSERT(array_get(parent->children, child->p_childindex) == child);
+	last = array_get(parent->children, n - 1);
+	array_set(parent->children, child->p_childindex, last);
+	last->p_childindex = child->p_childindex;
+	array_setsize(parent->children, n - 1);
+
+	child->parent = NULL;
+	proc_destroy(child);
+}
+
+void
+proc_vforkdone(struct proc *proc)
+{
+	lock_acquire(proc_family_lk);
+	KASSERT(proc->p_vforked);
+	/* the parent is blocked in vfork, so it cannot have gone away */
+	KASSERT(proc->parent != NULL);
+	proc->p_vforked = false;
+	cv_broadcast(proc->parent->p_waitcv, proc_family_lk);
+	lock_release(proc_family_lk);
+}
+
+void
+proc_exit(struct proc *proc, int exitcode)
+{
+	struct proc *child;
+	bool zombie;
+	unsigned n;
+
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+
+	/* release files now, so e.g. pipe readers see EOF */
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
+	if (proc->p_cwd) {
+		VOP_DECREF(proc->p_cwd);
+		proc->p_cwd = NULL;
+	}
+
+	lock_acquire(proc_family_lk);
+
+	/* nobody will wait for our children now */
+	while ((n = array_num(proc->children)) > 0) {
+		child = array_get(proc->children, n - 1);
+		if (child->p_exited) {
+			proc_reap(child);
+		}
+		else {
+			child->parent = NULL;
+			array_setsize(proc->children, n - 1);
+		}
+	}
+
+	zombie = (proc->parent != NULL);
+	if (zombie) {
+		proc->p_exitcode = exitcode;
+		proc->p_exited = true;
+		cv_broadcast(proc->parent->p_waitcv, proc_family_lk);
+	}
+	lock_release(proc_family_lk);
+
+	if (!zombie) {
+		proc_destroy(proc);
+	}
+}
+#endif /* OPT_A2 */
+
 /*
  * Create the process structure for the kernel.
  */
@@ -238,18 +525,18 @@ void
 proc_bootstrap(void)
 {
 #if OPT_A2
-    is_kernel_init = false;
-    pid_ctr = 1; // initialize a global counter for pid
-    pid_ctr_lock = lock_create("pid_ctr_lock");
-    if (pid_ctr_lock == NULL) panic("could not create pid_ctr_lock\n");
+    pid_bootstrap();
+    proc_family_lk = lock_create("proc_family_lk");
+    if (proc_family_lk == NULL) panic("could not create proc_family_lk\n");
 #endif
-    kproc = proc_create("[kernel]");
-    if (kproc == NULL) {
+    proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+                                   proc_ctor, proc_dtor);
+    if (proc_cache == NULL) {
+        panic("could not create proc cache\n");
+    }
+    if (proc_create("[kernel]", &kproc)) {
         panic("proc_create for kproc failed\n");
     }
-#if OPT_A2
-	is_kernel_init = true;
-#endif
 
 #ifdef UW
   proc_count = 0;
@@ -270,18 +557,61 @@ proc_bootstrap(void)
  * It will have no address space and will inherit the current
  * process's (that is, the kernel menu's) current directory.
  */
-struct proc *
-proc_create_runprogram(const char *name)
+#if OPT_A2
+/*
+ * Give PROC a fresh file table with the console open on descriptors
+ * 0, 1 and 2.
+ */
+static
+int
+proc_openconsole(struct proc *proc)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	char *console_path;
+	int fd, i, result;
+
+	proc->p_filetable = filetable_create();
+	if (proc->p_filetable == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<3; i++) {
+		/* openfile_open may destroy the path, so copy it each time */
+		console_path = kstrdup("con:");
+		if (console_path == NULL) {
+			return ENOMEM;
+		}
+		result = openfile_open(console_path, modes[i], 0, &of);
+		kfree(console_path);
+		if (result) {
+			return result;
+		}
+		result = filetable_place(proc->p_filetable, of, &fd);
+		if (result) {
+			openfile_decref(of);
+			return result;
+		}
+		KASSERT(fd == i);
+	}
+	return 0;
+}
+#endif
+
+int
+proc_create_runprogram(const char *name, struct proc **ret)
 {
 	struct proc *proc;
 	char *console_path;
+	int result;
 
-	proc = proc_create(name);
-	if (proc == NULL) {
-		return NULL;
+	result = proc_create(name, &proc);
+	if (result) {
+		return result;
 	}
 
-#ifdef UW
+#if OPT_A2
+	(void)console_path;
+#elif defined(UW)
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
@@ -325,7 +655,28 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
-	return proc;
+#if OPT_A2
+	/*
+	 * A process forked from a user process inherits its parent's
+	 * descriptors; one started from the kernel menu gets the
+	 * console on stdin, stdout and stderr. This is done last so
+	 * proc_destroy can clean up if it fails.
+	 */
+	if (curproc->p_filetable != NULL) {
+		result = filetable_copy(curproc->p_filetable,
+					&proc->p_filetable);
+	}
+	else {
+		result = proc_openconsole(proc);
+	}
+	if (result) {
+		proc_destroy(proc);
+		return result;
+	}
+#endif
+
+	*ret = proc;
+	return 0;
 }
 
 /*
@@ -46,6 +46,10 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <bio.h>
+#include <buf.h>
+#include <openfile.h>
+#include <futex.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -107,10 +111,17 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	lock_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	bio_bootstrap();
+	buf_bootstrap();
+	openfile_bootstrap();
+#if OPT_A2
+	futex_bootstrap();
+#endif
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -144,9 +144,9 @@ common_prog(int nargs, char **args)
 #endif
 
 	/* Create a process for the new program to run in. */
-	proc = proc_create_runprogram(args[0] /* name */);
-	if (proc == NULL) {
-		return ENOMEM;
+	result = proc_create_runprogram(args[0] /* name */, &proc);
+	if (result) {
+		return result;
 	}
 
 	result = thread_fork(args[0] /* thread name */,
@@ -409,14 +409,40 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for kernel heap statistics.
+ *
+ *    kh              usage per size class (and per caller if tracing)
+ *    kh pages        raw dump of every heap page
+ *    kh trace on|off record the caller of each allocation
+ *    kh snap         remember the current heap state
+ *    kh leaks        show what was allocated since "kh snap" and is
+ *                    still live
+ */
 static
 int
 cmd_kheapstats(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
-
-	kheap_printstats();
+	if (nargs == 1) {
+		kheap_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "pages")) {
+		kheap_dumppages();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "trace") &&
+		 (!strcmp(args[2], "on") || !strcmp(args[2], "off"))) {
+		kheap_settrace(!strcmp(args[2], "on"));
+	}
+	else if (nargs == 2 && !strcmp(args[1], "snap")) {
+		kheap_snapshot();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "leaks")) {
+		kheap_leakreport();
+	}
+	else {
+		kprintf("Usage: kh [pages | trace on|off | snap | leaks]\n");
+		return EINVAL;
+	}
 	
 	return 0;
 }
@@ -482,6 +508,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] Object cache test             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -491,6 +518,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Barrier/completion test       ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -500,6 +528,13 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS cache stress       (4)     ",
+	"[fs7] FS vnode stress       (4)     ",
+	"[fs8] FS directory stress   (4)     ",
+	"[fs9] FS rename test        (4)     ",
+	"[fs10] FS I/O stress        (4)     ",
+	"[fs11] FS read-ahead test   (4)     ",
+	"[fs12] FS delayed alloc     (4)     ",
 	NULL
 };
 
@@ -594,6 +629,7 @@ static struct {
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	slabtest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -605,6 +641,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	bartest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -616,6 +653,13 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	cachestress },
+	{ "fs7",	vnodestress },
+	{ "fs8",	dirstress },
+	{ "fs9",	renametest },
+	{ "fs10",	iostress },
+	{ "fs11",	rastress },
+	{ "fs12",	dalloctest },
 
 	{ NULL, NULL }
 };
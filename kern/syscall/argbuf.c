@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Argument vectors for exec. See <argbuf.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <argbuf.h>
+
+void
+argbuf_init(struct argbuf *ab)
+{
+	ab->ab_buf = NULL;
+	ab->ab_size = 0;
+	ab->ab_strlen = 0;
+	ab->ab_argc = 0;
+}
+
+void
+argbuf_cleanup(struct argbuf *ab)
+{
+	if (ab->ab_buf != NULL) {
+		kfree(ab->ab_buf);
+	}
+	argbuf_init(ab);
+}
+
+/* Bytes the block will take on the stack. */
+static
+size_t
+argbuf_total(struct argbuf *ab)
+{
+	return (ab->ab_argc + 1) * sizeof(userptr_t) + ab->ab_strlen;
+}
+
+/*
+ * Make the buffer at least MINSIZE bytes. It grows by doubling from a
+ * page, so the usual short argument list costs one small allocation.
+ */
+static
+int
+argbuf_grow(struct argbuf *ab, size_t minsize)
+{
+	size_t newsize;
+	char *newbuf;
+
+	if (minsize <= ab->ab_size) {
+		return 0;
+	}
+	if (minsize > ARG_MAX) {
+		return E2BIG;
+	}
+	newsize = ab->ab_size > 0 ? ab->ab_size : PAGE_SIZE;
+	while (newsize < minsize) {
+		newsize *= 2;
+	}
+	if (newsize > ARG_MAX) {
+		newsize = ARG_MAX;
+	}
+
+	newbuf = kmalloc(newsize);
+	if (newbuf == NULL) {
+		return ENOMEM;
+	}
+	if (ab->ab_buf != NULL) {
+		memcpy(newbuf, ab->ab_buf, ab->ab_strlen);
+		kfree(ab->ab_buf);
+	}
+	ab->ab_buf = newbuf;
+	ab->ab_size = newsize;
+	return 0;
+}
+
+int
+argbuf_copyin(struct argbuf *ab, userptr_t uargv)
+{
+	userptr_t uarg;
+	size_t got;
+	int result;
+
+	while (1) {
+		result = copyin((const_userptr_t)((vaddr_t)uargv +
+					ab->ab_argc * sizeof(userptr_t)),
+				&uarg, sizeof(uarg));
+		if (result) {
+			return result;
+		}
+		if (uarg == NULL) {
+			break;
+		}
+
+		/* copy straight into the buffer, growing it if it fills */
+		do {
+			result = argbuf_grow(ab, ab->ab_strlen + 1);
+			if (result) {
+				return result;
+			}
+			result = copyinstr((const_userptr_t)uarg,
+					   ab->ab_buf + ab->ab_strlen,
+					   ab->ab_size - ab->ab_strlen, &got);
+			if (result == ENAMETOOLONG) {
+				result = argbuf_grow(ab, ab->ab_size + 1);
+				if (result) {
+					return result;
+				}
+				result = ENAMETOOLONG;
+			}
+		} while (result == ENAMETOOLONG);
+		if (result) {
+			return result;
+		}
+
+		ab->ab_strlen += got;
+		ab->ab_argc++;
+		if (argbuf_total(ab) > ARG_MAX) {
+			return E2BIG;
+		}
+	}
+	return 0;
+}
+
+int
+argbuf_fromkernel(struct argbuf *ab, int argc, char **argv)
+{
+	size_t len;
+	int i, result;
+
+	for (i = 0; i < argc; i++) {
+		len = strlen(argv[i]) + 1;
+		result = argbuf_grow(ab, ab->ab_strlen + len);
+		if (result) {
+			return result;
+		}
+		memcpy(ab->ab_buf + ab->ab_strlen, argv[i], len);
+		ab->ab_strlen += len;
+		ab->ab_argc++;
+		if (argbuf_total(ab) > ARG_MAX) {
+			return E2BIG;
+		}
+	}
+	return 0;
+}
+
+int
+argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr)
+{
+	userptr_t *uptrs;
+	size_t ptrsize, total, off;
+	vaddr_t base;
+	int i, result;
+
+	ptrsize = (ab->ab_argc + 1) * sizeof(userptr_t);
+	total = argbuf_total(ab);
+	result = argbuf_grow(ab, total);
+	if (result) {
+		return result;
+	}
+
+	/* slide the strings up to make room for the pointers */
+	memmove(ab->ab_buf + ptrsize, ab->ab_buf, ab->ab_strlen);
+	base = (*stackptr - total) & ~(vaddr_t)7;
+
+	uptrs = (userptr_t *)ab->ab_buf;
+	off = ptrsize;
+	for (i = 0; i < ab->ab_argc; i++) {
+		uptrs[i] = (userptr_t)(base + off);
+		off += strlen(ab->ab_buf + off) + 1;
+	}
+	uptrs[ab->ab_argc] = NULL;
+	KASSERT(off == total);
+
+	result = copyout(ab->ab_buf, (userptr_t)base, total);
+	if (result) {
+		return result;
+	}
+	*stackptr = base;
+	return 0;
+}
@@ -8,6 +8,565 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include "opt-A2.h"
+
+#if OPT_A2
+#include <limits.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <copyinout.h>
+#include <synch.h>
+#include <openfile.h>
+#include <pipe.h>
+#include <poll.h>
+#include <clock.h>
+#endif
+
+#if OPT_A2
+
+/*
+ * File-handle system calls. Each descriptor in curproc->p_filetable
+ * refers to a shared openfile (see <openfile.h>); the openfile's
+ * offset lock is held across each I/O so that reads and writes on a
+ * shared openfile each advance the seek position atomically.
+ */
+
+/* handler for open() system call                   */
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  struct openfile *of;
+  char *kpath;
+  int fd, res;
+
+  kpath = kmalloc(PATH_MAX);
+  if (kpath == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr((const_userptr_t)upath, kpath, PATH_MAX, NULL);
+  if (res) {
+    kfree(kpath);
+    return res;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: open(%s,%d)\n",kpath,flags);
+
+  /* openfile_open (via vfs_open) may destroy kpath */
+  res = openfile_open(kpath, flags, mode, &of);
+  kfree(kpath);
+  if (res) {
+    return res;
+  }
+
+  res = filetable_place(curproc->p_filetable, of, &fd);
+  if (res) {
+    openfile_decref(of);
+    return res;
+  }
+  *retval = fd;
+  return 0;
+}
+
+/* largest transfer whose byte count fits in a syscall's int return value */
+#define IO_MAXRESID ((size_t)0x7fffffff)
+
+/*
+ * Small vector calls (the common case) copy their iovecs to the stack
+ * rather than allocating.
+ */
+#define IOV_STACK 8
+
+/*
+ * Common code for all the read and write calls: move RESID bytes
+ * between the file and the NIOV buffers in IOV with a single
+ * VOP_READ/VOP_WRITE. If POSITIONAL is false the transfer happens at
+ * the openfile's seek position, which is advanced; otherwise it
+ * happens at POS, and the seek position (and its lock) is untouched,
+ * so concurrent positional calls on one openfile do not serialize.
+ */
+static
+int
+file_io(int fdesc, struct iovec *iov, unsigned niov, size_t resid,
+        bool positional, off_t pos, enum uio_rw rw, int *retval)
+{
+  struct openfile *of;
+  struct uio u;
+  struct stat st;
+  int res;
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  if ((rw == UIO_READ && of->of_accmode == O_WRONLY) ||
+      (rw == UIO_WRITE && of->of_accmode == O_RDONLY)) {
+    openfile_decref(of);
+    return EBADF;
+  }
+
+  if (positional) {
+    /* rejects negative offsets, and devices that can't seek */
+    res = VOP_TRYSEEK(of->of_vnode, pos);
+    if (res) {
+      openfile_decref(of);
+      return res;
+    }
+  } else {
+    lock_acquire(of->of_offsetlock);
+    if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+      res = VOP_STAT(of->of_vnode, &st);
+      if (res) {
+        goto out;
+      }
+      of->of_offset = st.st_size;
+    }
+    pos = of->of_offset;
+  }
+
+  /* set up a uio structure to refer to the user program's buffers */
+  u.uio_iov = iov;
+  u.uio_iovcnt = niov;
+  u.uio_offset = pos;
+  u.uio_resid = resid;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc_getas();
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(of->of_vnode, &u);
+  } else {
+    res = VOP_WRITE(of->of_vnode, &u);
+  }
+  if (res) {
+    goto out;
+  }
+
+  if (!positional) {
+    of->of_offset = u.uio_offset;
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = resid - u.uio_resid;
+  KASSERT(*retval >= 0);
+
+ out:
+  if (!positional) {
+    lock_release(of->of_offsetlock);
+  }
+  openfile_decref(of);
+  return res;
+}
+
+/*
+ * Single-buffer read and write, optionally positional.
+ */
+static
+int
+file_rw(int fdesc, userptr_t ubuf, size_t nbytes,
+        bool positional, off_t pos, enum uio_rw rw, int *retval)
+{
+  struct iovec iov;
+
+  if (nbytes > IO_MAXRESID) {
+    return EINVAL;
+  }
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_io(fdesc, &iov, 1, nbytes, positional, pos, rw, retval);
+}
+
+/*
+ * Vectored read and write: copy in the user's iovec array and hand it
+ * to file_io as one multi-iovec uio.
+ */
+static
+int
+file_rwv(int fdesc, const_userptr_t uiov, int iovcnt,
+         enum uio_rw rw, int *retval)
+{
+  struct iovec stackiov[IOV_STACK];
+  struct iovec *iov;
+  size_t total;
+  int i, res;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  if (iovcnt <= IOV_STACK) {
+    iov = stackiov;
+  } else {
+    iov = kmalloc(iovcnt * sizeof(struct iovec));
+    if (iov == NULL) {
+      return ENOMEM;
+    }
+  }
+
+  res = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+  if (res) {
+    goto out;
+  }
+
+  total = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > IO_MAXRESID - total) {
+      res = EINVAL;
+      goto out;
+    }
+    total += iov[i].iov_len;
+  }
+
+  res = file_io(fdesc, iov, iovcnt, total, false, 0, rw, retval);
+
+ out:
+  if (iov != stackiov) {
+    kfree(iov);
+  }
+  return res;
+}
+
+/* handler for read() system call                   */
+int
+sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, false, 0, UIO_READ, retval);
+}
+
+/* handler for write() system call                  */
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw(fdesc, ubuf, nbytes, false, 0, UIO_WRITE, retval);
+}
+
+/* handler for pread() system call                  */
+int
+sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pread(%d,%x,%d,%d)\n",fdesc,(unsigned int)ubuf,
+        (int)nbytes,(int)pos);
+  return file_rw(fdesc, ubuf, nbytes, true, pos, UIO_READ, retval);
+}
+
+/* handler for pwrite() system call                 */
+int
+sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pwrite(%d,%x,%d,%d)\n",fdesc,(unsigned int)ubuf,
+        (int)nbytes,(int)pos);
+  return file_rw(fdesc, ubuf, nbytes, true, pos, UIO_WRITE, retval);
+}
+
+/* handler for readv() system call                  */
+int
+sys_readv(int fdesc, const_userptr_t iov, int iovcnt, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: readv(%d,%x,%d)\n",fdesc,(unsigned int)iov,iovcnt);
+  return file_rwv(fdesc, iov, iovcnt, UIO_READ, retval);
+}
+
+/* handler for writev() system call                 */
+int
+sys_writev(int fdesc, const_userptr_t iov, int iovcnt, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: writev(%d,%x,%d)\n",fdesc,(unsigned int)iov,iovcnt);
+  return file_rwv(fdesc, iov, iovcnt, UIO_WRITE, retval);
+}
+
+/* handler for close() system call                  */
+int
+sys_close(int fdesc)
+{
+  struct openfile *of;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+
+  res = filetable_remove(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  openfile_decref(of);
+  return 0;
+}
+
+/* handler for lseek() system call                  */
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: lseek(%d,%d,%d)\n",fdesc,(int)pos,whence);
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+
+  lock_acquire(of->of_offsetlock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    res = VOP_STAT(of->of_vnode, &st);
+    if (res) {
+      goto out;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    res = EINVAL;
+    goto out;
+  }
+
+  /* this also rejects devices that can't seek, like the console */
+  res = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (res) {
+    goto out;
+  }
+  of->of_offset = newpos;
+  *retval = newpos;
+
+ out:
+  lock_release(of->of_offsetlock);
+  openfile_decref(of);
+  return res;
+}
+
+/* handler for dup2() system call                   */
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of, *oldof;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: dup2(%d,%d)\n",oldfd,newfd);
+
+  if (newfd < 0 || newfd >= OPEN_MAX) {
+    return EBADF;
+  }
+  /* filetable_get's reference becomes the one held by the new slot */
+  res = filetable_get(curproc->p_filetable, oldfd, &of);
+  if (res) {
+    return res;
+  }
+  if (oldfd == newfd) {
+    openfile_decref(of);
+    *retval = newfd;
+    return 0;
+  }
+
+  res = filetable_placeat(curproc->p_filetable, of, newfd, &oldof);
+  if (res) {
+    openfile_decref(of);
+    return res;
+  }
+  if (oldof != NULL) {
+    openfile_decref(oldof);
+  }
+  *retval = newfd;
+  return 0;
+}
+
+/* handler for pipe() system call                   */
+int
+sys_pipe(userptr_t ufds, int *retval)
+{
+  struct vnode *rvn, *wvn;
+  struct openfile *rof, *wof;
+  int fds[2];
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: pipe(%x)\n",(unsigned int)ufds);
+
+  res = pipe_create(&rvn, &wvn);
+  if (res) {
+    return res;
+  }
+  res = openfile_create(rvn, O_RDONLY, &rof);
+  if (res) {
+    vfs_close(rvn);
+    vfs_close(wvn);
+    return res;
+  }
+  res = openfile_create(wvn, O_WRONLY, &wof);
+  if (res) {
+    openfile_decref(rof);
+    vfs_close(wvn);
+    return res;
+  }
+
+  res = filetable_place(curproc->p_filetable, rof, &fds[0]);
+  if (res) {
+    openfile_decref(rof);
+    openfile_decref(wof);
+    return res;
+  }
+  res = filetable_place(curproc->p_filetable, wof, &fds[1]);
+  if (res) {
+    openfile_decref(wof);
+    goto fail;
+  }
+
+  res = copyout(fds, ufds, sizeof(fds));
+  if (res) {
+    if (filetable_remove(curproc->p_filetable, fds[1], &wof) == 0) {
+      openfile_decref(wof);
+    }
+    goto fail;
+  }
+  *retval = 0;
+  return 0;
+
+ fail:
+  /* another thread may have closed it already */
+  if (filetable_remove(curproc->p_filetable, fds[0], &rof) == 0) {
+    openfile_decref(rof);
+  }
+  return res;
+}
+
+/*
+ * Check each descriptor in FDS (whose openfiles are in OFS, or NULL
+ * if not polled) and fill in its revents; if PW is not NULL, also
+ * register PW with each. Returns the number of ready descriptors in
+ * NREADY.
+ */
+static
+int
+poll_scan(struct pollfd *fds, struct openfile **ofs, unsigned nfds,
+          struct pollwaiter *pw, int *nready)
+{
+  unsigned i;
+  int res, revents;
+
+  *nready = 0;
+  for (i = 0; i < nfds; i++) {
+    if (ofs[i] == NULL) {
+      if (fds[i].revents != 0) {
+        /* POLLNVAL */
+        (*nready)++;
+      }
+      continue;
+    }
+    res = VOP_POLL(ofs[i]->of_vnode, fds[i].events, pw, &revents);
+    if (res) {
+      return res;
+    }
+    fds[i].revents = revents;
+    if (revents != 0) {
+      (*nready)++;
+    }
+  }
+  return 0;
+}
+
+/* handler for poll() system call                   */
+int
+sys_poll(userptr_t ufds, unsigned nfds, int timeout, int *retval)
+{
+  struct pollfd *fds = NULL;
+  struct openfile **ofs = NULL;
+  struct pollwaiter pw;
+  time_t secs, deadsecs = 0;
+  uint32_t nsecs, deadnsecs = 0;
+  unsigned i;
+  int res, nready;
+
+  DEBUG(DB_SYSCALL,"Syscall: poll(%x,%u,%d)\n",(unsigned int)ufds,nfds,timeout);
+
+  if (nfds > OPEN_MAX) {
+    return EINVAL;
+  }
+  if (nfds > 0) {
+    fds = kmalloc(nfds * sizeof(*fds));
+    ofs = kmalloc(nfds * sizeof(*ofs));
+    if (fds == NULL || ofs == NULL) {
+      res = ENOMEM;
+      goto out;
+    }
+    res = copyin((const_userptr_t)ufds, fds, nfds * sizeof(*fds));
+    if (res) {
+      goto out;
+    }
+  }
+
+  /* hold the openfiles so they stay valid while we sleep */
+  for (i = 0; i < nfds; i++) {
+    fds[i].revents = 0;
+    ofs[i] = NULL;
+    if (fds[i].fd >= 0 &&
+        filetable_get(curproc->p_filetable, fds[i].fd, &ofs[i])) {
+      fds[i].revents = POLLNVAL;
+    }
+  }
+
+  res = pollwaiter_init(&pw);
+  if (res) {
+    goto release;
+  }
+
+  res = poll_scan(fds, ofs, nfds, &pw, &nready);
+  if (res == 0 && nready == 0 && timeout != 0) {
+    if (timeout > 0) {
+      gettime(&deadsecs, &deadnsecs);
+      deadsecs += timeout / 1000;
+      deadnsecs += (timeout % 1000) * 1000000;
+      if (deadnsecs >= 1000000000) {
+        deadnsecs -= 1000000000;
+        deadsecs++;
+      }
+      res = clock_pollregister(&pw);
+    }
+    while (res == 0) {
+      pollwaiter_sleep(&pw);
+      res = poll_scan(fds, ofs, nfds, NULL, &nready);
+      if (res || nready > 0) {
+        break;
+      }
+      if (timeout > 0) {
+        gettime(&secs, &nsecs);
+        if (secs > deadsecs || (secs == deadsecs && nsecs >= deadnsecs)) {
+          break;
+        }
+      }
+    }
+  }
+  pollwaiter_cleanup(&pw);
+
+  if (res == 0 && nfds > 0) {
+    res = copyout(fds, ufds, nfds * sizeof(*fds));
+  }
+  if (res == 0) {
+    *retval = nready;
+  }
+
+ release:
+  for (i = 0; i < nfds; i++) {
+    if (ofs[i] != NULL) {
+      openfile_decref(ofs[i]);
+    }
+  }
+ out:
+  if (ofs != NULL) {
+    kfree(ofs);
+  }
+  if (fds != NULL) {
+    kfree(fds);
+  }
+  return res;
+}
+
+#else /* OPT_A2 */
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +617,5 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#endif /* OPT_A2 */
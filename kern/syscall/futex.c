@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futex wait queues. See <futex.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <futex.h>
+
+#define FUTEX_NBUCKETS	64
+
+/*
+ * One sleeper, on its own kernel stack. It stays on its bucket's list
+ * until a waker takes it off and sets fw_woken.
+ */
+struct futexwaiter {
+	struct addrspace *fw_as;
+	userptr_t fw_uaddr;
+	bool fw_woken;
+	struct futexwaiter *fw_next;
+};
+
+/*
+ * All sleepers in a bucket share its wchan; a wakeup wakes them all
+ * and those not chosen go back to sleep. Collisions are rare enough
+ * for that to be cheaper than a wchan per sleeper.
+ */
+struct futexbucket {
+	struct spinlock fb_lock;	/* protects fb_waiters */
+	struct wchan *fb_wchan;
+	struct futexwaiter *fb_waiters;
+};
+
+static struct futexbucket futex_buckets[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i = 0; i < FUTEX_NBUCKETS; i++) {
+		spinlock_init(&futex_buckets[i].fb_lock);
+		futex_buckets[i].fb_wchan = wchan_create("futex");
+		if (futex_buckets[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: out of memory\n");
+		}
+		futex_buckets[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futexbucket *
+futex_bucket(struct addrspace *as, userptr_t uaddr)
+{
+	uintptr_t h;
+
+	h = ((uintptr_t)as >> 4) ^ ((uintptr_t)uaddr >> 2);
+	return &futex_buckets[h % FUTEX_NBUCKETS];
+}
+
+int
+futex_wait(struct addrspace *as, userptr_t uaddr, int val)
+{
+	struct futexbucket *fb = futex_bucket(as, uaddr);
+	struct futexwaiter w, **wp;
+	int cur, result;
+
+	/*
+	 * The word is checked under the bucket lock, so a waker that
+	 * changes it and then calls futex_wake cannot slip in between
+	 * the check and our going to sleep. This relies on dumbvm's
+	 * vm_fault never sleeping.
+	 */
+	spinlock_acquire(&fb->fb_lock);
+	result = copyin(uaddr, &cur, sizeof(cur));
+	if (result == 0 && cur != val) {
+		result = EAGAIN;
+	}
+	if (result) {
+		spinlock_release(&fb->fb_lock);
+		return result;
+	}
+
+	w.fw_as = as;
+	w.fw_uaddr = uaddr;
+	w.fw_woken = false;
+	w.fw_next = fb->fb_waiters;
+	fb->fb_waiters = &w;
+
+	while (!w.fw_woken && !curproc->p_dying) {
+		/* bridge to the wchan lock, as in P() */
+		wchan_lock(fb->fb_wchan);
+		spinlock_release(&fb->fb_lock);
+		wchan_sleep(fb->fb_wchan);
+		spinlock_acquire(&fb->fb_lock);
+	}
+
+	if (!w.fw_woken) {
+		for (wp = &fb->fb_waiters; *wp != &w; wp = &(*wp)->fw_next) {
+			KASSERT(*wp != NULL);
+		}
+		*wp = w.fw_next;
+	}
+	spinlock_release(&fb->fb_lock);
+
+	return w.fw_woken ? 0 : EINTR;
+}
+
+void
+futex_wake(struct addrspace *as, userptr_t uaddr, int n, int *nwoken)
+{
+	struct futexbucket *fb = futex_bucket(as, uaddr);
+	struct futexwaiter *w, **wp;
+	int count = 0;
+
+	spinlock_acquire(&fb->fb_lock);
+	wp = &fb->fb_waiters;
+	while (*wp != NULL && count < n) {
+		w = *wp;
+		if (w->fw_as == as && w->fw_uaddr == uaddr) {
+			*wp = w->fw_next;
+			w->fw_woken = true;
+			count++;
+		}
+		else {
+			wp = &w->fw_next;
+		}
+	}
+	if (count > 0) {
+		wchan_wakeall(fb->fb_wchan);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	*nwoken = count;
+}
+
+void
+futex_wakeall(struct addrspace *as)
+{
+	struct futexbucket *fb;
+	struct futexwaiter *w;
+	unsigned i;
+
+	for (i = 0; i < FUTEX_NBUCKETS; i++) {
+		fb = &futex_buckets[i];
+		spinlock_acquire(&fb->fb_lock);
+		for (w = fb->fb_waiters; w != NULL; w = w->fw_next) {
+			if (w->fw_as == as) {
+				wchan_wakeall(fb->fb_wchan);
+				break;
+			}
+		}
+		spinlock_release(&fb->fb_lock);
+	}
+}
+
+/*
+ * futex(uaddr, op, val): FUTEX_WAIT sleeps while *uaddr == val;
+ * FUTEX_WAKE wakes up to val sleepers and returns how many it woke.
+ */
+int
+sys_futex(userptr_t uaddr, int op, int val, int *retval)
+{
+	struct addrspace *as = curproc_getas();
+
+	if (((vaddr_t)uaddr & (sizeof(int) - 1)) != 0) {
+		return EINVAL;
+	}
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		*retval = 0;
+		return futex_wait(as, uaddr, val);
+	    case FUTEX_WAKE:
+		if (val <= 0) {
+			return EINVAL;
+		}
+		futex_wake(as, uaddr, val, retval);
+		return 0;
+	}
+	return EINVAL;
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Open files and file tables.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <slab.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <openfile.h>
+
+/*
+ * openfiles come from an object cache; the constructor makes the
+ * offset lock, so open/close cycles don't rebuild it.
+ */
+static struct kmem_cache *openfile_cache;
+
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *of = obj;
+
+	of->of_offsetlock = lock_create("openfile");
+	if (of->of_offsetlock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&of->of_reflock);
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *of = obj;
+
+	spinlock_cleanup(&of->of_reflock);
+	lock_destroy(of->of_offsetlock);
+}
+
+void
+openfile_bootstrap(void)
+{
+	openfile_cache = kmem_cache_create("openfile", sizeof(struct openfile),
+					   openfile_ctor, openfile_dtor);
+	if (openfile_cache == NULL) {
+		panic("openfile_bootstrap: could not create openfile cache\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Open files.
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct vnode *vn;
+	int accmode, result;
+
+	accmode = flags & O_ACCMODE;
+	if (accmode != O_RDONLY && accmode != O_WRONLY && accmode != O_RDWR) {
+		return EINVAL;
+	}
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		return result;
+	}
+
+	result = openfile_create(vn, flags, ret);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	return 0;
+}
+
+int
+openfile_create(struct vnode *vn, int flags, struct openfile **ret)
+{
+	struct openfile *of;
+
+	of = kmem_cache_alloc(openfile_cache);
+	if (of == NULL) {
+		return ENOMEM;
+	}
+
+	of->of_vnode = vn;
+	of->of_accmode = flags & O_ACCMODE;
+	of->of_flags = flags & ~O_ACCMODE;
+	of->of_offset = 0;
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = (of->of_refcount == 0);
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		/* nobody else can see it now, so no locking needed */
+		KASSERT(!lock_do_i_hold(of->of_offsetlock));
+		vfs_close(of->of_vnode);
+		of->of_vnode = NULL;
+		kmem_cache_free(openfile_cache, of);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// File tables.
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	spinlock_init(&ft->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+	}
+	return ft;
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&src->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = src->ft_files[i];
+		if (ft->ft_files[i] != NULL) {
+			openfile_incref(ft->ft_files[i]);
+		}
+	}
+	spinlock_release(&src->ft_lock);
+
+	*ret = ft;
+	return 0;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	unsigned i;
+
+	/* we have the only reference to the table, so no locking */
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+			ft->ft_files[i] = NULL;
+		}
+	}
+	spinlock_cleanup(&ft->ft_lock);
+	kfree(ft);
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	if (of != NULL) {
+		openfile_incref(of);
+	}
+	spinlock_release(&ft->ft_lock);
+
+	if (of == NULL) {
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *fd)
+{
+	unsigned i;
+
+	spinlock_acquire(&ft->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			spinlock_release(&ft->ft_lock);
+			*fd = i;
+			return 0;
+		}
+	}
+	spinlock_release(&ft->ft_lock);
+	return EMFILE;
+}
+
+int
+filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		  struct openfile **oldof)
+{
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	*oldof = ft->ft_files[fd];
+	ft->ft_files[fd] = of;
+	spinlock_release(&ft->ft_lock);
+	return 0;
+}
+
+int
+filetable_remove(struct filetable *ft, int fd, struct openfile **ret)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	ft->ft_files[fd] = NULL;
+	spinlock_release(&ft->ft_lock);
+
+	if (of == NULL) {
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
@@ -15,6 +15,9 @@
 #include <mips/trapframe.h>
 #include <kern/fcntl.h>
 #include <vfs.h>
+#include <limits.h>
+#include <argbuf.h>
+#include <futex.h>
 #endif
 #include "opt-A2.h"
 
@@ -28,30 +31,29 @@ void sys__exit(int exitcode) {
   /* for now, just include this to keep the compiler from complaining about
      an unused variable */
 
-#if OPT_A2
-  // Assigning exit code to the struct child_info
-  struct proc *parent = p->parent;
-  if (parent != NULL) {
-    lock_acquire(parent->children_lk); // acquire children
-    struct array *children = parent->children;
-    // finding the child
-    for (unsigned i = 0; i < array_num(children); ++i) {
-        struct child_info *ci = array_get(children, i);
-        if (ci->pid == p->pid) {     // find within the parents children arr
-          ci->exitcode = exitcode; // set exit code
-          break;;
-        }
-    }
-    lock_release(parent->children_lk);
-    cv_signal(p->is_exited, p->children_lk);
-  }
-#else
+#if !OPT_A2
   (void)exitcode;
 #endif
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
   KASSERT(curproc->p_addrspace != NULL);
+#if OPT_A2
+  /* the first thread to call _exit takes the others with it */
+  lock_acquire(p->p_uthread_lk);
+  if (!p->p_dying) {
+    p->p_dying = true;
+    p->p_dyingcode = exitcode;
+    cv_broadcast(p->p_uthread_cv, p->p_uthread_lk);
+  }
+  lock_release(p->p_uthread_lk);
+  /* and out of any futex waits */
+  futex_wakeall(p->p_addrspace);
+
+  /* the last thread out tears down the address space and process */
+  (void)as;
+  uthread_exit(exitcode);
+#else
   as_deactivate();
   /*
    * clear p_addrspace before calling as_destroy. Otherwise if
@@ -70,6 +72,7 @@ void sys__exit(int exitcode) {
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
   proc_destroy(p);
+#endif
   
   thread_exit();
   /* thread_exit() does not return, so we should never get here */
@@ -111,116 +114,215 @@ sys_waitpid(pid_t pid,
      Fix this!
   */
 
-  if (options != 0) {
+#if OPT_A2
+  struct proc *c;
+
+  DEBUG(DB_SYSCALL,"Syscall: waitpid(%d,%x,%d)\n",pid,(unsigned int)status,options);
+
+  if ((options & ~WNOHANG) != 0) {
     return(EINVAL);
   }
 
-  #if OPT_A2
-  struct proc *p = curproc;
-  struct child_info *ci = NULL;
-  // find the correct child
-  lock_acquire(p->children_lk);
-  for (unsigned i = 0; i < array_num(p->children); ++i) {
-      struct child_info *curproc_ci = array_get(p->children, i);
-      if (curproc_ci->pid == pid) {
-        ci = curproc_ci;
-        break;
-      }
-  }
-  if (ci != NULL) { // if the given pid is a child of the process
-    while (ci->exitcode == -1) {
-      cv_wait(ci->proc->is_exited, p->children_lk);
-    }
-    exitstatus = _MKWAIT_EXIT(ci->exitcode);
-  } else {
-    lock_release(p->children_lk);
-    *retval = -1;
+  /*
+   * Children are found through the PID table, and a zombie keeps its
+   * PID until it is reaped here, so this is O(1) in the number of
+   * children.
+   */
+  lock_acquire(proc_family_lk);
+  c = proc_lookup(pid);
+  if (c == NULL) {
+    lock_release(proc_family_lk);
     return ESRCH;
+  }
+  /*
+   * Only our own children are stable while we hold proc_family_lk;
+   * anything else may be exiting (and its proc reused) under us.
+   */
+  if (c->parent != curproc || c->pid != pid) {
+    lock_release(proc_family_lk);
+    return ECHILD;
+  }
+  while (!c->p_exited) {
+    if (options & WNOHANG) {
+      lock_release(proc_family_lk);
+      *retval = 0;
+      return(0);
     }
-  lock_release(p->children_lk);
+    cv_wait(curproc->p_waitcv, proc_family_lk);
+  }
+  exitstatus = _MKWAIT_EXIT(c->p_exitcode);
+  proc_reap(c);
+  lock_release(proc_family_lk);
+
+  /* not under proc_family_lk: a fault here must not stall fork and exit */
+  if (status != NULL) {
+    result = copyout((void *)&exitstatus,status,sizeof(int));
+    if (result) {
+      return(result);
+    }
+  }
 #else
+  if (options != 0) {
+    return(EINVAL);
+  }
   /* for now, just pretend the exitstatus is 0 */
   exitstatus = 0;
-#endif
 
   result = copyout((void *)&exitstatus,status,sizeof(int));
   if (result) {
     return(result);
   }
+#endif
   *retval = pid;
   return(0);
 }
 
 
 #if OPT_A2
-/* fork stub handler  */
-int sys_fork(struct trapframe *tf, pid_t *retval) {
-  KASSERT(tf != NULL);
-  KASSERT(retval != NULL);
-
+/*
+ * Common part of fork and vfork: make a child of curproc that returns
+ * to user mode from a copy of TF. With SHARE the child runs in our own
+ * address space instead of a copy of it.
+ */
+static int
+fork_common(struct trapframe *tf, bool share, struct proc **childp)
+{
   struct proc *p = curproc;
+  struct proc *c;
+  struct trapframe *ctf;
+  int slot, result;
 
-  struct proc *c = proc_create_runprogram(p->p_name);
-  KASSERT(c != NULL);
+  result = proc_create_runprogram(p->p_name, &c);
+  if (result) {
+    return result;
+  }
   KASSERT(c->pid > 0);
 
-  c->parent = p;
-  struct child_info *ci = kmalloc(sizeof(struct child_info));
-  ci->pid = c->pid;
-  ci->exitcode = -1;
-  ci->proc = c;
+  if (share) {
+    c->p_addrspace = curproc_getas();
+    c->p_vforked = true;
+    /* on our stack, which stays ours */
+    c->p_firststack = uthread_stackslot();
+  }
+  else {
+    result = as_copy(curproc_getas(), &c->p_addrspace);
+    if (result) {
+      proc_destroy(c);
+      return result;
+    }
+    /* our copy becomes the child's first thread, on the same stack */
+    slot = uthread_stackslot();
+    if (slot >= 0) {
+      as_claim_threadstack(c->p_addrspace, slot);
+      c->p_firststack = slot;
+    }
+  }
+
+  // copy over trapframe; enter_forked_process frees it
+  ctf = kmalloc(sizeof(struct trapframe));
+  if (ctf == NULL) {
+    result = ENOMEM;
+    goto fail;
+  }
+  memcpy(ctf, tf, sizeof(struct trapframe));
 
-  lock_acquire(p->children_lk);
-  array_add(p->children, ci, NULL);
-  lock_release(p->children_lk); 
+  lock_acquire(proc_family_lk);
+  result = proc_addchild(p, c);
+  lock_release(proc_family_lk);
+  if (result) {
+    kfree(ctf);
+    goto fail;
+  }
 
-  // copy over addrspace
-  int err = as_copy(curproc_getas(),  &(c->p_addrspace));
-  if (err != 0) panic("copy addrspace err");
+  result = thread_fork(c->p_name, c, (void *)&enter_forked_process, ctf, 10);
+  if (result) {
+    kfree(ctf);
+    /* it never ran; reap it as if it had exited */
+    lock_acquire(proc_family_lk);
+    c->p_exited = true;
+    if (share) {
+      c->p_addrspace = NULL;
+    }
+    proc_reap(c);
+    lock_release(proc_family_lk);
+    return result;
+  }
+
+  *childp = c;
+  return 0;
+
+fail:
+  if (share) {
+    c->p_addrspace = NULL;
+  }
+  proc_destroy(c);
+  return result;
+}
+
+/* fork stub handler  */
+int sys_fork(struct trapframe *tf, pid_t *retval) {
+  struct proc *c;
+  int result;
 
-  // copy over trapframe
-  c->tf = kmalloc(sizeof(struct trapframe));
-  KASSERT(c->tf != NULL);
-  memcpy(c->tf, tf, sizeof(struct trapframe));
+  KASSERT(tf != NULL);
+  KASSERT(retval != NULL);
 
-  thread_fork(c->p_name, c, (void *)&enter_forked_process, c->tf, 10);
+  result = fork_common(tf, false, &c);
+  if (result) {
+    return result;
+  }
   *retval = c->pid; // retur pid for parent process
 
   return 0; // return 0 for child process
 }
 
-/* execv stub handler */
-int sys_execv(const_userptr_t progname, userptr_t *args) {
+/*
+ * vfork: the child borrows our address space, so there is nothing to
+ * copy. We sleep until it execs or exits and hands it back; until then
+ * it may scribble on our memory, which is the caller's lookout.
+ */
+int sys_vfork(struct trapframe *tf, pid_t *retval) {
+  struct proc *p = curproc;
+  struct proc *c;
+  pid_t pid;
+  int result;
+
+  KASSERT(tf != NULL);
+  KASSERT(retval != NULL);
+
+  result = fork_common(tf, true, &c);
+  if (result) {
+    return result;
+  }
+  pid = c->pid;
+
+  /* c cannot be reaped while p_vforked is set: only we can reap it */
+  lock_acquire(proc_family_lk);
+  while (c->p_vforked) {
+    cv_wait(p->p_waitcv, proc_family_lk);
+  }
+  lock_release(proc_family_lk);
+
+  *retval = pid;
+  return 0;
+}
+
+/*
+ * Set up a new image for curproc from PATH with the arguments in AB
+ * and switch to it. On success the address space we were using is
+ * handed back in OLD_AS for the caller to dispose of; on failure it is
+ * put back.
+ */
+static int
+exec_image(char *path, struct argbuf *ab, struct addrspace **old_as,
+           vaddr_t *entrypoint, vaddr_t *stackptr)
+{
   struct addrspace *as;
   struct vnode *v;
-  vaddr_t entrypoint, stackptr;
   int result;
-  
-  /* Count the number of args and copy them to the kernel*/
-  int argc  = 0;
-  for (int i = 0; args[i] != NULL; ++i) {
-    argc++;
-  }
-
-  char **kargs = kmalloc(argc * sizeof(char *));
-  KASSERT(kargs != NULL);
-  for (int i = 0; i < argc; ++i) {
-    size_t arg_size = (strlen(((char **)args)[i]) + 1) * sizeof(char);
-    kargs[i] = kmalloc(arg_size);
-    KASSERT(kargs[i] != NULL);
-    int err = copyinstr(args[i], kargs[i], arg_size, NULL);
-    KASSERT(err == 0);
-  }
-
-  /* Copy the program path from user space into the kernel */
-  size_t progname_size = (strlen((char*)progname) + 1) * sizeof(char);
-  char *kprogname = kmalloc(progname_size);
-  KASSERT(kprogname != NULL);
-  int err = copyinstr(progname, kprogname, progname_size, NULL);
-  KASSERT(err == 0);
-  
+
   /* Open the file. */
-  result = vfs_open((char *)kprogname, O_RDONLY, 0, &v);
+  result = vfs_open(path, O_RDONLY, 0, &v);
   if (result) {
     return result;
   }
@@ -231,67 +333,208 @@ int sys_execv(const_userptr_t progname, userptr_t *args) {
     vfs_close(v);
     return ENOMEM;
   }
-  
+
   /* Switch to it and activate it. */
-  struct addrspace * old_as = curproc_setas(as);
+  *old_as = curproc_setas(as);
   as_activate();
 
   /* Load the executable. */
-  result = load_elf(v, &entrypoint);
+  result = load_elf(v, entrypoint);
 
+  /* Done with the file now. */
+  vfs_close(v);
+
+  if (result == 0) {
+    /* Define the user stack and lay the arguments out on it */
+    result = as_define_stack(as, stackptr);
+  }
+  if (result == 0) {
+    result = argbuf_copyout(ab, stackptr);
+  }
   if (result) {
-    /* p_addrspace will go away when curproc is destroyed */
-    vfs_close(v);
+    /* go back to the old image; the caller gets the error */
+    curproc_setas(*old_as);
+    as_activate();
+    as_destroy(as);
     return result;
   }
+  return 0;
+}
 
-  /* Done with the file now. */
-  vfs_close(v);
+/*
+ * Copy in a program path and argument vector.
+ */
+static int
+exec_copyin(const_userptr_t progname, userptr_t *args, char **kprogname,
+            struct argbuf *ab)
+{
+  int result;
 
-  /* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
-	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		return result;
-	}
-
-  /* Pushing args to the stack */
-  vaddr_t curstack = stackptr;
-  vaddr_t *argv = kmalloc(sizeof(vaddr_t) * (argc + 1));
-  KASSERT(argv != NULL);
-  
-  argv[argc] = (vaddr_t)NULL; // set argv[argc] NULL 
-  for (int i = argc - 1; i >= 0; --i) {
-    size_t args_size = strlen(kargs[i]) + 1;
-    args_size = ROUNDUP(args_size, 4) * sizeof(char);
-    curstack -= args_size;
-    argv[i] = curstack;
-    int err = copyout(kargs[i], (userptr_t)curstack, args_size);
-    KASSERT(err == 0);
+  *kprogname = kmalloc(PATH_MAX);
+  if (*kprogname == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(progname, *kprogname, PATH_MAX, NULL);
+  if (result == 0) {
+    result = argbuf_copyin(ab, (userptr_t)args);
   }
+  if (result) {
+    kfree(*kprogname);
+    argbuf_cleanup(ab);
+    return result;
+  }
+  return 0;
+}
 
-  for (int i = argc; i >= 0; --i) {
-    size_t args_size = sizeof(vaddr_t);
-    curstack -= args_size;
-    int err = copyout(argv + i, (userptr_t)curstack, args_size);
-    KASSERT(err == 0);  
+/*
+ * execv: the program name and the whole argv block are copied in
+ * before anything is torn down, so a bad pointer or an oversized
+ * argument list fails with the old image still intact.
+ */
+int sys_execv(const_userptr_t progname, userptr_t *args) {
+  struct addrspace *old_as;
+  struct argbuf ab;
+  vaddr_t entrypoint, stackptr;
+  char *kprogname;
+  int argc, result;
+
+  /* any other threads would be left running in the old image */
+  if (curproc->p_nuthreads > 1) {
+    return EBUSY;
   }
 
-  /* Delete old address space */
-  as_destroy(old_as);
+  argbuf_init(&ab);
+  result = exec_copyin(progname, args, &kprogname, &ab);
+  if (result) {
+    return result;
+  }
+
+  result = exec_image(kprogname, &ab, &old_as, &entrypoint, &stackptr);
+  argc = ab.ab_argc;
+  argbuf_cleanup(&ab);
   kfree(kprogname);
-  for (int i = 0; i < argc; ++i) {
-    kfree(kargs[i]);
+  if (result) {
+    return result;
+  }
+
+  uthread_exec();
+
+  /* Delete old address space, or give it back if we vforked */
+  if (curproc->p_vforked) {
+    proc_vforkdone(curproc);
+  }
+  else {
+    as_destroy(old_as);
   }
-  kfree(kargs);
-  kfree(argv);
 
   /* Warp to user mode */
-  enter_new_process(argc, (userptr_t)curstack, ROUNDUP(curstack, 8), entrypoint);
+  enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
   panic("enter_new_process returned when it shouldn't have\n");
-  
-  /* execv only returns if there is an err */
-  return -1; // 
+  return EINVAL;
+}
+
+/*
+ * spawn: handed from sys_spawn to the new process's first thread,
+ * which builds its own image and reports back in sp_result.
+ */
+struct spawn {
+  char *sp_path;
+  struct argbuf sp_args;
+  struct semaphore *sp_done;
+  int sp_result;
+};
+
+static
+void
+spawn_start(void *data1, unsigned long data2)
+{
+  struct spawn *sp = data1;
+  struct proc *p = curproc;
+  struct addrspace *as;
+  vaddr_t entrypoint, stackptr;
+  int argc, result;
+
+  (void)data2;
+
+  result = exec_image(sp->sp_path, &sp->sp_args, &as,
+                      &entrypoint, &stackptr);
+  sp->sp_result = result;
+  if (result) {
+    /* become a zombie for sys_spawn to reap */
+    proc_remthread(curthread);
+    proc_exit(p, 0);
+    V(sp->sp_done);
+    thread_exit();
+  }
+  KASSERT(as == NULL);
+
+  /* sp belongs to the parent and is gone once we signal */
+  argc = sp->sp_args.ab_argc;
+  V(sp->sp_done);
+
+  enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
+  panic("enter_new_process returned when it shouldn't have\n");
+}
+
+/*
+ * spawn: start PROGNAME with ARGS in a new child process, without
+ * copying (or borrowing) our address space at all.
+ */
+int sys_spawn(const_userptr_t progname, userptr_t *args, pid_t *retval) {
+  struct spawn sp;
+  struct proc *c;
+  int result;
+
+  argbuf_init(&sp.sp_args);
+  result = exec_copyin(progname, args, &sp.sp_path, &sp.sp_args);
+  if (result) {
+    return result;
+  }
+  sp.sp_done = sem_create("spawn", 0);
+  if (sp.sp_done == NULL) {
+    result = ENOMEM;
+    goto out;
+  }
+
+  result = proc_create_runprogram(sp.sp_path, &c);
+  if (result) {
+    goto out;
+  }
+  lock_acquire(proc_family_lk);
+  result = proc_addchild(curproc, c);
+  lock_release(proc_family_lk);
+  if (result) {
+    proc_destroy(c);
+    goto out;
+  }
+
+  result = thread_fork(c->p_name, c, spawn_start, &sp, 0);
+  if (result) {
+    lock_acquire(proc_family_lk);
+    c->p_exited = true;
+    proc_reap(c);
+    lock_release(proc_family_lk);
+    goto out;
+  }
+
+  P(sp.sp_done);
+  result = sp.sp_result;
+  if (result) {
+    lock_acquire(proc_family_lk);
+    KASSERT(c->p_exited);
+    proc_reap(c);
+    lock_release(proc_family_lk);
+    goto out;
+  }
+  *retval = c->pid;
+
+out:
+  if (sp.sp_done != NULL) {
+    sem_destroy(sp.sp_done);
+  }
+  argbuf_cleanup(&sp.sp_args);
+  kfree(sp.sp_path);
+  return result;
 }
 #endif
 
@@ -47,7 +47,7 @@
 
 #include "opt-A2.h"
 #if OPT_A2
-#include <copyinout.h>	
+#include <argbuf.h>
 #endif
 
 /*
@@ -60,6 +60,7 @@
 int
 runprogram(char *progname, int argc, char **args)
 {
+	struct argbuf ab;
 	struct addrspace *as;
 	struct vnode *v;
 	vaddr_t entrypoint, stackptr;
@@ -104,35 +105,23 @@ runprogram(char *progname, int argc, char **args)
 	}
 
 	/* Pushing args to the stack */
-	vaddr_t curstack = stackptr;
-	vaddr_t *argv = kmalloc(sizeof(vaddr_t) * (argc + 1));
-	KASSERT(argv != NULL);
-	
-	argv[argc] = (vaddr_t)NULL; // set argv[argc] NULL 
-	for (int i = argc - 1; i >= 0; --i) {
-		size_t args_size = strlen(args[i]) + 1;
-		args_size = ROUNDUP(args_size, 4) * sizeof(char);
-		curstack -= args_size;
-		argv[i] = curstack;
-		int err = copyout(args[i], (userptr_t)curstack, args_size);
-		KASSERT(err == 0);
+	argbuf_init(&ab);
+	result = argbuf_fromkernel(&ab, argc, args);
+	if (result == 0) {
+		result = argbuf_copyout(&ab, &stackptr);
 	}
-
-	for (int i = argc; i >= 0; --i) {
-		size_t args_size = sizeof(vaddr_t);
-		curstack -= args_size;
-		int err = copyout(argv + i, (userptr_t)curstack, args_size);
-		KASSERT(err == 0);  
+	argbuf_cleanup(&ab);
+	if (result) {
+		/* p_addrspace will go away when curproc is destroyed */
+		return result;
 	}
 
-
 	/* Cleaning up */
 	as_destroy(old_as);
-	kfree(argv);
 
 	/* Warp to user mode. */
-	enter_new_process(argc /*argc*/, (userptr_t)curstack /*userspace addr of argv*/,
-			  ROUNDUP(curstack, 8), entrypoint);
+	enter_new_process(argc /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
+			  stackptr, entrypoint);
 	
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * User threads: thread_create, thread_join and thread_exit, and the
+ * exit path every thread of a user process leaves through.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <mips/trapframe.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/* Find curthread's record; NULL for a process's first thread. */
+static
+struct uthread *
+uthread_self(struct proc *p)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(p->p_uthread_lk));
+	for (i = 0; i < PROC_MAXUTHREADS; i++) {
+		if (p->p_uthreads[i].ut_tid != 0 &&
+		    !p->p_uthreads[i].ut_exited &&
+		    p->p_uthreads[i].ut_thread == curthread) {
+			return &p->p_uthreads[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The thread stack slot curthread runs on: its own, or, for the first
+ * thread, the one it inherited from a fork by a thread on that slot.
+ */
+int
+uthread_stackslot(void)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	int slot;
+
+	lock_acquire(p->p_uthread_lk);
+	ut = uthread_self(p);
+	slot = ut != NULL ? (int)ut->ut_stack : p->p_firststack;
+	lock_release(p->p_uthread_lk);
+	return slot;
+}
+
+/*
+ * curthread, now the only thread in its process, has just switched
+ * to a new image and will run on its main stack. It becomes the
+ * first thread: its record, if it had one, goes away, and so does
+ * any slot it held, which belonged to the old address space.
+ */
+void
+uthread_exec(void)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+
+	lock_acquire(p->p_uthread_lk);
+	KASSERT(p->p_nuthreads == 1);
+	ut = uthread_self(p);
+	if (ut != NULL) {
+		ut->ut_tid = 0;
+		ut->ut_thread = NULL;
+	}
+	p->p_firststack = -1;
+	lock_release(p->p_uthread_lk);
+}
+
+/*
+ * First code run by a new user thread: go to user mode with the
+ * trapframe sys_thread_create built.
+ */
+static
+void
+uthread_start(void *data1, unsigned long unused)
+{
+	(void)unused;
+	enter_new_thread(data1);
+}
+
+/*
+ * Start a new thread in the current process at user address START,
+ * with FUNC and ARG as its first two arguments, on a stack of its own.
+ */
+int
+sys_thread_create(struct trapframe *tf, userptr_t start, userptr_t func,
+		  userptr_t arg, int *retval)
+{
+	struct proc *p = curproc;
+	struct trapframe *ntf;
+	struct uthread *ut;
+	vaddr_t stackptr;
+	unsigned i, slot;
+	int result;
+
+	lock_acquire(p->p_uthread_lk);
+	if (p->p_dying) {
+		/* we will be gone as soon as we return */
+		lock_release(p->p_uthread_lk);
+		return EINTR;
+	}
+	for (i = 0; i < PROC_MAXUTHREADS; i++) {
+		if (p->p_uthreads[i].ut_tid == 0) {
+			break;
+		}
+	}
+	if (i == PROC_MAXUTHREADS) {
+		lock_release(p->p_uthread_lk);
+		return EAGAIN;
+	}
+	ut = &p->p_uthreads[i];
+
+	result = as_define_threadstack(p->p_addrspace, &slot, &stackptr);
+	if (result) {
+		lock_release(p->p_uthread_lk);
+		return result;
+	}
+
+	ntf = kmalloc(sizeof(*ntf));
+	if (ntf == NULL) {
+		as_release_threadstack(p->p_addrspace, slot);
+		lock_release(p->p_uthread_lk);
+		return ENOMEM;
+	}
+	/* keep gp and friends; the rest is set up for the call */
+	memcpy(ntf, tf, sizeof(*ntf));
+	ntf->tf_epc = (vaddr_t)start;
+	ntf->tf_a0 = (vaddr_t)func;
+	ntf->tf_a1 = (vaddr_t)arg;
+	ntf->tf_sp = stackptr;
+	ntf->tf_ra = 0;
+
+	ut->ut_tid = p->p_nexttid++;
+	if (p->p_nexttid <= 0) {
+		p->p_nexttid = 1;
+	}
+	ut->ut_thread = NULL;
+	ut->ut_exited = false;
+	ut->ut_stack = slot;
+	ut->ut_retval = NULL;
+	p->p_nuthreads++;
+
+	/*
+	 * The new thread can't get to uthread_exit, and so can't go
+	 * away, until we drop p_uthread_lk.
+	 */
+	result = thread_fork_ret(p->p_name, p, uthread_start, ntf, 0,
+				 &ut->ut_thread);
+	if (result) {
+		p->p_nuthreads--;
+		ut->ut_tid = 0;
+		kfree(ntf);
+		as_release_threadstack(p->p_addrspace, slot);
+		lock_release(p->p_uthread_lk);
+		return result;
+	}
+
+	*retval = ut->ut_tid;
+	lock_release(p->p_uthread_lk);
+	return 0;
+}
+
+/*
+ * Wait for thread TID to exit and collect the value it passed to
+ * thread_exit. Each thread can be joined once.
+ */
+int
+sys_thread_join(int tid, userptr_t retvalp)
+{
+	struct proc *p = curproc;
+	struct uthread *ut = NULL;
+	userptr_t rv;
+	unsigned i;
+
+	if (tid <= 0) {
+		return ESRCH;
+	}
+
+	lock_acquire(p->p_uthread_lk);
+	for (i = 0; i < PROC_MAXUTHREADS; i++) {
+		if (p->p_uthreads[i].ut_tid == tid) {
+			ut = &p->p_uthreads[i];
+			break;
+		}
+	}
+	if (ut == NULL) {
+		lock_release(p->p_uthread_lk);
+		return ESRCH;
+	}
+	if (!ut->ut_exited && ut->ut_thread == curthread) {
+		lock_release(p->p_uthread_lk);
+		return EINVAL;
+	}
+
+	/* the slot may be joined and reused by someone else meanwhile */
+	while (ut->ut_tid == tid && !ut->ut_exited && !p->p_dying) {
+		cv_wait(p->p_uthread_cv, p->p_uthread_lk);
+	}
+	if (p->p_dying) {
+		lock_release(p->p_uthread_lk);
+		return EINTR;
+	}
+	if (ut->ut_tid != tid) {
+		lock_release(p->p_uthread_lk);
+		return ESRCH;
+	}
+	rv = ut->ut_retval;
+	ut->ut_tid = 0;
+	lock_release(p->p_uthread_lk);
+
+	if (retvalp != NULL) {
+		return copyout(&rv, retvalp, sizeof(rv));
+	}
+	return 0;
+}
+
+/*
+ * Exit the calling thread. The process goes on until its last thread
+ * exits.
+ */
+void
+sys_thread_exit(userptr_t retval)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+
+	lock_acquire(p->p_uthread_lk);
+	ut = uthread_self(p);
+	if (ut != NULL) {
+		ut->ut_retval = retval;
+	}
+	lock_release(p->p_uthread_lk);
+
+	uthread_exit(0);
+}
+
+/*
+ * Detach the current thread from its process and exit. The last
+ * thread out tears down the address space and exits the process,
+ * with the code given to _exit if any thread called it and EXITCODE
+ * otherwise.
+ */
+void
+uthread_exit(int exitcode)
+{
+	struct proc *p = curproc;
+	struct addrspace *as;
+	struct uthread *ut;
+	bool last;
+
+	lock_acquire(p->p_uthread_lk);
+	ut = uthread_self(p);
+	if (ut != NULL) {
+		as_release_threadstack(p->p_addrspace, ut->ut_stack);
+		ut->ut_exited = true;
+		cv_broadcast(p->p_uthread_cv, p->p_uthread_lk);
+	}
+	else if (p->p_firststack >= 0 && !p->p_vforked) {
+		as_release_threadstack(p->p_addrspace, p->p_firststack);
+		p->p_firststack = -1;
+	}
+	if (p->p_dying) {
+		exitcode = p->p_dyingcode;
+	}
+	KASSERT(p->p_nuthreads > 0);
+	p->p_nuthreads--;
+	last = (p->p_nuthreads == 0);
+	if (!last) {
+		/* detach under the lock, so the last thread finds us gone */
+		proc_remthread(curthread);
+	}
+	lock_release(p->p_uthread_lk);
+
+	if (!last) {
+		thread_exit();
+	}
+
+	as_deactivate();
+	/*
+	 * clear p_addrspace before calling as_destroy. Otherwise if
+	 * as_destroy sleeps (which is quite possible) when we
+	 * come back we'll be calling as_activate on a
+	 * half-destroyed address space. This tends to be
+	 * messily fatal.
+	 */
+	as = curproc_setas(NULL);
+	if (p->p_vforked) {
+		/* it was our parent's; hand it back */
+		proc_vforkdone(p);
+	}
+	else {
+		as_destroy(as);
+	}
+
+	/* detach this thread from its process */
+	/* note: curproc cannot be used after this call */
+	proc_remthread(curthread);
+
+	/* become a zombie for our parent, or go away now if there is none */
+	proc_exit(p, exitcode);
+
+	thread_exit();
+}
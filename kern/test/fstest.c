@@ -535,6 +535,983 @@ docreatestress(const char *filesys)
 	kprintf("*** fs create stress test done\n");
 }
 
+////////////////////////////////////////////////////////////
+//
+// Bigger files, for the tests below. The contents are a function of
+// the offset and a seed, so any range can be checked on its own.
+
+#define CHUNK      1000		/* not a multiple of the block size */
+#define CACHEFILE  (160*1024)		/* a few times the buffer cache */
+
+static
+char
+fstest_byte(unsigned seed, off_t pos)
+{
+	return (char)(pos * 7 + pos / 509 + seed * 13);
+}
+
+/*
+ * Open test file NAMESUFFIX on FS.
+ */
+static
+int
+fstest_open(const char *fs, const char *namesuffix, int flags,
+	    struct vnode **ret)
+{
+	char name[32];
+
+	MAKENAME();
+	/* vfs_open destroys the string it's passed, but it's ours */
+	return vfs_open(name, flags, 0664, ret);
+}
+
+/*
+ * Write LEN bytes of SEED's pattern at POS in VN, or read them back
+ * and check them, CHUNK bytes at a time. Complains and returns -1 on
+ * failure.
+ */
+static
+int
+fstest_bigio(struct vnode *vn, const char *what, unsigned seed,
+	     off_t pos, size_t len, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t i, n;
+	int err, ret = 0;
+
+	buf = kmalloc(CHUNK);
+	if (buf == NULL) {
+		kprintf("%s: Out of memory\n", what);
+		return -1;
+	}
+
+	while (len > 0 && ret == 0) {
+		n = len < CHUNK ? len : CHUNK;
+		if (rw == UIO_WRITE) {
+			for (i=0; i<n; i++) {
+				buf[i] = fstest_byte(seed, pos + i);
+			}
+		}
+		uio_kinit(&iov, &ku, buf, n, pos, rw);
+		if (rw == UIO_WRITE) {
+			err = VOP_WRITE(vn, &ku);
+		}
+		else {
+			err = VOP_READ(vn, &ku);
+		}
+		if (err) {
+			kprintf("%s: %s error at %lu: %s\n", what,
+				rw == UIO_WRITE ? "Write" : "Read",
+				(unsigned long) pos, strerror(err));
+			ret = -1;
+			break;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short %s at %lu: %lu bytes left over\n",
+				what, rw == UIO_WRITE ? "write" : "read",
+				(unsigned long) pos,
+				(unsigned long) ku.uio_resid);
+			ret = -1;
+			break;
+		}
+		if (rw == UIO_READ) {
+			for (i=0; i<n; i++) {
+				if (buf[i] != fstest_byte(seed, pos + i)) {
+					kprintf("%s: Test failed: byte %lu "
+						"mismatched\n", what,
+						(unsigned long) (pos + i));
+					ret = -1;
+					break;
+				}
+			}
+		}
+		pos += n;
+		len -= n;
+	}
+
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * Fsync and close VN, which is test file NAMESUFFIX on FS, and open
+ * it again read-only, so what's read next has been through the disk.
+ * Complains and returns -1, with *VN null, on failure.
+ */
+static
+int
+fstest_reopen(const char *fs, const char *namesuffix, struct vnode **vn)
+{
+	int err;
+
+	err = VOP_FSYNC(*vn);
+	vfs_close(*vn);
+	*vn = NULL;
+	if (err) {
+		kprintf("%s: fsync: %s\n", namesuffix, strerror(err));
+		return -1;
+	}
+	err = fstest_open(fs, namesuffix, O_RDONLY, vn);
+	if (err) {
+		kprintf("%s: Could not reopen: %s\n", namesuffix,
+			strerror(err));
+		*vn = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Give up on test file NAMESUFFIX: close VN, if it's open, and
+ * remove the file.
+ */
+static
+void
+fstest_discard(const char *fs, const char *namesuffix, struct vnode *vn)
+{
+	if (vn != NULL) {
+		vfs_close(vn);
+	}
+	fstest_remove(fs, namesuffix);
+}
+
+/*
+ * Run FUNC in NUM threads called NAME, each getting FILESYS and its
+ * thread number, and wait for them all. FUNC must V threadsem when
+ * it's done.
+ */
+static
+void
+fstest_runthreads(const char *filesys, const char *name,
+		  void (*func)(void *, unsigned long), int num)
+{
+	int i, err;
+
+	init_threadsem();
+
+	for (i=0; i<num; i++) {
+		err = thread_fork(name, NULL, func, (char *)filesys, i);
+		if (err) {
+			panic("%s: thread_fork failed: %s\n", name,
+			      strerror(err));
+		}
+	}
+
+	for (i=0; i<num; i++) {
+		P(threadsem);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Each thread writes its own file several times the size of the
+ * buffer cache, so dirty buffers are written back as they're evicted,
+ * then reads it back, rewrites the middle, and checks it all again
+ * through a fresh open.
+ */
+static
+void
+cachestress_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	struct vnode *vn;
+	char numstr[8];
+	int err;
+
+	snprintf(numstr, sizeof(numstr), "c%lu", num);
+
+	err = fstest_open(filesys, numstr, O_RDWR|O_CREAT|O_TRUNC, &vn);
+	if (err) {
+		kprintf("%s: Could not create: %s\n", numstr, strerror(err));
+		kprintf("*** Thread %lu: failed\n", num);
+		V(threadsem);
+		return;
+	}
+	if (fstest_bigio(vn, numstr, num, 0, CACHEFILE, UIO_WRITE) ||
+	    fstest_bigio(vn, numstr, num, 0, CACHEFILE, UIO_READ) ||
+	    fstest_bigio(vn, numstr, num + 1, CACHEFILE / 4, CACHEFILE / 2,
+			 UIO_WRITE)) {
+		goto fail;
+	}
+	if (num == 0) {
+		/* and a global sync, while the others are still busy */
+		err = vfs_sync();
+		if (err) {
+			kprintf("%s: sync: %s\n", numstr, strerror(err));
+			goto fail;
+		}
+	}
+	if (fstest_reopen(filesys, numstr, &vn) ||
+	    fstest_bigio(vn, numstr, num, 0, CACHEFILE / 4, UIO_READ) ||
+	    fstest_bigio(vn, numstr, num + 1, CACHEFILE / 4, CACHEFILE / 2,
+			 UIO_READ) ||
+	    fstest_bigio(vn, numstr, num, 3 * (CACHEFILE / 4), CACHEFILE / 4,
+			 UIO_READ)) {
+		goto fail;
+	}
+	vfs_close(vn);
+
+	if (fstest_remove(filesys, numstr)) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+	V(threadsem);
+	return;
+
+ fail:
+	kprintf("*** Thread %lu: failed\n", num);
+	fstest_discard(filesys, numstr, vn);
+	V(threadsem);
+}
+
+static
+void
+docachestress(const char *filesys)
+{
+	kprintf("*** Starting fs cache stress test on %s:\n", filesys);
+	fstest_runthreads(filesys, "cachestress", cachestress_thread,
+			  NTHREADS/3);
+	kprintf("*** fs cache stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+#define NVNODES  100	/* files each thread holds open at once */
+
+/*
+ * Each thread creates NVNODES files and keeps them all open, so
+ * between them the threads load a few hundred vnodes at once and the
+ * filesystem's vnode table has to grow under them. Every file is
+ * checked while all are open, then closed, and checked again through
+ * a fresh open before being removed.
+ */
+static
+void
+vnodestress_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	struct vnode **vns, *vn;
+	char numstr[16];
+	int i, n, err, failed = 0;
+
+	vns = kmalloc(NVNODES * sizeof(struct vnode *));
+	if (vns == NULL) {
+		kprintf("*** Thread %lu: out of memory\n", num);
+		V(threadsem);
+		return;
+	}
+
+	for (n=0; n<NVNODES; n++) {
+		snprintf(numstr, sizeof(numstr), "v%lu-%d", num, n);
+		err = fstest_open(filesys, numstr, O_RDWR|O_CREAT|O_TRUNC,
+				  &vns[n]);
+		if (err) {
+			kprintf("%s: Could not create: %s\n", numstr,
+				strerror(err));
+			failed = 1;
+			break;
+		}
+		if (fstest_bigio(vns[n], numstr, num * NVNODES + n, 0, 100,
+				 UIO_WRITE)) {
+			failed = 1;
+			n++;
+			break;
+		}
+	}
+
+	/* N files were created; check them while they're all loaded */
+	for (i=0; i<n; i++) {
+		snprintf(numstr, sizeof(numstr), "v%lu-%d", num, i);
+		if (!failed && fstest_bigio(vns[i], numstr, num * NVNODES + i,
+					    0, 100, UIO_READ)) {
+			failed = 1;
+		}
+		vfs_close(vns[i]);
+	}
+	kfree(vns);
+
+	/* and again once they may have been reclaimed */
+	for (i=0; i<n; i++) {
+		snprintf(numstr, sizeof(numstr), "v%lu-%d", num, i);
+		if (!failed) {
+			err = fstest_open(filesys, numstr, O_RDONLY, &vn);
+			if (err) {
+				kprintf("%s: Could not reopen: %s\n", numstr,
+					strerror(err));
+				failed = 1;
+			}
+			else {
+				if (fstest_bigio(vn, numstr, num * NVNODES + i,
+						 0, 100, UIO_READ)) {
+					failed = 1;
+				}
+				vfs_close(vn);
+			}
+		}
+		if (fstest_remove(filesys, numstr)) {
+			failed = 1;
+		}
+	}
+
+	if (failed) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+	V(threadsem);
+}
+
+static
+void
+dovnodestress(const char *filesys)
+{
+	kprintf("*** Starting fs vnode stress test on %s:\n", filesys);
+	fstest_runthreads(filesys, "vnodestress", vnodestress_thread,
+			  NTHREADS/3);
+	kprintf("*** fs vnode stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+#define NDIRFILES  200	/* directory entries per thread */
+
+/*
+ * Open test file NAMESUFFIX with FLAGS and close it again, checking
+ * that the open fails with EXPECT (or succeeds, if EXPECT is 0).
+ */
+static
+int
+fstest_expect(const char *fs, const char *namesuffix, int flags, int expect)
+{
+	struct vnode *vn;
+	int err;
+
+	err = fstest_open(fs, namesuffix, flags, &vn);
+	if (err == 0) {
+		vfs_close(vn);
+	}
+	if (err != expect) {
+		kprintf("%s: Test failed: open gave \"%s\", "
+			"expected \"%s\"\n",
+			namesuffix, err ? strerror(err) : "success",
+			expect ? strerror(expect) : "success");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fill a directory with a few hundred entries from several threads
+ * at once, and check that lookups, exclusive creates and removes all
+ * see the right ones as entries come and go.
+ */
+static
+void
+dirstress_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	char numstr[16];
+	int i, pass;
+
+#define DIRNAME(i) snprintf(numstr, sizeof(numstr), "d%lu-%d", num, i)
+
+	for (i=0; i<NDIRFILES; i++) {
+		DIRNAME(i);
+		if (fstest_expect(filesys, numstr, O_WRONLY|O_CREAT|O_EXCL,
+				  0)) {
+			goto fail;
+		}
+	}
+
+	for (pass=0; pass<2; pass++) {
+		/* everything is there, and can't be created again */
+		for (i=0; i<NDIRFILES; i++) {
+			DIRNAME(i);
+			if (fstest_expect(filesys, numstr, O_RDONLY, 0) ||
+			    fstest_expect(filesys, numstr,
+					  O_WRONLY|O_CREAT|O_EXCL, EEXIST)) {
+				goto fail;
+			}
+		}
+
+		/* take out every other one, and look again */
+		for (i=pass; i<NDIRFILES; i+=2) {
+			DIRNAME(i);
+			if (fstest_remove(filesys, numstr)) {
+				goto fail;
+			}
+		}
+		for (i=0; i<NDIRFILES; i++) {
+			DIRNAME(i);
+			if (fstest_expect(filesys, numstr, O_RDONLY,
+					  i % 2 == pass ? ENOENT : 0)) {
+				goto fail;
+			}
+		}
+
+		/* put them back, in the slots just freed */
+		for (i=pass; i<NDIRFILES; i+=2) {
+			DIRNAME(i);
+			if (fstest_expect(filesys, numstr,
+					  O_WRONLY|O_CREAT|O_EXCL, 0)) {
+				goto fail;
+			}
+		}
+	}
+
+	for (i=0; i<NDIRFILES; i++) {
+		DIRNAME(i);
+		if (fstest_remove(filesys, numstr) ||
+		    fstest_expect(filesys, numstr, O_RDONLY, ENOENT)) {
+			goto fail;
+		}
+	}
+	V(threadsem);
+	return;
+
+ fail:
+	kprintf("*** Thread %lu: failed\n", num);
+	V(threadsem);
+}
+
+#undef DIRNAME
+
+static
+void
+dodirstress(const char *filesys)
+{
+	kprintf("*** Starting fs directory stress test on %s:\n", filesys);
+	fstest_runthreads(filesys, "dirstress", dirstress_thread,
+			  NTHREADS/4);
+	kprintf("*** fs directory stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+#define NRENAMES  20
+
+/*
+ * Rename test file FROM to TO, checking that this fails with EXPECT
+ * (or succeeds, if EXPECT is 0).
+ */
+static
+int
+fstest_rename(const char *fs, const char *from, const char *to, int expect)
+{
+	char name[32], name2[32];
+	int err;
+
+	fstest_makename(name, sizeof(name), fs, from);
+	fstest_makename(name2, sizeof(name2), fs, to);
+	err = vfs_rename(name, name2);
+	if (err != expect) {
+		kprintf("%s: Test failed: rename to %s gave \"%s\", "
+			"expected \"%s\"\n", from, to,
+			err ? strerror(err) : "success",
+			expect ? strerror(expect) : "success");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Create test file NAMESUFFIX holding a little of SEED's pattern.
+ */
+static
+int
+fstest_small(const char *fs, const char *namesuffix, unsigned seed)
+{
+	struct vnode *vn;
+	int err, ret;
+
+	err = fstest_open(fs, namesuffix, O_WRONLY|O_CREAT|O_EXCL, &vn);
+	if (err) {
+		kprintf("%s: Could not create: %s\n", namesuffix,
+			strerror(err));
+		return -1;
+	}
+	ret = fstest_bigio(vn, namesuffix, seed, 0, 100, UIO_WRITE);
+	vfs_close(vn);
+	return ret;
+}
+
+/*
+ * Check that test file NAMESUFFIX holds SEED's pattern.
+ */
+static
+int
+fstest_checksmall(const char *fs, const char *namesuffix, unsigned seed)
+{
+	struct vnode *vn;
+	int err, ret;
+
+	err = fstest_open(fs, namesuffix, O_RDONLY, &vn);
+	if (err) {
+		kprintf("%s: Could not open: %s\n", namesuffix,
+			strerror(err));
+		return -1;
+	}
+	ret = fstest_bigio(vn, namesuffix, seed, 0, 100, UIO_READ);
+	vfs_close(vn);
+	return ret;
+}
+
+/*
+ * Rename and remove files whose names (and absences) were just
+ * looked up, so the name cache holds entries for them, and check that
+ * lookups afterwards see the change and never a stale file.
+ */
+static
+void
+dorenametest(const char *filesys)
+{
+	struct vnode *vn;
+	int i, err;
+
+	kprintf("*** Starting fs rename test on %s:\n", filesys);
+
+	for (i=0; i<NRENAMES; i++) {
+		/* a cached "no such file" must go when the name appears */
+		if (fstest_expect(filesys, "rA", O_RDONLY, ENOENT) ||
+		    fstest_expect(filesys, "rB", O_RDONLY, ENOENT) ||
+		    fstest_small(filesys, "rA", 1) ||
+		    fstest_checksmall(filesys, "rA", 1)) {
+			goto fail;
+		}
+
+		/* rename to a name cached as absent */
+		if (fstest_rename(filesys, "rA", "rB", 0) ||
+		    fstest_expect(filesys, "rA", O_RDONLY, ENOENT) ||
+		    fstest_checksmall(filesys, "rB", 1)) {
+			goto fail;
+		}
+
+		/* renaming onto a name in use fails and changes nothing */
+		if (fstest_small(filesys, "rA", 2) ||
+		    fstest_rename(filesys, "rA", "rB", EEXIST) ||
+		    fstest_checksmall(filesys, "rA", 2) ||
+		    fstest_checksmall(filesys, "rB", 1)) {
+			goto fail;
+		}
+
+		/* rename to a name whose file was just removed */
+		if (fstest_remove(filesys, "rB") ||
+		    fstest_rename(filesys, "rA", "rB", 0) ||
+		    fstest_expect(filesys, "rA", O_RDONLY, ENOENT) ||
+		    fstest_checksmall(filesys, "rB", 2)) {
+			goto fail;
+		}
+
+		/* remove it while it's open, and make a new one */
+		err = fstest_open(filesys, "rB", O_RDONLY, &vn);
+		if (err) {
+			kprintf("rB: Could not open: %s\n", strerror(err));
+			goto fail;
+		}
+		if (fstest_remove(filesys, "rB") ||
+		    fstest_expect(filesys, "rB", O_RDONLY, ENOENT) ||
+		    fstest_small(filesys, "rB", 3) ||
+		    fstest_checksmall(filesys, "rB", 3) ||
+		    fstest_bigio(vn, "removed rB", 2, 0, 100, UIO_READ)) {
+			vfs_close(vn);
+			goto fail;
+		}
+		/* the old file goes away now; the new one must not */
+		vfs_close(vn);
+		if (fstest_checksmall(filesys, "rB", 3) ||
+		    fstest_remove(filesys, "rB")) {
+			goto fail;
+		}
+	}
+
+	kprintf("*** fs rename test done\n");
+	return;
+
+ fail:
+	kprintf("*** Test failed\n");
+}
+
+////////////////////////////////////////////////////////////
+
+#define IOBLOCK      512	/* SFS block size */
+#define IOPERTHREAD  29		/* blocks per file; prime */
+#define IOROUNDS     4
+
+/*
+ * Each thread writes its own file, visiting the blocks out of order
+ * and writing each several times, and reads every write straight
+ * back. Between them the files are bigger than the buffer cache, so
+ * the disk sees requests from all the threads at once, in no
+ * particular order, with rewrites of blocks whose earlier writes may
+ * still be queued. At the end every block must hold its last write,
+ * both before and after an fsync and a fresh open.
+ */
+static
+void
+iostress_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	struct vnode *vn;
+	char numstr[8];
+	unsigned k, r, seed;
+	int err;
+
+	snprintf(numstr, sizeof(numstr), "io%lu", num);
+
+	err = fstest_open(filesys, numstr, O_RDWR|O_CREAT|O_TRUNC, &vn);
+	if (err) {
+		kprintf("%s: Could not create: %s\n", numstr, strerror(err));
+		kprintf("*** Thread %lu: failed\n", num);
+		V(threadsem);
+		return;
+	}
+
+	for (r=0; r<IOROUNDS; r++) {
+		seed = r * NTHREADS + num;
+		for (k=0; k<IOPERTHREAD; k++) {
+			/* 7 is prime to IOPERTHREAD, so this visits all */
+			off_t pos = ((k * 7 + r) % IOPERTHREAD) * IOBLOCK;
+
+			if (fstest_bigio(vn, numstr, seed, pos, IOBLOCK,
+					 UIO_WRITE) ||
+			    fstest_bigio(vn, numstr, seed, pos, IOBLOCK,
+					 UIO_READ)) {
+				goto fail;
+			}
+		}
+	}
+
+	/* the last round's seed, everywhere */
+	if (fstest_bigio(vn, numstr, seed, 0, IOPERTHREAD * IOBLOCK,
+			 UIO_READ) ||
+	    fstest_reopen(filesys, numstr, &vn) ||
+	    fstest_bigio(vn, numstr, seed, 0, IOPERTHREAD * IOBLOCK,
+			 UIO_READ)) {
+		goto fail;
+	}
+	vfs_close(vn);
+
+	if (fstest_remove(filesys, numstr)) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+	V(threadsem);
+	return;
+
+ fail:
+	kprintf("*** Thread %lu: failed\n", num);
+	fstest_discard(filesys, numstr, vn);
+	V(threadsem);
+}
+
+static
+void
+doiostress(const char *filesys)
+{
+	kprintf("*** Starting fs I/O stress test on %s:\n", filesys);
+	fstest_runthreads(filesys, "iostress", iostress_thread, NTHREADS);
+	kprintf("*** fs I/O stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Several threads read one file bigger than the buffer cache at once:
+ * some front to back, so read-ahead kicks in, and some back to front,
+ * so it doesn't. Then, with read-ahead running well ahead of a reader,
+ * the blocks it fetched are rewritten, and the reader must see the new
+ * data and not what was read ahead.
+ */
+static
+void
+rastress_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	struct vnode *vn;
+	off_t pos;
+	size_t n;
+	int err, ret = 0;
+
+	err = fstest_open(filesys, "ra", O_RDONLY, &vn);
+	if (err) {
+		kprintf("ra: Could not open: %s\n", strerror(err));
+		kprintf("*** Thread %lu: failed\n", num);
+		V(threadsem);
+		return;
+	}
+
+	if (num % 2 == 0) {
+		ret = fstest_bigio(vn, "ra", 5, 0, CACHEFILE, UIO_READ);
+	}
+	else {
+		for (pos = CACHEFILE; pos > 0 && ret == 0; pos -= n) {
+			n = pos < CHUNK ? pos : CHUNK;
+			ret = fstest_bigio(vn, "ra", 5, pos - n, n, UIO_READ);
+		}
+	}
+	vfs_close(vn);
+
+	if (ret) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+	V(threadsem);
+}
+
+static
+void
+dorastress(const char *filesys)
+{
+	struct vnode *vn;
+	int err;
+
+	kprintf("*** Starting fs read-ahead test on %s:\n", filesys);
+
+	err = fstest_open(filesys, "ra", O_RDWR|O_CREAT|O_TRUNC, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+	if (fstest_bigio(vn, "ra", 5, 0, CACHEFILE, UIO_WRITE)) {
+		goto fail;
+	}
+	err = VOP_FSYNC(vn);
+	if (err) {
+		kprintf("ra: fsync: %s\n", strerror(err));
+		goto fail;
+	}
+
+	fstest_runthreads(filesys, "rastress", rastress_thread, NTHREADS/3);
+
+	/* read a quarter, rewrite what's just ahead, read on */
+	if (fstest_bigio(vn, "ra", 5, 0, CACHEFILE / 4, UIO_READ) ||
+	    fstest_bigio(vn, "ra", 6, CACHEFILE / 4, CACHEFILE / 8,
+			 UIO_WRITE) ||
+	    fstest_bigio(vn, "ra", 6, CACHEFILE / 4, CACHEFILE / 8,
+			 UIO_READ) ||
+	    fstest_bigio(vn, "ra", 5, CACHEFILE / 4 + CACHEFILE / 8,
+			 CACHEFILE - CACHEFILE / 4 - CACHEFILE / 8,
+			 UIO_READ)) {
+		goto fail;
+	}
+	vfs_close(vn);
+
+	if (fstest_remove(filesys, "ra")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	kprintf("*** fs read-ahead test done\n");
+	return;
+
+ fail:
+	fstest_discard(filesys, "ra", vn);
+	kprintf("*** Test failed\n");
+}
+
+////////////////////////////////////////////////////////////
+
+#define DABLOCK   512			/* SFS block size */
+#define DAFILLMAX (64*1024*1024)	/* give up filling the disk here */
+
+/*
+ * Check that LEN bytes at POS in VN read back as zeros.
+ */
+static
+int
+fstest_zeros(struct vnode *vn, const char *what, off_t pos, size_t len)
+{
+	struct iovec iov;
+	struct uio ku;
+	char buf[64];
+	size_t i, n;
+	int err;
+
+	while (len > 0) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		uio_kinit(&iov, &ku, buf, n, pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Read error at %lu: %s\n", what,
+				(unsigned long) pos,
+				err ? strerror(err) : "short read");
+			return -1;
+		}
+		for (i=0; i<n; i++) {
+			if (buf[i] != 0) {
+				kprintf("%s: Test failed: byte %lu not zero\n",
+					what, (unsigned long) (pos + i));
+				return -1;
+			}
+		}
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Check that VN ends at LEN.
+ */
+static
+int
+fstest_eof(struct vnode *vn, const char *what, off_t len)
+{
+	struct iovec iov;
+	struct uio ku;
+	char c;
+	int err;
+
+	uio_kinit(&iov, &ku, &c, 1, len, UIO_READ);
+	err = VOP_READ(vn, &ku);
+	if (err || ku.uio_resid != 1) {
+		kprintf("%s: Test failed: no end of file at %lu\n", what,
+			(unsigned long) len);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes that haven't been given disk blocks yet must read back like
+ * any others, through holes, overwrites and truncation. Then fill the
+ * disk: the write that doesn't fit must fail with ENOSPC, and
+ * everything written before it must still make it to disk intact.
+ */
+static
+void
+dodalloctest(const char *filesys)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	off_t total;
+	size_t i;
+	int err;
+
+	kprintf("*** Starting fs delayed allocation test on %s:\n", filesys);
+
+	err = fstest_open(filesys, "da", O_RDWR|O_CREAT|O_TRUNC, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	/* written, and read back before anything could reach the disk */
+	if (fstest_bigio(vn, "da", 7, 0, 20 * DABLOCK, UIO_WRITE) ||
+	    fstest_bigio(vn, "da", 7, 0, 20 * DABLOCK, UIO_READ)) {
+		goto fail;
+	}
+
+	/* a write past a hole; the hole reads as zeros */
+	if (fstest_bigio(vn, "da", 8, 40 * DABLOCK, CHUNK, UIO_WRITE) ||
+	    fstest_zeros(vn, "da", 20 * DABLOCK, 20 * DABLOCK) ||
+	    fstest_bigio(vn, "da", 8, 40 * DABLOCK, CHUNK, UIO_READ)) {
+		goto fail;
+	}
+
+	/* overwrite part of a block, then cut the file off mid-block */
+	if (fstest_bigio(vn, "da", 9, 3 * DABLOCK + 100, 300, UIO_WRITE) ||
+	    fstest_bigio(vn, "da", 7, 0, 3 * DABLOCK + 100, UIO_READ) ||
+	    fstest_bigio(vn, "da", 9, 3 * DABLOCK + 100, 300, UIO_READ) ||
+	    fstest_bigio(vn, "da", 7, 3 * DABLOCK + 400, 7 * DABLOCK - 400,
+			 UIO_READ)) {
+		goto fail;
+	}
+	err = VOP_TRUNCATE(vn, 10 * DABLOCK + 17);
+	if (err) {
+		kprintf("da: truncate: %s\n", strerror(err));
+		goto fail;
+	}
+	if (fstest_eof(vn, "da", 10 * DABLOCK + 17) ||
+	    fstest_bigio(vn, "da", 7, 3 * DABLOCK + 400,
+			 7 * DABLOCK - 400 + 17, UIO_READ)) {
+		goto fail;
+	}
+
+	/* grow it again; what was cut off must not come back */
+	if (fstest_bigio(vn, "da", 10, 30 * DABLOCK, CHUNK, UIO_WRITE) ||
+	    fstest_zeros(vn, "da", 10 * DABLOCK + 17,
+			 20 * DABLOCK - 17) ||
+	    fstest_bigio(vn, "da", 10, 30 * DABLOCK, CHUNK, UIO_READ)) {
+		goto fail;
+	}
+
+	/* and all the same once it's on disk */
+	if (fstest_reopen(filesys, "da", &vn) ||
+	    fstest_bigio(vn, "da", 7, 0, 3 * DABLOCK + 100, UIO_READ) ||
+	    fstest_bigio(vn, "da", 9, 3 * DABLOCK + 100, 300, UIO_READ) ||
+	    fstest_zeros(vn, "da", 10 * DABLOCK + 17, 20 * DABLOCK - 17) ||
+	    fstest_bigio(vn, "da", 10, 30 * DABLOCK, CHUNK, UIO_READ) ||
+	    fstest_eof(vn, "da", 30 * DABLOCK + CHUNK)) {
+		goto fail;
+	}
+	vfs_close(vn);
+	if (fstest_remove(filesys, "da")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	/* now fill the disk */
+	err = fstest_open(filesys, "da", O_RDWR|O_CREAT|O_TRUNC, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+	buf = kmalloc(CHUNK);
+	if (buf == NULL) {
+		kprintf("da: Out of memory\n");
+		goto fail;
+	}
+	total = 0;
+	err = 0;
+	while (err == 0 && total < DAFILLMAX) {
+		for (i=0; i<CHUNK; i++) {
+			buf[i] = fstest_byte(11, total + i);
+		}
+		uio_kinit(&iov, &ku, buf, CHUNK, total, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		total = ku.uio_offset;
+	}
+	kfree(buf);
+	if (err != ENOSPC) {
+		kprintf("da: Test failed: filling the disk gave \"%s\", "
+			"expected \"%s\"\n", err ? strerror(err) : "success",
+			strerror(ENOSPC));
+		goto fail;
+	}
+	kprintf("da: disk full after %lu bytes\n", (unsigned long) total);
+
+	/* the space was promised, so writing it back can't run out */
+	if (fstest_reopen(filesys, "da", &vn) ||
+	    fstest_bigio(vn, "da", 11, 0, total, UIO_READ) ||
+	    fstest_eof(vn, "da", total)) {
+		goto fail;
+	}
+	vfs_close(vn);
+	if (fstest_remove(filesys, "da")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	/* and the space comes back */
+	if (fstest_small(filesys, "da", 12) ||
+	    fstest_checksmall(filesys, "da", 12) ||
+	    fstest_remove(filesys, "da")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	kprintf("*** fs delayed allocation test done\n");
+	return;
+
+ fail:
+	fstest_discard(filesys, "da", vn);
+	kprintf("*** Test failed\n");
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -544,7 +1521,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fsN filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +1553,13 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(cachestress);
+DEFTEST(vnodestress);
+DEFTEST(dirstress);
+DEFTEST(renametest);
+DEFTEST(iostress);
+DEFTEST(rastress);
+DEFTEST(dalloctest);
 
 ////////////////////////////////////////////////////////////
 
@@ -34,6 +34,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <slab.h>
 #include <test.h>
 
 /*
@@ -137,3 +138,105 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test the object cache allocator: objects must come back constructed,
+ * be distinct, and the constructor must not rerun on reuse.
+ */
+
+#define SLABITEMS   300
+#define SLABREUSE   20
+#define SLABMAGIC   0x5eed5eed
+
+struct slabtestobj {
+	unsigned magic;
+	unsigned owner;
+	char pad[52];
+};
+
+static unsigned slabtest_ctors;
+static unsigned slabtest_dtors;
+
+static
+int
+slabtest_ctor(void *obj)
+{
+	struct slabtestobj *sto = obj;
+
+	sto->magic = SLABMAGIC;
+	sto->owner = SLABITEMS;
+	slabtest_ctors++;
+	return 0;
+}
+
+static
+void
+slabtest_dtor(void *obj)
+{
+	struct slabtestobj *sto = obj;
+
+	KASSERT(sto->magic == SLABMAGIC);
+	slabtest_dtors++;
+}
+
+int
+slabtest(int nargs, char **args)
+{
+	static struct slabtestobj *objs[SLABITEMS];
+	struct kmem_cache *kc;
+	unsigned i, ctors;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	slabtest_ctors = slabtest_dtors = 0;
+	kc = kmem_cache_create("slabtest", sizeof(struct slabtestobj),
+			       slabtest_ctor, slabtest_dtor);
+	if (kc == NULL) {
+		panic("slabtest: kmem_cache_create failed\n");
+	}
+
+	for (i=0; i<SLABITEMS; i++) {
+		objs[i] = kmem_cache_alloc(kc);
+		if (objs[i] == NULL) {
+			panic("slabtest: kmem_cache_alloc failed\n");
+		}
+		KASSERT(objs[i]->magic == SLABMAGIC);
+		KASSERT(objs[i]->owner == SLABITEMS);
+		objs[i]->owner = i;
+	}
+	for (i=0; i<SLABITEMS; i++) {
+		KASSERT(objs[i]->owner == i);
+		objs[i]->owner = SLABITEMS;
+	}
+	/* free in the opposite order to shuffle the free stacks */
+	for (i=SLABITEMS; i-- > 0; ) {
+		kmem_cache_free(kc, objs[i]);
+	}
+
+	/* a few more should come from retained, already constructed slabs */
+	ctors = slabtest_ctors;
+	for (i=0; i<SLABREUSE; i++) {
+		objs[i] = kmem_cache_alloc(kc);
+		if (objs[i] == NULL) {
+			panic("slabtest: kmem_cache_alloc failed\n");
+		}
+		KASSERT(objs[i]->magic == SLABMAGIC);
+		KASSERT(objs[i]->owner == SLABITEMS);
+	}
+	if (slabtest_ctors != ctors) {
+		panic("slabtest: %u unexpected constructor calls\n",
+		      slabtest_ctors - ctors);
+	}
+	for (i=0; i<SLABREUSE; i++) {
+		kmem_cache_free(kc, objs[i]);
+	}
+
+	kmem_cache_destroy(kc);
+	KASSERT(slabtest_dtors == slabtest_ctors);
+
+	kprintf("Object cache test done\n");
+	return 0;
+}
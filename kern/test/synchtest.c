@@ -32,15 +32,18 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <test.h>
 
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NBARLOOPS     4
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -347,3 +350,91 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+static struct barrier *testbarrier;
+static struct completion *testgo;
+static struct spinlock testbar_spin = SPINLOCK_INITIALIZER;
+static volatile unsigned testbar_fails;
+
+static
+void
+bartestthread(void *junk, unsigned long num)
+{
+	int i;
+	unsigned long seen;
+	(void)junk;
+
+	/* nobody starts until the main thread fires the completion */
+	completion_wait(testgo);
+
+	for (i=0; i<NBARLOOPS; i++) {
+		spinlock_acquire(&testbar_spin);
+		testval1++;
+		spinlock_release(&testbar_spin);
+
+		barrier_wait(testbarrier);
+
+		/* everyone has bumped testval1 for this round, nobody for the next */
+		seen = testval1;
+		if (seen != (unsigned long)(i+1)*NTHREADS) {
+			kprintf("Thread %lu: round %d saw %lu\n", num, i, seen);
+			spinlock_acquire(&testbar_spin);
+			testbar_fails++;
+			spinlock_release(&testbar_spin);
+		}
+
+		if (barrier_wait(testbarrier)) {
+			kprintf("Round %d done\n", i);
+		}
+	}
+	V(donesem);
+	thread_exit();
+}
+
+int
+bartest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting barrier test...\n");
+
+	donesem = sem_create("donesem", 0);
+	testbarrier = barrier_create("testbarrier", NTHREADS);
+	testgo = completion_create("testgo");
+	if (donesem == NULL || testbarrier == NULL || testgo == NULL) {
+		panic("bartest: create failed\n");
+	}
+	testval1 = 0;
+	testbar_fails = 0;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("bartest", NULL, bartestthread, NULL, i);
+		if (result) {
+			panic("bartest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	KASSERT(!completion_done(testgo));
+	complete(testgo);
+	KASSERT(completion_done(testgo));
+
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	completion_destroy(testgo);
+	barrier_destroy(testbarrier);
+	sem_destroy(donesem);
+	donesem = NULL;
+
+	if (testbar_fails > 0) {
+		kprintf("Barrier test failed\n");
+		return EINVAL;
+	}
+	kprintf("Barrier test done.\n");
+	return 0;
+}
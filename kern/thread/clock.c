@@ -32,6 +32,7 @@
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
+#include <poll.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
@@ -62,6 +63,7 @@ static struct wchan *lbolt;
  * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
  */
 static struct wchan *minibolt;
+static struct pollqueue tickpoll;
 
 /* 
  * number of minibolts per second
@@ -87,6 +89,7 @@ hardclock_bootstrap(void)
 	if (minibolt == NULL) {
 		panic("Couldn't create minibolt\n");
 	}
+	pollqueue_init(&tickpoll);
 	minicount = MINI_PER_SECOND;
 	/* we assume MINI_PER_SECOND > 0 */
 	KASSERT(minicount > 0);
@@ -101,6 +104,7 @@ timerclock(void)
 {
 	/* Broadcast on minibolt */
 	wchan_wakeall(minibolt);
+	pollqueue_wakeup(&tickpoll);
 	/* Broadcast on lbolt if a second has elapsed */
 	if (--minicount <= 0) {
 	  minicount = MINI_PER_SECOND;
@@ -155,3 +159,9 @@ clocknap(int num_ticks)
     num_ticks--;
   }
 }
+
+int
+clock_pollregister(struct pollwaiter *pw)
+{
+	return pollwaiter_register(pw, &tickpoll);
+}
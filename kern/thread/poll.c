@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Waiting on several objects at once, for poll(). See <poll.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <poll.h>
+
+/*
+ * One registration of a waiter on a queue. It is on two lists: the
+ * queue's list of waiters, and the waiter's list of registrations.
+ */
+struct pollentry {
+	struct pollwaiter *pe_waiter;
+	struct pollqueue *pe_queue;
+	struct pollentry *pe_next;	/* next on the queue */
+	struct pollentry *pe_wnext;	/* next for the waiter */
+};
+
+void
+pollqueue_init(struct pollqueue *pq)
+{
+	spinlock_init(&pq->pq_lock);
+	pq->pq_entries = NULL;
+}
+
+void
+pollqueue_cleanup(struct pollqueue *pq)
+{
+	KASSERT(pq->pq_entries == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+void
+pollqueue_wakeup(struct pollqueue *pq)
+{
+	struct pollentry *pe;
+	struct pollwaiter *pw;
+
+	/*
+	 * Unlocked check, so objects nobody is polling pay nothing. A
+	 * waiter registers before it checks the object's state, and
+	 * the caller has updated that state already, so if we miss a
+	 * registration here the waiter will see the new state.
+	 */
+	if (pq->pq_entries == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_entries; pe != NULL; pe = pe->pe_next) {
+		pw = pe->pe_waiter;
+		spinlock_acquire(&pw->pw_lock);
+		pw->pw_ready = true;
+		wchan_wakeall(pw->pw_wchan);
+		spinlock_release(&pw->pw_lock);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+int
+pollwaiter_init(struct pollwaiter *pw)
+{
+	pw->pw_wchan = wchan_create("poll");
+	if (pw->pw_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&pw->pw_lock);
+	pw->pw_ready = false;
+	pw->pw_entries = NULL;
+	return 0;
+}
+
+void
+pollwaiter_cleanup(struct pollwaiter *pw)
+{
+	struct pollentry *pe, **pp;
+	struct pollqueue *pq;
+
+	while ((pe = pw->pw_entries) != NULL) {
+		pw->pw_entries = pe->pe_wnext;
+
+		pq = pe->pe_queue;
+		spinlock_acquire(&pq->pq_lock);
+		for (pp = (struct pollentry **)&pq->pq_entries; *pp != pe;
+		     pp = &(*pp)->pe_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = pe->pe_next;
+		spinlock_release(&pq->pq_lock);
+
+		kfree(pe);
+	}
+
+	spinlock_cleanup(&pw->pw_lock);
+	wchan_destroy(pw->pw_wchan);
+}
+
+int
+pollwaiter_register(struct pollwaiter *pw, struct pollqueue *pq)
+{
+	struct pollentry *pe;
+
+	pe = kmalloc(sizeof(*pe));
+	if (pe == NULL) {
+		return ENOMEM;
+	}
+	pe->pe_waiter = pw;
+	pe->pe_queue = pq;
+	pe->pe_wnext = pw->pw_entries;
+	pw->pw_entries = pe;
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_next = pq->pq_entries;
+	pq->pq_entries = pe;
+	spinlock_release(&pq->pq_lock);
+	return 0;
+}
+
+void
+pollwaiter_sleep(struct pollwaiter *pw)
+{
+	spinlock_acquire(&pw->pw_lock);
+	while (!pw->pw_ready) {
+		wchan_lock(pw->pw_wchan);
+		spinlock_release(&pw->pw_lock);
+		wchan_sleep(pw->pw_wchan);
+		spinlock_acquire(&pw->pw_lock);
+	}
+	pw->pw_ready = false;
+	spinlock_release(&pw->pw_lock);
+}
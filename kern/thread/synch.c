@@ -39,6 +39,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <slab.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,19 +148,32 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/* Locks come and go with every proc, vnode and pipe; cache them. */
+static struct kmem_cache *lock_cache;
+
+void
+lock_bootstrap(void)
+{
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       NULL, NULL);
+	if (lock_cache == NULL) {
+		panic("lock_bootstrap: could not create lock cache\n");
+	}
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
 
@@ -167,7 +181,7 @@ lock_create(const char *name)
 	lock->lk_wchan = wchan_create(lock->lk_name);
 	if (lock->lk_wchan == NULL) {
 		kfree(lock->lk_name);
-		kfree(lock);
+		kmem_cache_free(lock_cache, lock);
 		return NULL;
 	}
 
@@ -189,7 +203,7 @@ lock_destroy(struct lock *lock)
         wchan_destroy(lock->lk_wchan);
         lock->owner = NULL;
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -323,3 +337,180 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	// (void)cv;    // suppress warning until code gets written
 	// (void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Barrier.
+
+struct barrier *
+barrier_create(const char *name, unsigned count)
+{
+        struct barrier *b;
+
+        KASSERT(count > 0);
+
+        b = kmalloc(sizeof(struct barrier));
+        if (b == NULL) {
+                return NULL;
+        }
+
+        b->b_name = kstrdup(name);
+        if (b->b_name == NULL) {
+                kfree(b);
+                return NULL;
+        }
+
+        b->b_wchan = wchan_create(b->b_name);
+        if (b->b_wchan == NULL) {
+                kfree(b->b_name);
+                kfree(b);
+                return NULL;
+        }
+
+        spinlock_init(&b->b_lock);
+        b->b_count = count;
+        b->b_arrived = 0;
+        b->b_generation = 0;
+
+        return b;
+}
+
+void
+barrier_destroy(struct barrier *b)
+{
+        KASSERT(b != NULL);
+
+        /* a round in progress means someone is still inside barrier_wait */
+        KASSERT(b->b_arrived == 0);
+
+        /* wchan_cleanup will assert if anyone's waiting on it */
+        spinlock_cleanup(&b->b_lock);
+        wchan_destroy(b->b_wchan);
+        kfree(b->b_name);
+        kfree(b);
+}
+
+bool
+barrier_wait(struct barrier *b)
+{
+        unsigned generation;
+
+        KASSERT(b != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&b->b_lock);
+        generation = b->b_generation;
+        b->b_arrived++;
+        KASSERT(b->b_arrived <= b->b_count);
+
+        if (b->b_arrived == b->b_count) {
+                /* last one in: open the barrier and start the next round */
+                b->b_arrived = 0;
+                b->b_generation++;
+                wchan_wakeall(b->b_wchan);
+                spinlock_release(&b->b_lock);
+                return true;
+        }
+
+        /*
+         * Sleep until the generation changes, not until b_arrived
+         * drops, so a fast thread re-entering for the next round
+         * cannot strand the ones still waking up from this one.
+         */
+        while (b->b_generation == generation) {
+                wchan_lock(b->b_wchan);
+                spinlock_release(&b->b_lock);
+                wchan_sleep(b->b_wchan);
+
+                spinlock_acquire(&b->b_lock);
+        }
+        spinlock_release(&b->b_lock);
+        return false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Completion.
+
+struct completion *
+completion_create(const char *name)
+{
+        struct completion *c;
+
+        c = kmalloc(sizeof(struct completion));
+        if (c == NULL) {
+                return NULL;
+        }
+
+        c->c_name = kstrdup(name);
+        if (c->c_name == NULL) {
+                kfree(c);
+                return NULL;
+        }
+
+        c->c_wchan = wchan_create(c->c_name);
+        if (c->c_wchan == NULL) {
+                kfree(c->c_name);
+                kfree(c);
+                return NULL;
+        }
+
+        spinlock_init(&c->c_lock);
+        c->c_done = false;
+
+        return c;
+}
+
+void
+completion_destroy(struct completion *c)
+{
+        KASSERT(c != NULL);
+
+        /* wchan_cleanup will assert if anyone's waiting on it */
+        spinlock_cleanup(&c->c_lock);
+        wchan_destroy(c->c_wchan);
+        kfree(c->c_name);
+        kfree(c);
+}
+
+void
+complete(struct completion *c)
+{
+        KASSERT(c != NULL);
+
+        spinlock_acquire(&c->c_lock);
+        KASSERT(c->c_done == false);
+        c->c_done = true;
+        wchan_wakeall(c->c_wchan);
+        spinlock_release(&c->c_lock);
+}
+
+void
+completion_wait(struct completion *c)
+{
+        KASSERT(c != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&c->c_lock);
+        while (!c->c_done) {
+                wchan_lock(c->c_wchan);
+                spinlock_release(&c->c_lock);
+                wchan_sleep(c->c_wchan);
+
+                spinlock_acquire(&c->c_lock);
+        }
+        spinlock_release(&c->c_lock);
+}
+
+bool
+completion_done(struct completion *c)
+{
+        bool done;
+
+        KASSERT(c != NULL);
+
+        spinlock_acquire(&c->c_lock);
+        done = c->c_done;
+        spinlock_release(&c->c_lock);
+        return done;
+}
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <slab.h>
 
 #include "opt-synchprobs.h"
 
@@ -72,6 +73,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Thread structures; every fork and exit takes and returns one. */
+static struct kmem_cache *thread_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,14 +127,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -180,6 +184,7 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_kmcache = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -259,7 +264,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -351,6 +356,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: could not create thread cache\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -479,6 +490,19 @@ thread_fork(const char *name,
 	    struct proc *proc,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2)
+{
+	return thread_fork_ret(name, proc, entrypoint, data1, data2, NULL);
+}
+
+/*
+ * thread_fork, handing back the new thread in *RET if RET isn't NULL.
+ */
+int
+thread_fork_ret(const char *name,
+		struct proc *proc,
+		void (*entrypoint)(void *data1, unsigned long data2),
+		void *data1, unsigned long data2,
+		struct thread **ret)
 {
 	struct thread *newthread;
 	int result;
@@ -531,6 +555,9 @@ thread_fork(const char *name,
 	/* Lock the current cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
+	if (ret != NULL) {
+		*ret = newthread;
+	}
 	return 0;
 }
 
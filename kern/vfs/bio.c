@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block I/O request submission and completion. See <bio.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <uio.h>
+#include <device.h>
+#include <bio.h>
+
+/*
+ * Requests complete rarely enough, compared to the cost of a disk
+ * transfer, that one wait channel for everyone is fine; waiters
+ * recheck their own bio when woken.
+ */
+static struct spinlock bio_lock = SPINLOCK_INITIALIZER;
+static struct wchan *bio_wchan;
+
+void
+bio_bootstrap(void)
+{
+	bio_wchan = wchan_create("bio");
+	if (bio_wchan == NULL) {
+		panic("bio_bootstrap: out of memory\n");
+	}
+}
+
+int
+bio_start(struct device *dev, struct bio *bio)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(bio->bio_nblocks > 0);
+
+	bio->bio_isdone = false;
+	bio->bio_result = 0;
+
+	if (dev->d_strategy != NULL) {
+		return dev->d_strategy(dev, bio);
+	}
+
+	uio_kinit(&iov, &ku, bio->bio_data,
+		  bio->bio_nblocks * dev->d_blocksize,
+		  (off_t)bio->bio_block * dev->d_blocksize, bio->bio_rw);
+	result = dev->d_io(dev, &ku);
+	bio_complete(bio, result);
+	return 0;
+}
+
+void
+bio_complete(struct bio *bio, int result)
+{
+	void (*done)(struct bio *) = bio->bio_done;
+
+	spinlock_acquire(&bio_lock);
+	bio->bio_result = result;
+	bio->bio_isdone = true;
+	wchan_wakeall(bio_wchan);
+	spinlock_release(&bio_lock);
+
+	/*
+	 * Without a callback the waiter may free the bio now. With one,
+	 * the bio belongs to the callback, and we mustn't look at it
+	 * again once the callback returns.
+	 */
+	if (done != NULL) {
+		done(bio);
+	}
+}
+
+int
+bio_wait(struct bio *bio)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&bio_lock);
+	while (!bio->bio_isdone) {
+		wchan_lock(bio_wchan);
+		spinlock_release(&bio_lock);
+		wchan_sleep(bio_wchan);
+		spinlock_acquire(&bio_lock);
+	}
+	spinlock_release(&bio_lock);
+
+	return bio->bio_result;
+}
+
+int
+bio_io(struct device *dev, struct bio *bio)
+{
+	int result;
+
+	result = bio_start(dev, bio);
+	if (result) {
+		return result;
+	}
+	return bio_wait(bio);
+}
@@ -0,0 +1,701 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache. See <buf.h>.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <device.h>
+#include <bio.h>
+#include <buf.h>
+
+#define BUF_NHASH	64
+#define BUF_MAXRA	(BUF_NBUFS / 4)	/* read-aheads in flight */
+
+static struct buf buf_pool[BUF_NBUFS];
+static struct buf *buf_hash[BUF_NHASH];
+
+/* Buffers that are not busy, least recently used first. */
+static struct buf *buf_lruhead, *buf_lrutail;
+
+/* Protects everything here except the contents of busy buffers. */
+static struct lock *buf_lock;
+
+/* Signalled whenever a buffer stops being busy. */
+static struct cv *buf_cv;
+
+/* Serializes buf_sync. */
+static struct lock *buf_synclock;
+
+/*
+ * Read-aheads finish in interrupt context, where buf_lock can't be
+ * taken, so the completion callback just puts the buffer on a list
+ * and whoever next holds buf_lock finishes it off (buf_reap).
+ */
+static struct spinlock buf_ralock = SPINLOCK_INITIALIZER;
+static struct buf *buf_radone;		/* protected by buf_ralock */
+static unsigned buf_nra;		/* in flight or on buf_radone */
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+buf_hashfn(struct device *dev, uint32_t block)
+{
+	return (((uintptr_t)dev >> 4) ^ block) % BUF_NHASH;
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfn(dev, block)]; b != NULL; b = b->b_hnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashadd(struct buf *b)
+{
+	unsigned h = buf_hashfn(b->b_dev, b->b_block);
+
+	b->b_hnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **bp;
+
+	bp = &buf_hash[buf_hashfn(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hnext;
+	}
+	*bp = b->b_hnext;
+	b->b_hnext = NULL;
+}
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buf_lruhead == b);
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buf_lrutail == b);
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/* Newest end. */
+static
+void
+buf_lruaddtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Oldest end, for buffers that hold nothing worth keeping. */
+static
+void
+buf_lruaddhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Device I/O
+
+/*
+ * Fill in the buffer's block request.
+ */
+static
+void
+buf_setupbio(struct buf *b, enum uio_rw rw)
+{
+	b->b_bio.bio_block = b->b_block;
+	b->b_bio.bio_nblocks = 1;
+	b->b_bio.bio_data = b->b_data;
+	b->b_bio.bio_rw = rw;
+	b->b_bio.bio_done = NULL;
+	b->b_bio.bio_arg = b;
+}
+
+/*
+ * Read or write one buffer. The buffer must be busy, and buf_lock
+ * not held, since the device may sleep.
+ */
+static
+int
+buf_devio(struct buf *b, enum uio_rw rw)
+{
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_flags & B_BUSY);
+
+ retry:
+	buf_setupbio(b, rw);
+	result = bio_io(b->b_dev, &b->b_bio);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: block I/O returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Write back a dirty buffer that is not busy. Called with buf_lock
+ * held; drops it during the I/O.
+ */
+static
+int
+buf_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT((b->b_flags & (B_DIRTY | B_BUSY)) == B_DIRTY);
+
+	buf_lruremove(b);
+	b->b_flags |= B_BUSY;
+	lock_release(buf_lock);
+
+	result = buf_devio(b, UIO_WRITE);
+
+	lock_acquire(buf_lock);
+	b->b_flags &= ~B_BUSY;
+	if (result == 0) {
+		b->b_flags &= ~B_DIRTY;
+	}
+	buf_lruaddtail(b);
+	cv_broadcast(buf_cv, buf_lock);
+	return result;
+}
+
+/*
+ * Completion callback for read-ahead; runs in interrupt context.
+ */
+static
+void
+buf_radonefn(struct bio *bio)
+{
+	struct buf *b = bio->bio_arg;
+
+	spinlock_acquire(&buf_ralock);
+	b->b_ranext = buf_radone;
+	buf_radone = b;
+	spinlock_release(&buf_ralock);
+}
+
+/*
+ * Finish off a read-ahead buffer whose I/O is over.
+ */
+static
+void
+buf_rafinish(struct buf *b, int result)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT((b->b_flags & (B_BUSY | B_READAHEAD)) ==
+		(B_BUSY | B_READAHEAD));
+
+	b->b_flags &= ~(B_BUSY | B_READAHEAD);
+	KASSERT(buf_nra > 0);
+	buf_nra--;
+	if (result == 0) {
+		b->b_flags |= B_VALID;
+		buf_lruaddtail(b);
+	}
+	else {
+		/* nobody asked for it; just forget it */
+		buf_hashremove(b);
+		b->b_dev = NULL;
+		buf_lruaddhead(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+/*
+ * Finish all completed read-aheads. Called with buf_lock held.
+ */
+static
+void
+buf_reap(void)
+{
+	struct buf *b, *next;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	spinlock_acquire(&buf_ralock);
+	b = buf_radone;
+	buf_radone = NULL;
+	spinlock_release(&buf_ralock);
+
+	for (; b != NULL; b = next) {
+		next = b->b_ranext;
+		b->b_ranext = NULL;
+		buf_rafinish(b, b->b_bio.bio_result);
+	}
+}
+
+/*
+ * Find some read-ahead buffer in flight, or NULL.
+ */
+static
+struct buf *
+buf_anyra(void)
+{
+	unsigned i;
+
+	if (buf_nra == 0) {
+		return NULL;
+	}
+	for (i = 0; i < BUF_NBUFS; i++) {
+		if (buf_pool[i].b_flags & B_READAHEAD) {
+			return &buf_pool[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wait for a read-ahead buffer's I/O and reap it. Called with
+ * buf_lock held; drops it while waiting.
+ */
+static
+void
+buf_rawait(struct buf *b)
+{
+	KASSERT(b->b_flags & B_READAHEAD);
+
+	lock_release(buf_lock);
+	/* b can't be reused until reaped, so its bio stays put */
+	bio_wait(&b->b_bio);
+	lock_acquire(buf_lock);
+	/*
+	 * buf_radonefn runs after bio_wait is woken, so on another cpu
+	 * it may not have queued b yet; if so the reap misses it and the
+	 * caller, seeing B_READAHEAD still set, comes round again.
+	 */
+	buf_reap();
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+buf_bootstrap(void)
+{
+	unsigned i;
+
+	buf_lock = lock_create("buf");
+	buf_cv = cv_create("buf");
+	buf_synclock = lock_create("buf-sync");
+	if (buf_lock == NULL || buf_cv == NULL || buf_synclock == NULL) {
+		panic("buf_bootstrap: out of memory\n");
+	}
+
+	for (i = 0; i < BUF_NBUFS; i++) {
+		buf_pool[i].b_dev = NULL;
+		buf_pool[i].b_block = 0;
+		buf_pool[i].b_flags = 0;
+		buf_pool[i].b_hnext = NULL;
+		buf_pool[i].b_data = kmalloc(BUF_SIZE);
+		if (buf_pool[i].b_data == NULL) {
+			panic("buf_bootstrap: out of memory\n");
+		}
+		buf_lruaddtail(&buf_pool[i]);
+	}
+}
+
+int
+buf_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+
+	lock_acquire(buf_lock);
+	while (1) {
+		buf_reap();
+		b = buf_lookup(dev, block);
+		if (b != NULL) {
+			if (b->b_flags & B_READAHEAD) {
+				buf_rawait(b);
+				continue;
+			}
+			if (b->b_flags & B_BUSY) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			buf_lruremove(b);
+			b->b_flags |= B_BUSY;
+			break;
+		}
+
+		/* Not cached: recycle the least recently used buffer. */
+		b = buf_lruhead;
+		if (b == NULL) {
+			b = buf_anyra();
+			if (b != NULL) {
+				/* nobody will signal for it; go wait */
+				buf_rawait(b);
+			}
+			else {
+				cv_wait(buf_cv, buf_lock);
+			}
+			continue;
+		}
+		if (b->b_flags & B_DIRTY) {
+			/* clean it and look again; things may have moved */
+			result = buf_writeback(b);
+			if (result) {
+				lock_release(buf_lock);
+				return result;
+			}
+			continue;
+		}
+
+		buf_lruremove(b);
+		if (b->b_dev != NULL) {
+			buf_hashremove(b);
+		}
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_flags = B_BUSY;
+		buf_hashadd(b);
+		break;
+	}
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buf_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buf_get(dev, block, &b);
+	if (result) {
+		return result;
+	}
+
+	/* it is busy, so only we can change B_VALID now */
+	if ((b->b_flags & B_VALID) == 0) {
+		result = buf_devio(b, UIO_READ);
+		if (result) {
+			buf_release(b);
+			return result;
+		}
+		lock_acquire(buf_lock);
+		b->b_flags |= B_VALID;
+		lock_release(buf_lock);
+	}
+
+	*ret = b;
+	return 0;
+}
+
+void
+buf_readahead(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+
+	lock_acquire(buf_lock);
+	buf_reap();
+	if (buf_nra >= BUF_MAXRA || buf_lookup(dev, block) != NULL) {
+		lock_release(buf_lock);
+		return;
+	}
+
+	/* Only take a buffer that is free to reuse right now. */
+	b = buf_lruhead;
+	if (b == NULL || (b->b_flags & B_DIRTY)) {
+		lock_release(buf_lock);
+		return;
+	}
+
+	buf_lruremove(b);
+	if (b->b_dev != NULL) {
+		buf_hashremove(b);
+	}
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_flags = B_BUSY | B_READAHEAD;
+	buf_hashadd(b);
+	buf_nra++;
+	lock_release(buf_lock);
+
+	buf_setupbio(b, UIO_READ);
+	b->b_bio.bio_done = buf_radonefn;
+	result = bio_start(dev, &b->b_bio);
+	if (result) {
+		/* never queued, so the callback won't run */
+		lock_acquire(buf_lock);
+		buf_rafinish(b, result);
+		lock_release(buf_lock);
+	}
+}
+
+bool
+buf_incore(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+	bool ret;
+
+	lock_acquire(buf_lock);
+	buf_reap();
+	b = buf_lookup(dev, block);
+	ret = b != NULL && (b->b_flags & (B_VALID | B_BUSY)) == B_VALID;
+	lock_release(buf_lock);
+	return ret;
+}
+
+void
+buf_markdirty(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_flags & B_BUSY);
+	b->b_flags |= B_VALID | B_DIRTY;
+	lock_release(buf_lock);
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_flags & B_BUSY);
+	b->b_flags &= ~B_BUSY;
+	if (b->b_flags & B_VALID) {
+		buf_lruaddtail(b);
+	}
+	else {
+		/* never filled in; don't let anyone find it */
+		KASSERT((b->b_flags & B_DIRTY) == 0);
+		buf_hashremove(b);
+		b->b_dev = NULL;
+		buf_lruaddhead(b);
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back the dirty buffers for blocks LO through HI-1 of DEV.
+ */
+static
+int
+buf_syncrange(struct device *dev, uint32_t lo, uint32_t hi)
+{
+	struct buf *b;
+	unsigned i;
+	int result, err = 0;
+
+	lock_acquire(buf_synclock);
+
+	/*
+	 * First claim every dirty buffer nobody is using, queue
+	 * writes for all of them, and then collect the results.
+	 * Failures, and buffers that were busy, are handled one at a
+	 * time below.
+	 *
+	 * Only the holder of buf_synclock sets or clears B_WRITING,
+	 * so we can test it without buf_lock.
+	 */
+	lock_acquire(buf_lock);
+	for (i = 0; i < BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_dev != dev || b->b_block < lo || b->b_block >= hi ||
+		    (b->b_flags & (B_DIRTY | B_BUSY)) != B_DIRTY) {
+			continue;
+		}
+		buf_lruremove(b);
+		b->b_flags |= B_BUSY | B_WRITING;
+	}
+	lock_release(buf_lock);
+
+	for (i = 0; i < BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_flags & B_WRITING) {
+			buf_setupbio(b, UIO_WRITE);
+			if (bio_start(dev, &b->b_bio)) {
+				panic("buf: block I/O returned EINVAL\n");
+			}
+		}
+	}
+
+	for (i = 0; i < BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if ((b->b_flags & B_WRITING) == 0) {
+			continue;
+		}
+		result = bio_wait(&b->b_bio);
+		lock_acquire(buf_lock);
+		b->b_flags &= ~(B_BUSY | B_WRITING);
+		if (result == 0) {
+			b->b_flags &= ~B_DIRTY;
+		}
+		buf_lruaddtail(b);
+		cv_broadcast(buf_cv, buf_lock);
+		lock_release(buf_lock);
+	}
+
+	lock_acquire(buf_lock);
+	for (i = 0; i < BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		while (b->b_dev == dev && b->b_block >= lo &&
+		       b->b_block < hi && (b->b_flags & B_DIRTY)) {
+			if (b->b_flags & B_BUSY) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			result = buf_writeback(b);
+			if (result) {
+				/* report it, but still try the others */
+				err = result;
+				break;
+			}
+		}
+	}
+	lock_release(buf_lock);
+
+	lock_release(buf_synclock);
+	return err;
+}
+
+int
+buf_sync(struct device *dev)
+{
+	return buf_syncrange(dev, 0, (uint32_t)-1);
+}
+
+int
+buf_flush(struct device *dev, uint32_t block, uint32_t nblocks)
+{
+	return buf_syncrange(dev, block, block + nblocks);
+}
+
+void
+buf_invalidate(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	buf_reap();
+	for (i = 0; i < BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		while (b->b_dev == dev && (b->b_flags & B_READAHEAD)) {
+			buf_rawait(b);
+		}
+	}
+	for (i = 0; i < BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT((b->b_flags & (B_BUSY | B_DIRTY)) == 0);
+		buf_hashremove(b);
+		b->b_dev = NULL;
+		b->b_flags = 0;
+		buf_lruremove(b);
+		buf_lruaddhead(b);
+	}
+	lock_release(buf_lock);
+}
@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a ring buffer with one vnode for each end. Readers only
+ * ever advance p_tail and writers only ever advance p_head, so once
+ * the readers have been serialized among themselves (p_readlock) and
+ * the writers among themselves (p_writelock), a reader and a writer
+ * can copy data through the ring at the same time without sharing
+ * any lock. The spinlock is only taken to publish a new index and
+ * wake the other side, and to go to sleep when the ring is empty or
+ * full; doing both under it is what keeps wakeups from being lost.
+ *
+ * The indices count bytes transferred since the pipe was made and
+ * are reduced modulo PIPE_SIZE only to address the buffer, so
+ * p_head - p_tail is always the number of bytes in the ring (even
+ * after they wrap around).
+ *
+ * This relies on the hardware not reordering memory accesses, as
+ * the spinlock code does.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <poll.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pipe.h>
+
+/* Size of the ring; must be a power of 2. */
+#define PIPE_SIZE	PAGE_SIZE
+
+struct pipe {
+	struct vnode p_readvn;		/* read end */
+	struct vnode p_writevn;		/* write end */
+
+	char *p_buf;			/* ring buffer, PIPE_SIZE bytes */
+	volatile unsigned p_head;	/* written so far; writers only */
+	volatile unsigned p_tail;	/* read so far; readers only */
+
+	struct lock *p_readlock;	/* serializes readers */
+	struct lock *p_writelock;	/* serializes writers */
+
+	struct spinlock p_lock;		/* for sleeping and the fields below */
+	struct wchan *p_readwchan;	/* readers wait here for data */
+	struct wchan *p_writewchan;	/* writers wait here for space */
+	volatile bool p_readwaiting;	/* a reader is (about to be) asleep */
+	volatile bool p_writewaiting;	/* a writer is (about to be) asleep */
+	struct pollqueue p_readpoll;	/* pollers waiting for data */
+	struct pollqueue p_writepoll;	/* pollers waiting for space */
+	volatile bool p_readopen;	/* read end not yet closed */
+	volatile bool p_writeopen;	/* write end not yet closed */
+	unsigned p_nvnodes;		/* ends not yet reclaimed */
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	pollqueue_cleanup(&p->p_writepoll);
+	pollqueue_cleanup(&p->p_readpoll);
+	spinlock_cleanup(&p->p_lock);
+	if (p->p_writewchan != NULL) {
+		wchan_destroy(p->p_writewchan);
+	}
+	if (p->p_readwchan != NULL) {
+		wchan_destroy(p->p_readwchan);
+	}
+	if (p->p_writelock != NULL) {
+		lock_destroy(p->p_writelock);
+	}
+	if (p->p_readlock != NULL) {
+		lock_destroy(p->p_readlock);
+	}
+	if (p->p_buf != NULL) {
+		kfree(p->p_buf);
+	}
+	kfree(p);
+}
+
+int
+pipe_create(struct vnode **readvn, struct vnode **writevn)
+{
+	struct pipe *p;
+	int result;
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	p->p_head = p->p_tail = 0;
+	p->p_readwaiting = p->p_writewaiting = false;
+	p->p_readopen = p->p_writeopen = true;
+	p->p_nvnodes = 2;
+	spinlock_init(&p->p_lock);
+	pollqueue_init(&p->p_readpoll);
+	pollqueue_init(&p->p_writepoll);
+	p->p_buf = kmalloc(PIPE_SIZE);
+	p->p_readlock = lock_create("pipe read");
+	p->p_writelock = lock_create("pipe write");
+	p->p_readwchan = wchan_create("pipe read");
+	p->p_writewchan = wchan_create("pipe write");
+	if (p->p_buf == NULL || p->p_readlock == NULL ||
+	    p->p_writelock == NULL || p->p_readwchan == NULL ||
+	    p->p_writewchan == NULL) {
+		pipe_destroy(p);
+		return ENOMEM;
+	}
+
+	result = VOP_INIT(&p->p_readvn, &pipe_vnode_ops, NULL, p);
+	KASSERT(result == 0);
+	result = VOP_INIT(&p->p_writevn, &pipe_vnode_ops, NULL, p);
+	KASSERT(result == 0);
+
+	/* hand them back open, as vfs_open would */
+	VOP_INCOPEN(&p->p_readvn);
+	VOP_INCOPEN(&p->p_writevn);
+
+	*readvn = &p->p_readvn;
+	*writevn = &p->p_writevn;
+	return 0;
+}
+
+/*
+ * Sleep on WC until READY returns true for P. WAITING is the flag
+ * that tells the other side to wake us up. It is set, READY checked,
+ * and WC locked all under p_lock, and the other side updates its
+ * index and checks the flag under p_lock too, so its wakeup comes
+ * either before the check (which then sees the update) or once we
+ * are on WC.
+ */
+static
+void
+pipe_wait(struct pipe *p, struct wchan *wc, volatile bool *waiting,
+	  bool (*ready)(struct pipe *))
+{
+	spinlock_acquire(&p->p_lock);
+	*waiting = true;
+	while (!ready(p)) {
+		wchan_lock(wc);
+		spinlock_release(&p->p_lock);
+		wchan_sleep(wc);
+		spinlock_acquire(&p->p_lock);
+	}
+	*waiting = false;
+	spinlock_release(&p->p_lock);
+}
+
+/*
+ * Advance INDEX by MOVED bytes and wake the other side, if it is
+ * waiting or being polled for.
+ */
+static
+void
+pipe_advance(struct pipe *p, volatile unsigned *index, unsigned moved,
+	     struct wchan *wc, volatile bool *waiting, struct pollqueue *pq)
+{
+	spinlock_acquire(&p->p_lock);
+	*index += moved;
+	if (*waiting) {
+		wchan_wakeall(wc);
+	}
+	spinlock_release(&p->p_lock);
+	pollqueue_wakeup(pq);
+}
+
+/* A reader can proceed: there is data, or there never will be. */
+static
+bool
+pipe_readready(struct pipe *p)
+{
+	return p->p_head != p->p_tail || !p->p_writeopen;
+}
+
+/* A writer can proceed: there is space, or nobody will ever read it. */
+static
+bool
+pipe_writeready(struct pipe *p)
+{
+	return p->p_head - p->p_tail < PIPE_SIZE || !p->p_readopen;
+}
+
+/*
+ * Move up to LEN bytes between the ring, starting at index POS, and
+ * UIO, handling wraparound. Returns the number of bytes moved in
+ * MOVED, which is short only on error.
+ */
+static
+int
+pipe_uiomove(struct pipe *p, unsigned pos, unsigned len, struct uio *uio,
+	     unsigned *moved)
+{
+	unsigned off, chunk;
+	size_t startresid;
+	int result;
+
+	startresid = uio->uio_resid;
+	off = pos & (PIPE_SIZE - 1);
+	chunk = PIPE_SIZE - off;
+	if (chunk > len) {
+		chunk = len;
+	}
+	result = uiomove(p->p_buf + off, chunk, uio);
+	if (result == 0 && chunk < len) {
+		result = uiomove(p->p_buf, len - chunk, uio);
+	}
+	*moved = startresid - uio->uio_resid;
+	return result;
+}
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	unsigned avail, moved;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	if (v != &p->p_readvn) {
+		return EBADF;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	lock_acquire(p->p_readlock);
+	if (!pipe_readready(p)) {
+		pipe_wait(p, p->p_readwchan, &p->p_readwaiting,
+			  pipe_readready);
+	}
+
+	/* take whatever is there; a short read is fine */
+	avail = p->p_head - p->p_tail;
+	if (avail > uio->uio_resid) {
+		avail = uio->uio_resid;
+	}
+	result = pipe_uiomove(p, p->p_tail, avail, uio, &moved);
+	pipe_advance(p, &p->p_tail, moved, p->p_writewchan,
+		     &p->p_writewaiting, &p->p_writepoll);
+	lock_release(p->p_readlock);
+
+	/* report a partial transfer rather than the fault */
+	if (moved > 0) {
+		return 0;
+	}
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	unsigned space, moved;
+	size_t startresid;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	if (v != &p->p_writevn) {
+		return EBADF;
+	}
+	startresid = uio->uio_resid;
+
+	/* holding the write lock throughout keeps each write atomic */
+	lock_acquire(p->p_writelock);
+	while (uio->uio_resid > 0) {
+		if (!pipe_writeready(p)) {
+			pipe_wait(p, p->p_writewchan, &p->p_writewaiting,
+				  pipe_writeready);
+		}
+		if (!p->p_readopen) {
+			result = EPIPE;
+			break;
+		}
+
+		space = PIPE_SIZE - (p->p_head - p->p_tail);
+		if (space > uio->uio_resid) {
+			space = uio->uio_resid;
+		}
+		result = pipe_uiomove(p, p->p_head, space, uio, &moved);
+		pipe_advance(p, &p->p_head, moved, p->p_readwchan,
+			     &p->p_readwaiting, &p->p_readpoll);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(p->p_writelock);
+
+	if (uio->uio_resid < startresid) {
+		return 0;
+	}
+	return result;
+}
+
+/*
+ * Called for poll(). The read end is readable when a read would not
+ * block, and reports POLLHUP once the write end is closed; the write
+ * end is writable when there is space, and reports POLLERR once the
+ * read end is closed.
+ */
+static
+int
+pipe_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	struct pipe *p = v->vn_data;
+	bool isread = (v == &p->p_readvn);
+	int result;
+
+	if (pw != NULL) {
+		result = pollwaiter_register(pw, isread ? &p->p_readpoll
+						 : &p->p_writepoll);
+		if (result) {
+			return result;
+		}
+	}
+
+	*revents = 0;
+	if (isread) {
+		if (p->p_head != p->p_tail) {
+			*revents |= events & (POLLIN | POLLRDNORM);
+		}
+		if (!p->p_writeopen) {
+			*revents |= POLLHUP;
+		}
+	}
+	else {
+		if (!p->p_readopen) {
+			*revents |= POLLERR;
+		}
+		else if (p->p_head - p->p_tail < PIPE_SIZE) {
+			*revents |= events & (POLLOUT | POLLWRNORM);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Called on the last close of either end: let the other side know
+ * nothing more will happen at this end.
+ */
+static
+int
+pipe_close(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+
+	spinlock_acquire(&p->p_lock);
+	if (v == &p->p_readvn) {
+		p->p_readopen = false;
+		spinlock_release(&p->p_lock);
+		wchan_wakeall(p->p_writewchan);
+		pollqueue_wakeup(&p->p_writepoll);
+	}
+	else {
+		p->p_writeopen = false;
+		spinlock_release(&p->p_lock);
+		wchan_wakeall(p->p_readwchan);
+		pollqueue_wakeup(&p->p_readpoll);
+	}
+	return 0;
+}
+
+/*
+ * Called when an end's vnode is released. The pipe goes away with
+ * the second one.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+	bool last;
+
+	VOP_CLEANUP(v);
+
+	spinlock_acquire(&p->p_lock);
+	KASSERT(p->p_nvnodes > 0);
+	p->p_nvnodes--;
+	last = (p->p_nvnodes == 0);
+	spinlock_release(&p->p_lock);
+
+	if (last) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+static
+int
+pipe_open(struct vnode *v, int openflags)
+{
+	/* pipes are only opened by pipe_create */
+	(void)v;
+	(void)openflags;
+	return EINVAL;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *p = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_mode |= 0600;
+	statbuf->st_size = p->p_head - p->p_tail;
+	statbuf->st_blksize = PIPE_SIZE;
+	statbuf->st_nlink = 1;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+/*
+ * Used for several functions with the same type signature that are
+ * not meaningful on pipes.
+ */
+static
+int
+pipe_nullio(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENOSYS;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v1, const char *n1,
+	    struct vnode *v2, const char *n2)
+{
+	(void)v1;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *pathname, struct vnode **result)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *pathname, struct vnode **result,
+		char *namebuf, size_t buflen)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	(void)namebuf;
+	(void)buflen;
+	return ENOTDIR;
+}
+
+/*
+ * Function table for pipe vnodes.
+ */
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_nullio,  /* readlink */
+	pipe_nullio,  /* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_poll,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_nullio,  /* namefile */
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,  /* remove */
+	pipe_nameop,  /* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name cache. Remembers the results of looking up one path component
+ * in a directory: (directory vnode, name) -> vnode, or "no such
+ * file" for negative entries. Entries hold references on both
+ * vnodes and are recycled in least-recently-used order.
+ *
+ * The vfs_* path operations in vfspath.c invalidate by (fs, name)
+ * after changing a directory, rather than by exact directory, since
+ * some filesystems (emufs) can hand out several vnodes for one
+ * directory. A generation number, bumped on every invalidation,
+ * keeps a lookup that raced with a change from entering a stale
+ * result.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define DCACHE_NENTRIES  256
+#define DCACHE_NHASH     128
+#define DCACHE_NAMELEN   32	/* longer names are not cached */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* NULL if unused */
+	struct vnode *dc_vn;		/* NULL if negative */
+	char dc_name[DCACHE_NAMELEN];
+	struct dcentry *dc_hnext;	/* hash chain */
+	struct dcentry *dc_lrunext;	/* LRU list, newest last */
+	struct dcentry *dc_lruprev;
+};
+
+static struct dcentry dcache[DCACHE_NENTRIES];
+static struct dcentry *dcache_hash[DCACHE_NHASH];
+static struct dcentry *dcache_lruhead, *dcache_lrutail;
+static unsigned dcache_gen;
+static struct spinlock dcache_lock;
+
+/* Hashed by name only, so invalidation by name sees one chain. */
+static
+unsigned
+dcache_hashfn(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_NHASH;
+}
+
+static
+bool
+dcache_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL) {
+		/* device */
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return false;
+	}
+	return strlen(name) < DCACHE_NAMELEN;
+}
+
+static
+void
+dcache_lruremove(struct dcentry *e)
+{
+	if (e->dc_lruprev != NULL) {
+		e->dc_lruprev->dc_lrunext = e->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = e->dc_lrunext;
+	}
+	if (e->dc_lrunext != NULL) {
+		e->dc_lrunext->dc_lruprev = e->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = e->dc_lruprev;
+	}
+}
+
+static
+void
+dcache_lruaddtail(struct dcentry *e)
+{
+	e->dc_lrunext = NULL;
+	e->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = e;
+	}
+	else {
+		dcache_lruhead = e;
+	}
+	dcache_lrutail = e;
+}
+
+static
+void
+dcache_lruaddhead(struct dcentry *e)
+{
+	e->dc_lruprev = NULL;
+	e->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = e;
+	}
+	else {
+		dcache_lrutail = e;
+	}
+	dcache_lruhead = e;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *e;
+
+	for (e = dcache_hash[dcache_hashfn(name)]; e != NULL; e = e->dc_hnext) {
+		if (e->dc_dir == dir && !strcmp(e->dc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Empty an entry and make it the next to be reused. Hands back the
+ * references it held; the caller must drop them after releasing
+ * dcache_lock, since that can sleep.
+ */
+static
+void
+dcache_drop(struct dcentry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry **ep;
+
+	KASSERT(e->dc_dir != NULL);
+
+	ep = &dcache_hash[dcache_hashfn(e->dc_name)];
+	while (*ep != e) {
+		KASSERT(*ep != NULL);
+		ep = &(*ep)->dc_hnext;
+	}
+	*ep = e->dc_hnext;
+	e->dc_hnext = NULL;
+
+	*dir = e->dc_dir;
+	*vn = e->dc_vn;
+	e->dc_dir = NULL;
+	e->dc_vn = NULL;
+
+	dcache_lruremove(e);
+	dcache_lruaddhead(e);
+}
+
+static
+void
+dcache_release(struct vnode *dir, struct vnode *vn)
+{
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_init(&dcache_lock);
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		dcache[i].dc_dir = NULL;
+		dcache[i].dc_vn = NULL;
+		dcache[i].dc_hnext = NULL;
+		dcache_lruaddtail(&dcache[i]);
+	}
+	dcache_gen = 0;
+}
+
+/*
+ * Look up NAME in DIR. On a hit, returns true and hands back a new
+ * reference to the vnode, or NULL if the name is known not to exist.
+ * On a miss, returns false; pass *GEN to vfs_dcache_enter with what
+ * the filesystem says.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name,
+		  struct vnode **ret, unsigned *gen)
+{
+	struct dcentry *e;
+
+	spinlock_acquire(&dcache_lock);
+	*gen = dcache_gen;
+	if (!dcache_cacheable(dir, name)) {
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	e = dcache_find(dir, name);
+	if (e == NULL) {
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+	dcache_lruremove(e);
+	dcache_lruaddtail(e);
+	if (e->dc_vn != NULL) {
+		VOP_INCREF(e->dc_vn);
+	}
+	*ret = e->dc_vn;
+	spinlock_release(&dcache_lock);
+	return true;
+}
+
+/*
+ * Remember that NAME in DIR is VN (or, if VN is NULL, doesn't exist).
+ * Ignored if anything was invalidated since the lookup that got GEN.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct dcentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (!dcache_cacheable(dir, name)) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_lock);
+	if (gen != dcache_gen || dcache_find(dir, name) != NULL) {
+		spinlock_release(&dcache_lock);
+		return;
+	}
+
+	e = dcache_lruhead;
+	if (e->dc_dir != NULL) {
+		dcache_drop(e, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	e->dc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->dc_vn = vn;
+	strcpy(e->dc_name, name);
+
+	e->dc_hnext = dcache_hash[dcache_hashfn(name)];
+	dcache_hash[dcache_hashfn(name)] = e;
+	dcache_lruremove(e);
+	dcache_lruaddtail(e);
+	spinlock_release(&dcache_lock);
+
+	dcache_release(olddir, oldvn);
+}
+
+/*
+ * NAME changed in some directory on FS: forget it in every directory
+ * there, and forget what was cached under whatever it used to be.
+ */
+void
+vfs_dcache_invalidate(struct fs *fs, const char *name)
+{
+	struct dcentry *e, *sub;
+	struct vnode *dir, *vn, *subdir, *subvn;
+	unsigned i;
+
+	spinlock_acquire(&dcache_lock);
+	dcache_gen++;
+	while (1) {
+		for (e = dcache_hash[dcache_hashfn(name)]; e != NULL;
+		     e = e->dc_hnext) {
+			if (e->dc_dir->vn_fs == fs &&
+			    !strcmp(e->dc_name, name)) {
+				break;
+			}
+		}
+		if (e == NULL) {
+			break;
+		}
+		dcache_drop(e, &dir, &vn);
+
+		/* If it was a directory, its own entries are stale too */
+		for (i=0; vn != NULL && i<DCACHE_NENTRIES; i++) {
+			sub = &dcache[i];
+			if (sub->dc_dir == vn) {
+				dcache_drop(sub, &subdir, &subvn);
+				spinlock_release(&dcache_lock);
+				dcache_release(subdir, subvn);
+				spinlock_acquire(&dcache_lock);
+			}
+		}
+
+		spinlock_release(&dcache_lock);
+		dcache_release(dir, vn);
+		spinlock_acquire(&dcache_lock);
+	}
+	spinlock_release(&dcache_lock);
+}
+
+/*
+ * Forget everything on FS; it is being unmounted.
+ */
+void
+vfs_dcache_purgefs(struct fs *fs)
+{
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	spinlock_acquire(&dcache_lock);
+	dcache_gen++;
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		if (dcache[i].dc_dir != NULL && dcache[i].dc_dir->vn_fs == fs) {
+			dcache_drop(&dcache[i], &dir, &vn);
+			spinlock_release(&dcache_lock);
+			dcache_release(dir, vn);
+			spinlock_acquire(&dcache_lock);
+		}
+	}
+	spinlock_release(&dcache_lock);
+}
@@ -87,7 +87,11 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
+/*
+ * The VFS lock. It now covers only the mount table (knowndevs), the
+ * boot filesystem vnode, and filesystems that do no locking of their
+ * own (emufs); sfs locks per vnode.
+ */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
@@ -109,6 +113,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_dcache_bootstrap();
+
 	devnull_create();
 }
 
@@ -571,6 +577,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* The name cache holds vnodes; let them go */
+	vfs_dcache_purgefs(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -619,6 +628,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_dcache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -40,6 +40,7 @@
 #include <fs.h>
 #include <vnode.h>
 
+/* Protected by vfs_biglock, along with the mount table. */
 static struct vnode *bootfs_vnode = NULL;
 
 /*
@@ -133,8 +134,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -171,7 +170,9 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 		}
 		*subpath = &path[colon+1];
 		
+		vfs_biglock_acquire();
 		result = vfs_getroot(path, startvn);
+		vfs_biglock_release();
 		if (result) {
 			return result;
 		}
@@ -188,11 +189,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		vfs_biglock_acquire();
 		if (bootfs_vnode==NULL) {
+			vfs_biglock_release();
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		vfs_biglock_release();
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -223,6 +227,79 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up a single path component NAME in directory DIR, going
+ * through the name cache.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (vfs_dcache_lookup(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == 0) {
+		vfs_dcache_enter(dir, name, vn, gen);
+		*ret = vn;
+	}
+	else if (result == ENOENT) {
+		vfs_dcache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Walk PATH from VN one component at a time, so that each step can
+ * be answered by the name cache. Consumes the reference to VN.
+ */
+static
+int
+lookup_walk(struct vnode *vn, char *path, struct vnode **ret)
+{
+	struct vnode *next;
+	char *end;
+	int result;
+
+	while (1) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			break;
+		}
+
+		end = strchr(path, '/');
+		if (end != NULL) {
+			*end = 0;
+		}
+
+		result = lookup_component(vn, path, &next);
+		VOP_DECREF(vn);
+		if (result) {
+			return result;
+		}
+		vn = next;
+
+		if (end == NULL) {
+			break;
+		}
+		path = end+1;
+	}
+
+	*ret = vn;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -232,32 +309,49 @@ int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *last;
+	size_t len;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	if (strlen(path)==0) {
+	/* Split off the last component, ignoring trailing slashes */
+	len = strlen(path);
+	while (len > 0 && path[len-1] == '/') {
+		path[--len] = 0;
+	}
+
+	if (len==0) {
 		/*
 		 * It does not make sense to use just a device name in
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		return EINVAL;
+	}
+
+	last = strrchr(path, '/');
+	if (last == NULL) {
+		last = path;
+		dir = startvn;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		*last++ = 0;
+		result = lookup_walk(startvn, path, &dir);
+		if (result) {
+			return result;
+		}
 	}
 
-	VOP_DECREF(startvn);
+	/* Let the filesystem check the directory and the name */
+	result = VOP_LOOKPARENT(dir, last, retval, buf, buflen);
 
-	vfs_biglock_release();
+	VOP_DECREF(dir);
 	return result;
 }
 
@@ -267,23 +361,10 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	if (strlen(path)==0) {
-		*retval = startvn;
-		vfs_biglock_release();
-		return 0;
-	}
-
-	result = VOP_LOOKUP(startvn, path, retval);
-
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	return lookup_walk(startvn, path, retval);
 }
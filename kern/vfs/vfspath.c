@@ -74,6 +74,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			vfs_dcache_invalidate(dir->vn_fs, name);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +153,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_dcache_invalidate(dir->vn_fs, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +187,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_dcache_invalidate(olddir->vn_fs, oldname);
+	vfs_dcache_invalidate(newdir->vn_fs, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +223,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_dcache_invalidate(newdir->vn_fs, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +251,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_dcache_invalidate(newdir->vn_fs, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +298,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_dcache_invalidate(parent->vn_fs, name);
 
 	VOP_DECREF(parent);
 
@@ -312,6 +321,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_dcache_invalidate(parent->vn_fs, name);
 
 	VOP_DECREF(parent);
 
@@ -29,7 +29,10 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -103,14 +106,28 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref *prev_samesize;
 	struct pageref *next_all;
+	struct pageref *prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
+	struct kmblock *blocks;		/* tracing info, or NULL */
 };
 
 #define INVALID_OFFSET   (0xffff)
 
+/*
+ * Per-block tracing info, kept in a separate page per heap page while
+ * heap tracing is on (see "Accounting and leak tracking" below).
+ * A tag of 0 means nothing is known about the block.
+ */
+struct kmblock {
+	uint16_t tag;		/* index into kmtags[] */
+	uint16_t reqsize;	/* size the caller asked for */
+	uint32_t epoch;		/* kheap_snapshot epoch at allocation */
+};
+
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
@@ -118,67 +135,102 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pageref structures are carved out of whole pages obtained from
+ * alloc_kpages as needed, and kept on a freelist (threaded through
+ * next_all) when not in use. Pages of pagerefs are never given back;
+ * there are PAGE_SIZE / sizeof(struct pageref) of them per page, so
+ * this costs well under 1% of the heap.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+static struct pageref *pagerefs_free;
+static unsigned pagerefs_total;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+/* Add a fresh page of pagerefs to the freelist. */
+static
+void
+addpagerefs(vaddr_t page)
+{
+	struct pageref *prs = (struct pageref *)page;
+	unsigned i, n;
+
+	n = PAGE_SIZE / sizeof(struct pageref);
+	for (i=0; i<n; i++) {
+		prs[i].next_all = pagerefs_free;
+		pagerefs_free = &prs[i];
+	}
+	pagerefs_total += n;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	pr = pagerefs_free;
+	if (pr != NULL) {
+		pagerefs_free = pr->next_all;
 	}
+	return pr;
+}
 
-	/* ran out */
-	return NULL;
+static
+void
+freepageref(struct pageref *pr)
+{
+	pr->pageaddr_and_blocktype = 0;
+	pr->next_all = pagerefs_free;
+	pagerefs_free = pr;
+}
+
+////////////////////////////////////////
+
+/*
+ * Map from physical page to the pageref describing it, so kfree can
+ * find a block's page in constant time. Kernel heap pages are always
+ * direct-mapped in kseg0, so the physical page number is just the
+ * offset from MIPS_KSEG0.
+ *
+ * The map is two-level: a fixed top-level table, and one-page leaf
+ * tables allocated the first time a page in their range joins the
+ * heap. With 4k pages a leaf covers 4M of physical memory.
+ */
+
+#define PRMAP_LEAFSIZE  (PAGE_SIZE / sizeof(struct pageref *))
+#define PRMAP_NPAGES    ((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE)
+#define PRMAP_NLEAVES   (PRMAP_NPAGES / PRMAP_LEAFSIZE)
+
+static struct pageref **prmap[PRMAP_NLEAVES];
+
+/* Return the slot for the page containing VADDR, or NULL if none. */
+static
+struct pageref **
+prmap_slot(vaddr_t vaddr)
+{
+	unsigned ppn;
+
+	if (vaddr < MIPS_KSEG0 || vaddr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	ppn = (vaddr - MIPS_KSEG0) / PAGE_SIZE;
+	if (prmap[ppn / PRMAP_LEAFSIZE] == NULL) {
+		return NULL;
+	}
+	return &prmap[ppn / PRMAP_LEAFSIZE][ppn % PRMAP_LEAFSIZE];
 }
 
+/* Install a zeroed leaf table (in PAGE) covering VADDR. */
 static
 void
-freepageref(struct pageref *p)
+prmap_addleaf(vaddr_t vaddr, vaddr_t page)
 {
-	size_t i, j;
-	uint32_t k;
+	unsigned ppn;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(vaddr >= MIPS_KSEG0 && vaddr < MIPS_KSEG1);
+	ppn = (vaddr - MIPS_KSEG0) / PAGE_SIZE;
+	KASSERT(prmap[ppn / PRMAP_LEAFSIZE] == NULL);
+	bzero((void *)page, PAGE_SIZE);
+	prmap[ppn / PRMAP_LEAFSIZE] = (struct pageref **)page;
 }
 
 ////////////////////////////////////////
@@ -189,10 +241,8 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their freelists. Most traffic
+ * never gets here, though: see the per-cpu caches below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -260,14 +310,15 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < pagerefs_total);
+			KASSERT(*prmap_slot(PR_PAGEADDR(pr)) == pr);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < pagerefs_total);
 		ac++;
 	}
 
@@ -331,7 +382,7 @@ dumpsubpage(struct pageref *pr)
 }
 
 void
-kheap_printstats(void)
+kheap_dumppages(void)
 {
 	struct pageref *pr;
 
@@ -353,25 +404,31 @@ static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	if (pr->prev_all != NULL) {
+		pr->prev_all->next_all = pr->next_all;
+	}
+	else {
+		KASSERT(allbase == pr);
+		allbase = pr->next_all;
 	}
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
+	}
+
+	*prmap_slot(PR_PAGEADDR(pr)) = NULL;
 }
 
 static
@@ -392,26 +449,22 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block of type BLKTYPE off an existing page, or return NULL
+ * if no page of that type has a free block. Called with
+ * kmalloc_spinlock held.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_pop(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -420,9 +473,6 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
@@ -442,43 +492,93 @@ subpage_kmalloc(size_t sz)
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
+			return retptr;
+		}
+	}
+	return NULL;
+}
 
-			checksubpages();
+/*
+ * Make sure there is a free pageref and a prmap leaf for PRPAGE,
+ * getting pages for them as needed. Called with kmalloc_spinlock
+ * held; releases it around alloc_kpages. Returns nonzero if out of
+ * memory.
+ */
+static
+int
+subpage_reserve(vaddr_t prpage)
+{
+	vaddr_t page;
 
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	while (pagerefs_free == NULL || prmap_slot(prpage) == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		page = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (page == 0) {
+			return 1;
+		}
+		/* recheck; things may have changed while unlocked */
+		if (pagerefs_free == NULL) {
+			addpagerefs(page);
+		}
+		else if (prmap_slot(prpage) == NULL) {
+			prmap_addleaf(prpage, page);
+		}
+		else {
 			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+			free_kpages(page);
+			spinlock_acquire(&kmalloc_spinlock);
 		}
 	}
+	return 0;
+}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
+/*
+ * Get a fresh page, carve it into blocks of type BLKTYPE, and put it
+ * on the lists. Called with kmalloc_spinlock held; releases it while
+ * calling alloc_kpages, so this avoids deadlock if alloc_kpages needs
+ * to come back here. Note that this means things can change behind
+ * our back... Returns nonzero if out of memory.
+ */
+static
+int
+subpage_addpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+
+	volatile int i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return 1;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
+	if (subpage_reserve(prpage)) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return 1;
 	}
+	pr = allocpageref();
+	KASSERT(pr != NULL);
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->blocks = NULL;
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -498,58 +598,324 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
+	pr->prev_samesize = NULL;
 	pr->next_samesize = sizebases[blktype];
+	if (sizebases[blktype] != NULL) {
+		sizebases[blktype]->prev_samesize = pr;
+	}
 	sizebases[blktype] = pr;
 
+	pr->prev_all = NULL;
 	pr->next_all = allbase;
+	if (allbase != NULL) {
+		allbase->prev_all = pr;
+	}
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	KASSERT(*prmap_slot(prpage) == NULL);
+	*prmap_slot(prpage) = pr;
+
+	return 0;
+}
+
+/*
+ * Move up to N blocks of type BLKTYPE into VEC, adding pages as
+ * needed. Returns the number of blocks moved, which is 0 only if out
+ * of memory.
+ */
+static
+unsigned
+subpage_kmalloc_batch(unsigned blktype, void **vec, unsigned n)
+{
+	unsigned got;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (got = 0; got < n; got++) {
+		vec[got] = subpage_pop(blktype);
+		if (vec[got] == NULL) {
+			/* only go for a new page if we have nothing at all */
+			if (got > 0 || subpage_addpage(blktype)) {
+				break;
+			}
+			vec[got] = subpage_pop(blktype);
+			KASSERT(vec[got] != NULL);
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	void *retptr;
+
+	if (subpage_kmalloc_batch(blocktype(sz), &retptr, 1) == 0) {
+		return NULL;
+	}
+	return retptr;
+}
+
+/*
+ * Find the pageref for the page containing PTRADDR, or NULL if it
+ * isn't on any of our pages. Called with kmalloc_spinlock held.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref **slot;
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	slot = prmap_slot(ptraddr);
+	if (slot == NULL || *slot == NULL) {
+		return NULL;
+	}
+	pr = *slot;
+
+	/* check for corruption */
+	KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+	KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+	checksubpage(pr);
+
+	return pr;
 }
 
+/*
+ * Return the size class of a subpage block that is being freed, or -1
+ * if PTR is not a subpage allocation.
+ *
+ * This is on every kfree, so it doesn't take kmalloc_spinlock. While
+ * the caller owns the block its page can't leave the heap, so its
+ * prmap slot and pageref hold still; prmap leaves and pagerefs are
+ * never given back, so reading a slot is always safe. Likewise the
+ * block's tracing entry belongs to the caller, and nobody else writes
+ * it until the block is handed out again.
+ */
 static
 int
-subpage_kfree(void *ptr)
+subpage_blocktype(void *ptr)
+{
+	struct pageref **slot;
+	struct pageref *pr;
+	struct kmblock *blocks;
+	vaddr_t offset;
+	int blktype;
+
+	slot = prmap_slot((vaddr_t)ptr);
+	if (slot == NULL || *slot == NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+	pr = *slot;
+	KASSERT(PR_PAGEADDR(pr) == ((vaddr_t)ptr & PAGE_FRAME));
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/* the block is no longer the caller's; forget who allocated it */
+	blocks = pr->blocks;
+	if (blocks != NULL) {
+		blocks[offset / sizes[blktype]].tag = 0;
+	}
+
+	return blktype;
+}
+
+/*
+ * Put N already-deadbeefed blocks back on their pages, releasing any
+ * page that becomes completely free.
+ */
+static
+void
+subpage_kfree_batch(void **vec, unsigned n)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
+	int blktype;		// index into sizes[] that we're using
+	struct kmblock *blocks;	// pr->blocks
+	unsigned i;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (i=0; i<n; i++) {
+		pr = subpage_findpage((vaddr_t)vec[i]);
+		KASSERT(pr != NULL);
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
+		offset = (vaddr_t)vec[i] - prpage;
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+		/*
+		 * We probably ought to check for free twice by seeing
+		 * if the block is already on the free list. But that's
+		 * expensive, so we don't.
+		 */
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		fla = prpage + offset;
+		fl = (struct freelist *)fla;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			blocks = pr->blocks;
+			remove_lists(pr, blktype);
+			freepageref(pr);
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(prpage);
+			if (blocks != NULL) {
+				free_kpages((vaddr_t)blocks);
+			}
+			spinlock_acquire(&kmalloc_spinlock);
 		}
 	}
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu caches.
+//
+// Each cpu keeps a small stack of free blocks for each size class.
+// kmalloc and kfree work on the current cpu's stacks with interrupts
+// off (which also keeps the thread from migrating) and only take
+// kmalloc_spinlock to move a batch of blocks between a stack and the
+// shared pages: refilling CPUCACHE_BATCH blocks when a stack runs
+// dry, and draining CPUCACHE_BATCH when one fills up.
+//
+// Blocks sitting in a cpu cache look allocated to the page-level
+// code, so a page with cached blocks is never released. The caches
+// are small enough that this doesn't matter.
+//
+
+#define CPUCACHE_MAX    16
+#define CPUCACHE_BATCH  (CPUCACHE_MAX / 2)
+
+struct kmalloc_cpucache {
+	struct {
+		unsigned count;
+		void *blocks[CPUCACHE_MAX];
+	} kc_sizes[NSIZES];
+	struct kmalloc_cpucache *kc_next;	/* for statistics */
+};
+
+/* all cpu caches, protected by kmalloc_spinlock */
+static struct kmalloc_cpucache *allcpucaches;
+
+/*
+ * Return the current cpu's cache, creating it if needed, or NULL if
+ * we couldn't get one. Called at splhigh.
+ */
+static
+struct kmalloc_cpucache *
+cpucache_get(void)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned i;
+
+	KASSERT(CURCPU_EXISTS());
+	kc = curcpu->c_kmcache;
+	if (kc != NULL) {
+		return kc;
 	}
 
-	offset = ptraddr - prpage;
+	/* curcpu can't change under us since interrupts are off */
+	kc = subpage_kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_sizes[i].count = 0;
+	}
+	spinlock_acquire(&kmalloc_spinlock);
+	kc->kc_next = allcpucaches;
+	allcpucaches = kc;
+	spinlock_release(&kmalloc_spinlock);
+	curcpu->c_kmcache = kc;
+	return kc;
+}
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+static
+void *
+cpucache_kmalloc(size_t sz)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned blktype;
+	void *retptr;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* early boot; no cpus (or spl) yet */
+		return subpage_kmalloc(sz);
+	}
+	blktype = blocktype(sz);
+
+	spl = splhigh();
+	kc = cpucache_get();
+	if (kc == NULL) {
+		splx(spl);
+		return subpage_kmalloc(sz);
+	}
+	if (kc->kc_sizes[blktype].count == 0) {
+		kc->kc_sizes[blktype].count =
+			subpage_kmalloc_batch(blktype,
+					      kc->kc_sizes[blktype].blocks,
+					      CPUCACHE_BATCH);
+		if (kc->kc_sizes[blktype].count == 0) {
+			splx(spl);
+			return NULL;
+		}
+	}
+	retptr = kc->kc_sizes[blktype].blocks[--kc->kc_sizes[blktype].count];
+	splx(spl);
+
+	return retptr;
+}
+
+/*
+ * Free a subpage block. Returns -1 if PTR is not a subpage allocation.
+ */
+static
+int
+cpucache_kfree(void *ptr)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned count;
+	int blktype;
+	int spl;
+
+	blktype = subpage_blocktype(ptr);
+	if (blktype < 0) {
+		return -1;
 	}
 
 	/*
@@ -558,33 +924,30 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	if (!CURCPU_EXISTS()) {
+		subpage_kfree_batch(&ptr, 1);
+		return 0;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	spl = splhigh();
+	kc = cpucache_get();
+	if (kc == NULL) {
+		splx(spl);
+		subpage_kfree_batch(&ptr, 1);
+		return 0;
+	}
+	count = kc->kc_sizes[blktype].count;
+	if (count == CPUCACHE_MAX) {
+		/* give back the older half, keep the recently freed ones */
+		subpage_kfree_batch(kc->kc_sizes[blktype].blocks,
+				    CPUCACHE_BATCH);
+		memmove(kc->kc_sizes[blktype].blocks,
+			kc->kc_sizes[blktype].blocks + CPUCACHE_BATCH,
+			(CPUCACHE_MAX - CPUCACHE_BATCH) * sizeof(void *));
+		count -= CPUCACHE_BATCH;
 	}
+	kc->kc_sizes[blktype].blocks[count++] = ptr;
+	kc->kc_sizes[blktype].count = count;
+	splx(spl);
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -595,9 +958,329 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Accounting and leak tracking.
+//
+// Per-size-class usage is always available: it is computed on demand
+// from the page freecounts and the per-cpu caches, so it costs
+// nothing on the allocation path.
+//
+// Per-caller information is only kept while heap tracing is on
+// (kheap_settrace). The kmalloc macro in <lib.h> passes the caller's
+// __FILE__ and __LINE__; each distinct pair is interned in kmtags[]
+// and the tag index, requested size and current epoch are recorded
+// in the kmblock for the returned block. Tracing costs a trip
+// through kmalloc_spinlock per allocation and an extra page per heap
+// page, so it's for debugging only. Blocks allocated before tracing
+// was turned on show up as untagged.
+//
+// kheap_snapshot starts a new epoch and remembers the per-class
+// usage; kheap_leakreport then shows what changed since, and which
+// callers own the traced blocks allocated in the new epoch that are
+// still live. Run a test in between to find what it leaked.
+//
+
+#define KMTAG_MAX  509		/* prime, for hashing */
+
+struct kmtag {
+	const char *file;
+	int line;
+	unsigned count;		/* scratch space for reports */
+	size_t bytes;		/* ditto */
+};
+
+/* slot 0 is reserved for "no tag"; all protected by kmalloc_spinlock */
+static struct kmtag kmtags[KMTAG_MAX];
+static bool kmalloc_trace;
+static uint32_t kmalloc_epoch;
+static unsigned kmalloc_snapinuse[NSIZES];
+
+/*
+ * Find or create the tag for FILE:LINE. Returns 0 if the table is
+ * full. FILE is a string constant, so we compare pointers.
+ */
+static
+uint16_t
+kmtag_get(const char *file, int line)
+{
+	unsigned i, start;
+
+	start = ((uintptr_t)file ^ ((unsigned)line * 31)) % KMTAG_MAX;
+	i = start;
+	do {
+		if (i != 0) {
+			if (kmtags[i].file == NULL) {
+				kmtags[i].file = file;
+				kmtags[i].line = line;
+				return i;
+			}
+			if (kmtags[i].file == file && kmtags[i].line == line) {
+				return i;
+			}
+		}
+		i = (i + 1) % KMTAG_MAX;
+	} while (i != start);
+	return 0;
+}
+
+/*
+ * Record that PTR, a subpage block of REQSIZE bytes, was just handed
+ * to FILE:LINE.
+ */
+static
+void
+kmtrack_alloc(void *ptr, size_t reqsize, const char *file, int line)
+{
+	struct pageref *pr;
+	struct kmblock *blocks;
+	vaddr_t newpage;
+	unsigned index;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = subpage_findpage((vaddr_t)ptr);
+	KASSERT(pr != NULL);
+
+	if (pr->blocks == NULL) {
+		/* the page can't go away; we hold one of its blocks */
+		spinlock_release(&kmalloc_spinlock);
+		newpage = alloc_kpages(1);
+		if (newpage != 0) {
+			bzero((void *)newpage, PAGE_SIZE);
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		if (newpage == 0) {
+			spinlock_release(&kmalloc_spinlock);
+			return;
+		}
+		if (pr->blocks != NULL) {
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(newpage);
+			spinlock_acquire(&kmalloc_spinlock);
+		}
+		else {
+			pr->blocks = (struct kmblock *)newpage;
+		}
+	}
+	blocks = pr->blocks;
+
+	index = ((vaddr_t)ptr - PR_PAGEADDR(pr)) / sizes[PR_BLOCKTYPE(pr)];
+	KASSERT(index * sizeof(struct kmblock) < PAGE_SIZE);
+	blocks[index].tag = kmtag_get(file, line);
+	blocks[index].reqsize = reqsize;
+	blocks[index].epoch = kmalloc_epoch;
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Compute blocks in use per size class, and the number of heap pages
+ * per class. Called with kmalloc_spinlock held. The per-cpu counts
+ * are read without their owners' cooperation, so the result is only
+ * a snapshot.
+ */
+static
+void
+kheap_usage(unsigned *inuse, unsigned *npages)
+{
+	struct pageref *pr;
+	struct kmalloc_cpucache *kc;
+	unsigned i, blktype;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<NSIZES; i++) {
+		inuse[i] = 0;
+		npages[i] = 0;
+	}
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		blktype = PR_BLOCKTYPE(pr);
+		npages[blktype]++;
+		inuse[blktype] += PAGE_SIZE / sizes[blktype] - pr->nfree;
+	}
+	for (kc = allcpucaches; kc != NULL; kc = kc->kc_next) {
+		for (i=0; i<NSIZES; i++) {
+			inuse[i] -= kc->kc_sizes[i].count;
+		}
+	}
+}
+
+/*
+ * Add up the traced blocks per tag into kmtags[].count/bytes. If
+ * SINCE_SNAPSHOT, only count blocks allocated in the current epoch.
+ * Returns the total requested bytes counted; the number of blocks and
+ * the bytes they actually occupy go in NTRACED and BLKBYTES. Called
+ * with kmalloc_spinlock held.
+ */
+static
+size_t
+kmtags_tally(bool since_snapshot, unsigned *ntraced, size_t *blkbytes)
+{
+	struct pageref *pr;
+	struct kmblock *b;
+	unsigned i, n;
+	size_t total;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<KMTAG_MAX; i++) {
+		kmtags[i].count = 0;
+		kmtags[i].bytes = 0;
+	}
+	total = 0;
+	*ntraced = 0;
+	*blkbytes = 0;
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		if (pr->blocks == NULL) {
+			continue;
+		}
+		n = PAGE_SIZE / sizes[PR_BLOCKTYPE(pr)];
+		for (i=0; i<n; i++) {
+			b = &pr->blocks[i];
+			if (b->tag == 0) {
+				continue;
+			}
+			if (since_snapshot && b->epoch != kmalloc_epoch) {
+				continue;
+			}
+			kmtags[b->tag].count++;
+			kmtags[b->tag].bytes += b->reqsize;
+			total += b->reqsize;
+			*blkbytes += sizes[PR_BLOCKTYPE(pr)];
+			(*ntraced)++;
+		}
+	}
+	return total;
+}
+
+static
+void
+kmtags_print(void)
+{
+	char caller[64];
+	unsigned i;
+
+	kprintf("    %-32s %8s %8s\n", "caller", "blocks", "bytes");
+	for (i=1; i<KMTAG_MAX; i++) {
+		if (kmtags[i].count == 0) {
+			continue;
+		}
+		/* one field, so a long file name can't skew the columns */
+		snprintf(caller, sizeof(caller), "%s:%d",
+			 kmtags[i].file, kmtags[i].line);
+		kprintf("    %-32s %8u %8lu\n", caller, kmtags[i].count,
+			(unsigned long)kmtags[i].bytes);
+	}
+}
+
+void
+kheap_printstats(void)
+{
+	unsigned inuse[NSIZES], npages[NSIZES];
+	unsigned i, totpages, ntraced;
+	size_t inusebytes, reqbytes, blkbytes;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kheap_usage(inuse, npages);
+
+	kprintf("Kernel heap (subpage allocations):\n");
+	kprintf("    %5s %8s %8s %6s\n", "size", "blocks", "bytes", "pages");
+	totpages = 0;
+	inusebytes = 0;
+	for (i=0; i<NSIZES; i++) {
+		kprintf("    %5lu %8u %8lu %6u\n",
+			(unsigned long)sizes[i], inuse[i],
+			(unsigned long)(inuse[i] * sizes[i]), npages[i]);
+		totpages += npages[i];
+		inusebytes += inuse[i] * sizes[i];
+	}
+	kprintf("    %u pages (%lu bytes), %lu bytes in use, "
+		"%lu%% free space in heap pages\n",
+		totpages, (unsigned long)totpages * PAGE_SIZE,
+		(unsigned long)inusebytes,
+		totpages == 0 ? 0UL : (unsigned long)
+		(100 - inusebytes * 100 / (totpages * PAGE_SIZE)));
+
+	if (kmalloc_trace) {
+		reqbytes = kmtags_tally(false, &ntraced, &blkbytes);
+		kprintf("Traced allocations: %u blocks, %lu bytes requested "
+			"in %lu bytes of blocks (%lu%% lost to rounding)\n",
+			ntraced, (unsigned long)reqbytes,
+			(unsigned long)blkbytes,
+			blkbytes == 0 ? 0UL :
+			(unsigned long)(100 - reqbytes * 100 / blkbytes));
+		kmtags_print();
+	}
+	else {
+		kprintf("(heap tracing off; \"kh trace on\" for per-caller "
+			"info)\n");
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+void
+kheap_settrace(bool on)
+{
+	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_trace = on;
+	spinlock_release(&kmalloc_spinlock);
+}
+
+void
+kheap_snapshot(void)
+{
+	unsigned npages[NSIZES];
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_epoch++;
+	kheap_usage(kmalloc_snapinuse, npages);
+	spinlock_release(&kmalloc_spinlock);
+}
+
+void
+kheap_leakreport(void)
+{
+	unsigned inuse[NSIZES], npages[NSIZES];
+	unsigned i, ntraced;
+	size_t bytes, blkbytes;
+	long delta, totdelta;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kheap_usage(inuse, npages);
+
+	kprintf("Kernel heap change since snapshot:\n");
+	totdelta = 0;
+	for (i=0; i<NSIZES; i++) {
+		delta = (long)inuse[i] - (long)kmalloc_snapinuse[i];
+		if (delta != 0) {
+			kprintf("    size %4lu: %ld blocks\n",
+				(unsigned long)sizes[i], delta);
+		}
+		totdelta += delta * (long)sizes[i];
+	}
+	kprintf("    net %ld bytes\n", totdelta);
+
+	if (kmalloc_trace) {
+		bytes = kmtags_tally(true, &ntraced, &blkbytes);
+		kprintf("Traced blocks allocated since snapshot and still live: "
+			"%u (%lu bytes requested, %lu allocated)\n", ntraced,
+			(unsigned long)bytes, (unsigned long)blkbytes);
+		kmtags_print();
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+/* <lib.h> makes kmalloc a macro for kmalloc_tagged; this is the real one */
+#undef kmalloc
+
 void *
 kmalloc(size_t sz)
 {
@@ -615,7 +1298,19 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	return cpucache_kmalloc(sz);
+}
+
+void *
+kmalloc_tagged(size_t sz, const char *file, int line)
+{
+	void *ptr;
+
+	ptr = kmalloc(sz);
+	if (ptr != NULL && kmalloc_trace && sz < LARGEST_SUBPAGE_SIZE) {
+		kmtrack_alloc(ptr, sz, file, line);
+	}
+	return ptr;
 }
 
 void
@@ -626,9 +1321,8 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	} else if (cpucache_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
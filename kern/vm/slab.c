@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * Object cache ("slab") allocator.
+ *
+ * Each slab is one page obtained from alloc_kpages. The page starts
+ * with a struct slab header, followed by a stack of free object
+ * indexes, followed by the objects themselves:
+ *
+ *    +------------+----------------+-------+-------+-----+-------+
+ *    | struct slab| freestack[n]   | obj 0 | obj 1 | ... | obj n-1
+ *    +------------+----------------+-------+-------+-----+-------+
+ *
+ * Because free objects stay constructed, we cannot thread the free
+ * list through the objects the way the subpage allocator in kmalloc.c
+ * does; hence the separate index stack. Because slabs are page
+ * aligned, the slab owning an object is found by masking the object's
+ * address with PAGE_FRAME, so free is O(1).
+ *
+ * Each cache keeps three lists of slabs: partial (some objects free),
+ * full (no objects free), and empty (all objects free). Allocation
+ * prefers partial slabs so that empty ones can eventually be handed
+ * back. We keep up to SLAB_MAXEMPTY empty slabs around to absorb
+ * alloc/free churn without going back to the page allocator and
+ * rerunning constructors.
+ *
+ * Constructors and destructors may sleep (e.g. lock_create), so they
+ * are never called with the cache spinlock held.
+ */
+
+#define SLAB_ALIGN     8
+#define SLAB_MAXEMPTY  2
+#define SLAB_MAGIC     0x51ab51ab
+
+struct slab {
+	unsigned sl_magic;
+	struct kmem_cache *sl_cache;
+	struct slab *sl_next;
+	struct slab *sl_prev;
+	unsigned sl_nfree;
+	uint16_t sl_freestack[];	/* indexes of free objects */
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_objsize;		/* rounded to SLAB_ALIGN */
+	unsigned kc_perslab;		/* objects per slab */
+	size_t kc_objoffset;		/* offset of object 0 in a slab */
+	int (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct spinlock kc_lock;
+	struct slab *kc_partial;
+	struct slab *kc_full;
+	struct slab *kc_empty;
+	unsigned kc_nempty;
+	unsigned kc_nslabs;
+	unsigned kc_inuse;		/* objects handed out */
+};
+
+////////////////////////////////////////////////////////////
+//
+// Slab list handling.
+
+static
+void
+slab_unlink(struct slab **list, struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*list == sl);
+		*list = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+static
+void
+slab_push(struct slab **list, struct slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list != NULL) {
+		(*list)->sl_prev = sl;
+	}
+	*list = sl;
+}
+
+static
+inline
+void *
+slab_obj(struct kmem_cache *kc, struct slab *sl, unsigned index)
+{
+	KASSERT(index < kc->kc_perslab);
+	return (char *)sl + kc->kc_objoffset + index * kc->kc_objsize;
+}
+
+static
+inline
+unsigned
+slab_index(struct kmem_cache *kc, struct slab *sl, void *obj)
+{
+	vaddr_t offset;
+
+	offset = (vaddr_t)obj - (vaddr_t)sl;
+	if (offset < kc->kc_objoffset ||
+	    (offset - kc->kc_objoffset) % kc->kc_objsize != 0) {
+		panic("kmem_cache_free: %s: invalid object %p\n",
+		      kc->kc_name, obj);
+	}
+	return (offset - kc->kc_objoffset) / kc->kc_objsize;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slab creation and destruction. Called without kc_lock.
+
+/*
+ * Run the destructor on the first N objects of a slab and give its
+ * page back.
+ */
+static
+void
+slab_release(struct kmem_cache *kc, struct slab *sl, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(sl->sl_magic == SLAB_MAGIC);
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			kc->kc_dtor(slab_obj(kc, sl, i));
+		}
+	}
+	sl->sl_magic = 0;
+	free_kpages((vaddr_t)sl);
+}
+
+static
+struct slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct slab *sl;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	sl = (struct slab *)page;
+	sl->sl_magic = SLAB_MAGIC;
+	sl->sl_cache = kc;
+	sl->sl_next = sl->sl_prev = NULL;
+
+	for (i=0; i<kc->kc_perslab; i++) {
+		if (kc->kc_ctor != NULL && kc->kc_ctor(slab_obj(kc, sl, i))) {
+			slab_release(kc, sl, i);
+			return NULL;
+		}
+		/* hand out low indexes first */
+		sl->sl_freestack[i] = kc->kc_perslab - 1 - i;
+	}
+	sl->sl_nfree = kc->kc_perslab;
+	return sl;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface.
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+	size_t hdr;
+	unsigned n;
+
+	if (size == 0 || size > KMEM_CACHE_MAXOBJ) {
+		return NULL;
+	}
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	kc->kc_objsize = ROUNDUP(size, SLAB_ALIGN);
+
+	/* fit as many objects as we can after the header and index stack */
+	n = (PAGE_SIZE - sizeof(struct slab)) /
+		(kc->kc_objsize + sizeof(uint16_t));
+	while (1) {
+		hdr = sizeof(struct slab) + n * sizeof(uint16_t);
+		hdr = ROUNDUP(hdr, SLAB_ALIGN);
+		if (hdr + n * kc->kc_objsize <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	KASSERT(n > 0);
+	kc->kc_perslab = n;
+	kc->kc_objoffset = hdr;
+
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	KASSERT(kc != NULL);
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+
+	kmem_cache_reap(kc);
+	KASSERT(kc->kc_nslabs == 0);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct slab *sl, *newsl;
+	unsigned index;
+
+	KASSERT(kc != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_partial == NULL && kc->kc_empty == NULL) {
+		/*
+		 * Build a new slab without the spinlock. Things can
+		 * change behind our back; if someone else made space
+		 * in the meantime our slab just becomes another empty
+		 * one.
+		 */
+		spinlock_release(&kc->kc_lock);
+		newsl = slab_create(kc);
+		if (newsl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_push(&kc->kc_empty, newsl);
+		kc->kc_nempty++;
+		kc->kc_nslabs++;
+	}
+
+	if (kc->kc_partial != NULL) {
+		sl = kc->kc_partial;
+	}
+	else {
+		sl = kc->kc_empty;
+		slab_unlink(&kc->kc_empty, sl);
+		kc->kc_nempty--;
+		slab_push(&kc->kc_partial, sl);
+	}
+
+	KASSERT(sl->sl_magic == SLAB_MAGIC);
+	KASSERT(sl->sl_nfree > 0);
+	index = sl->sl_freestack[--sl->sl_nfree];
+	if (sl->sl_nfree == 0) {
+		slab_unlink(&kc->kc_partial, sl);
+		slab_push(&kc->kc_full, sl);
+	}
+	kc->kc_inuse++;
+	spinlock_release(&kc->kc_lock);
+
+	return slab_obj(kc, sl, index);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct slab *sl, *victim;
+
+	KASSERT(kc != NULL);
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(sl->sl_magic == SLAB_MAGIC);
+	KASSERT(sl->sl_cache == kc);
+
+	victim = NULL;
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(sl->sl_nfree < kc->kc_perslab);
+	if (sl->sl_nfree == 0) {
+		slab_unlink(&kc->kc_full, sl);
+		slab_push(&kc->kc_partial, sl);
+	}
+	sl->sl_freestack[sl->sl_nfree++] = slab_index(kc, sl, obj);
+	kc->kc_inuse--;
+
+	if (sl->sl_nfree == kc->kc_perslab) {
+		slab_unlink(&kc->kc_partial, sl);
+		if (kc->kc_nempty < SLAB_MAXEMPTY) {
+			slab_push(&kc->kc_empty, sl);
+			kc->kc_nempty++;
+		}
+		else {
+			victim = sl;
+			kc->kc_nslabs--;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (victim != NULL) {
+		slab_release(kc, victim, kc->kc_perslab);
+	}
+}
+
+void
+kmem_cache_reap(struct kmem_cache *kc)
+{
+	struct slab *list, *sl;
+
+	KASSERT(kc != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	list = kc->kc_empty;
+	kc->kc_empty = NULL;
+	kc->kc_nslabs -= kc->kc_nempty;
+	kc->kc_nempty = 0;
+	spinlock_release(&kc->kc_lock);
+
+	while (list != NULL) {
+		sl = list;
+		list = sl->sl_next;
+		slab_release(kc, sl, kc->kc_perslab);
+	}
+}
@@ -292,12 +292,100 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * dopipeline
+ * runs the commands in ARGS, which are separated by "|" tokens, with
+ * each one's standard output connected to the next one's standard
+ * input, and waits for all of them. returns the status of the last.
+ */
+static
+int
+dopipeline(char **args, int nargs)
+{
+	pid_t pids[NARG_MAX / 2 + 1];
+	int npids, i, start, status;
+	int fds[2];
+	int infd = -1;
+
+	status = 0;
+	npids = 0;
+	start = 0;
+	for (i = 0; i <= nargs; i++) {
+		if (i < nargs && strcmp(args[i], "|")) {
+			continue;
+		}
+		if (i == start) {
+			warnx("Missing command in pipeline");
+			status = _MKWAIT_EXIT(255);
+			break;
+		}
+		args[i] = NULL;
+
+		/* all but the last command write into a new pipe */
+		if (i < nargs && pipe(fds) < 0) {
+			warn("pipe");
+			status = _MKWAIT_EXIT(255);
+			break;
+		}
+
+		pids[npids] = fork();
+		if (pids[npids] < 0) {
+			warn("fork");
+			if (i < nargs) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			status = _MKWAIT_EXIT(255);
+			break;
+		}
+		if (pids[npids] == 0) {
+			/* child */
+			if (infd >= 0) {
+				dup2(infd, STDIN_FILENO);
+				close(infd);
+			}
+			if (i < nargs) {
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[0]);
+				close(fds[1]);
+			}
+			execv(args[start], &args[start]);
+			warn("%s", args[start]);
+			_exit(1);
+		}
+		npids++;
+
+		/* parent: keep only the read end for the next command */
+		if (infd >= 0) {
+			close(infd);
+			infd = -1;
+		}
+		if (i < nargs) {
+			close(fds[1]);
+			infd = fds[0];
+		}
+		start = i + 1;
+	}
+	if (infd >= 0) {
+		close(infd);
+	}
+
+	for (i = 0; i < npids; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			warn("waitpid");
+			status = -1;
+		}
+	}
+	return status;
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
  * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * the job if possible, otherwise just run it and wait on it. commands
+ * joined with "|" are run as a pipeline, in the foreground.
  */
 static
 int
@@ -337,6 +425,12 @@ docommand(char *buf)
 
 	/* Not a builtin; run it */
 
+	for (i=0; i<nargs; i++) {
+		if (!strcmp(args[i], "|")) {
+			return dopipeline(args, nargs);
+		}
+	}
+
 	if (nargs > 0 && !strcmp(args[nargs-1], "&")) {
 		/* background */
 		if (!can_bg()) {
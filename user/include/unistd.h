@@ -39,6 +39,7 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/iovec.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -152,6 +153,16 @@ int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+ssize_t readv(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t writev(int filehandle, const struct iovec *iov, int iovcnt);
+pid_t vfork(void);
+pid_t spawn(const char *prog, char *const *args);
+int __thread_create(void (*start)(void *(*)(void *), void *),
+                    void *(*func)(void *), void *arg);
+int thread_join(int tid, void **retval);
+__DEAD void thread_exit(void *retval);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
@@ -163,5 +174,6 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void *(*func)(void *), void *arg); /* __thread_create */
 
 #endif /* _UNISTD_H_ */
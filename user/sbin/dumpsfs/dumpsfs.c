@@ -95,12 +95,40 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which is
+ * DEPTH levels of indirection above them (1 for an indirect block,
+ * 2 for a double indirect block).
+ */
+static
+void
+dumpdirindirect(uint32_t iblock, int depth, uint32_t *nblocks)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block;
+	int i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (depth > 1) {
+			dumpdirindirect(block, depth-1, nblocks);
+		}
+		else {
+			dodirblock(block);
+			(*nblocks)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -120,14 +148,10 @@ dumpdir(uint32_t ino)
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		dumpdirindirect(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		dumpdirindirect(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
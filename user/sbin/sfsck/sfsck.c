@@ -767,9 +767,9 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #endif
 
 #define BMAP_DMAX   BMAP_ND
-#define BMAP_IMAX   (BMAP_DMAX+SFS_DBPERIDB*BMAP_NI)
-#define BMAP_IIMAX  (BMAP_IMAX+SFS_DBPERIDB*BMAP_NII)
-#define BMAP_IIIMAX (BMAP_IIMAX+SFS_DBPERIDB*BMAP_NIII)
+#define BMAP_IMAX   (BMAP_DMAX+BMAP_ISIZE*BMAP_NI)
+#define BMAP_IIMAX  (BMAP_IMAX+BMAP_IISIZE*BMAP_NII)
+#define BMAP_IIIMAX (BMAP_IIMAX+BMAP_IIISIZE*BMAP_NIII)
 
 #define BMAP_DSIZE	1
 #define BMAP_ISIZE	(BMAP_DSIZE*SFS_DBPERIDB)
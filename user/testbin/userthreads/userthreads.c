@@ -35,14 +35,10 @@
  * This won't do much of anything unless you implement user-level
  * threads.
  *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * It uses thread_create() to start each thread and thread_join() to
+ * wait for them, since exiting the process (returning from main)
+ * ends all its threads. Child threads exit when they return from
+ * the function they started in.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -61,22 +57,28 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void *ThreadRunner(void *);
+void *BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
     int i;
+    int tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL);
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (tids[i] > 0)
+	    thread_join(tids[i], NULL);
     }
 
     printf("Parent has left.\n");
@@ -88,23 +90,27 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+void *
+BladeRunner(void *arg)
 {
+    (void)arg;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
 	count++;
     }
+    return NULL;
 }
 
-void
-ThreadRunner()
+void *
+ThreadRunner(void *arg)
 {
+    (void)arg;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");
 	count++;
     }
+    return NULL;
 }
     
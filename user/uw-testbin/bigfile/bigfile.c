@@ -0,0 +1,180 @@
+/*
+ * bigfile - files that need indirect and double-indirect blocks.
+ *
+ * Writes a file well past the single-indirect range (about 71 KB on
+ * SFS) and reads it back, writes and reads at an offset deep in the
+ * double-indirect range with a hole before it, and truncates it.
+ * Truncation must free the blocks: the hole left behind reads as
+ * zeros, and writing and truncating the file over and over moves far
+ * more data than the disk holds, so leaked blocks end in ENOSPC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "../lib/testutils.h"
+
+#define FILENAME    "BIGFILE"
+#define FILESIZE    (200 * 1024)    /* well past 71 KB */
+#define DBLOFF      (512 * 1024)    /* deep in the double-indirect range */
+#define BUFSIZE     (1000)          /* not a multiple of the block size */
+#define NCYCLES     (40)            /* 40 * FILESIZE = 8 MB */
+
+static char buf[BUFSIZE];
+
+static
+char
+pattern(unsigned seed, int pos)
+{
+   return (char)(pos * 7 + pos / 509 + seed * 13);
+}
+
+/* write len bytes of the pattern at the seek pointer, from pos */
+static
+int
+write_pattern(int fd, unsigned seed, int pos, int len)
+{
+   int i, n, rc;
+
+   while (len > 0) {
+     n = len < BUFSIZE ? len : BUFSIZE;
+     for (i=0; i<n; i++) {
+       buf[i] = pattern(seed, pos + i);
+     }
+     rc = write(fd, buf, n);
+     if (rc != n) {
+       return rc < 0 ? rc : -1;
+     }
+     pos += n;
+     len -= n;
+   }
+   return 0;
+}
+
+/* read len bytes at the seek pointer; return how many don't match */
+static
+int
+check_pattern(int fd, unsigned seed, int pos, int len, int zeros)
+{
+   int i, n, rc, bad = 0;
+
+   while (len > 0) {
+     n = len < BUFSIZE ? len : BUFSIZE;
+     rc = read(fd, buf, n);
+     if (rc != n) {
+       return bad + len;
+     }
+     for (i=0; i<n; i++) {
+       if (buf[i] != (zeros ? 0 : pattern(seed, pos + i))) {
+         bad++;
+       }
+     }
+     pos += n;
+     len -= n;
+   }
+   return bad;
+}
+
+int
+main()
+{
+   int i, rc, fd;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC);
+   TEST_POSITIVE(fd, "Open file named " FILENAME " failed\n");
+
+   /* Direct, single-indirect and the start of double-indirect */
+   rc = write_pattern(fd, 1, 0, FILESIZE);
+   TEST_EQUAL(rc, 0, "writing the big file failed");
+   rc = lseek(fd, 0, SEEK_END);
+   TEST_EQUAL(rc, FILESIZE, "big file has the wrong size");
+   rc = lseek(fd, 0, SEEK_SET);
+   TEST_EQUAL(rc, 0, "lseek to start failed");
+   rc = check_pattern(fd, 1, 0, FILESIZE, 0);
+   TEST_EQUAL(rc, 0, "big file did not read back as written");
+
+   /* Overwrite across the single/double-indirect boundary */
+   rc = lseek(fd, 70 * 1024, SEEK_SET);
+   TEST_EQUAL(rc, 70 * 1024, "lseek to 70 KB failed");
+   rc = write_pattern(fd, 2, 70 * 1024, 8 * 1024);
+   TEST_EQUAL(rc, 0, "overwriting the indirect boundary failed");
+   rc = lseek(fd, 0, SEEK_SET);
+   TEST_EQUAL(rc, 0, "lseek to start failed");
+   rc = check_pattern(fd, 1, 0, 70 * 1024, 0);
+   TEST_EQUAL(rc, 0, "data before the overwrite changed");
+   rc = check_pattern(fd, 2, 70 * 1024, 8 * 1024, 0);
+   TEST_EQUAL(rc, 0, "overwrite did not read back as written");
+   rc = check_pattern(fd, 1, 78 * 1024, FILESIZE - 78 * 1024, 0);
+   TEST_EQUAL(rc, 0, "data after the overwrite changed");
+
+   /* Seek far into the double-indirect range, past a hole */
+   rc = lseek(fd, DBLOFF, SEEK_SET);
+   TEST_EQUAL(rc, DBLOFF, "lseek into the double-indirect range failed");
+   rc = write_pattern(fd, 3, DBLOFF, 3 * BUFSIZE);
+   TEST_EQUAL(rc, 0, "writing in the double-indirect range failed");
+   rc = lseek(fd, 0, SEEK_END);
+   TEST_EQUAL(rc, DBLOFF + 3 * BUFSIZE, "file has the wrong size");
+   rc = lseek(fd, FILESIZE, SEEK_SET);
+   TEST_EQUAL(rc, FILESIZE, "lseek to the hole failed");
+   rc = check_pattern(fd, 0, FILESIZE, DBLOFF - FILESIZE, 1);
+   TEST_EQUAL(rc, 0, "hole did not read as zeros");
+   rc = check_pattern(fd, 3, DBLOFF, 3 * BUFSIZE, 0);
+   TEST_EQUAL(rc, 0, "double-indirect data did not read back as written");
+   rc = read(fd, buf, 1);
+   TEST_EQUAL(rc, 0, "read at end of file did not return 0");
+   close(fd);
+
+   /* Truncate; the old data must be gone, not just out of reach */
+   fd = open(FILENAME, O_RDWR | O_TRUNC);
+   TEST_POSITIVE(fd, "Truncating " FILENAME " failed\n");
+   rc = lseek(fd, 0, SEEK_END);
+   TEST_EQUAL(rc, 0, "truncated file is not empty");
+   rc = lseek(fd, DBLOFF, SEEK_SET);
+   TEST_EQUAL(rc, DBLOFF, "lseek into the double-indirect range failed");
+   rc = write_pattern(fd, 4, DBLOFF, BUFSIZE);
+   TEST_EQUAL(rc, 0, "writing after truncation failed");
+   rc = lseek(fd, 0, SEEK_SET);
+   TEST_EQUAL(rc, 0, "lseek to start failed");
+   rc = check_pattern(fd, 0, 0, DBLOFF, 1);
+   TEST_EQUAL(rc, 0, "truncated data came back");
+   rc = check_pattern(fd, 4, DBLOFF, BUFSIZE, 0);
+   TEST_EQUAL(rc, 0, "data after truncation did not read back as written");
+   close(fd);
+
+   /* Every truncation must give all the blocks back */
+   for (i=0; i<NCYCLES; i++) {
+     fd = open(FILENAME, O_RDWR | O_TRUNC);
+     TEST_POSITIVE(fd, "Truncating " FILENAME " failed\n");
+     rc = write_pattern(fd, 5 + i, 0, FILESIZE);
+     TEST_EQUAL(rc, 0, "rewriting the big file failed (blocks leaked?)");
+     if (rc != 0) {
+       close(fd);
+       break;
+     }
+     close(fd);
+   }
+
+   if (i == NCYCLES) {
+     fd = open(FILENAME, O_RDONLY);
+     TEST_POSITIVE(fd, "Open file named " FILENAME " failed\n");
+     rc = check_pattern(fd, 4 + NCYCLES, 0, FILESIZE, 0);
+     TEST_EQUAL(rc, 0, "last rewrite did not read back as written");
+     close(fd);
+   }
+
+   /* Leave the space behind for the next test */
+   fd = open(FILENAME, O_RDWR | O_TRUNC);
+   TEST_POSITIVE(fd, "Truncating " FILENAME " failed\n");
+   close(fd);
+
+   TEST_STATS();
+
+   exit(0);
+}
@@ -0,0 +1,105 @@
+/*
+ * execargs - argument passing in execv.
+ *
+ * Checks that execv fails cleanly, leaving the caller running, when
+ * argv or one of its strings is a bad pointer or when the arguments
+ * exceed ARG_MAX. Then execs itself with a known argument list and
+ * checks that the child sees it intact and word-aligned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../lib/testutils.h"
+
+#define PROG        "/uw-testbin/execargs"
+#define BIGLEN      (1000)
+#define NBIG        (ARG_MAX / BIGLEN + 2)
+
+static char big[BIGLEN];
+static char *bigargs[NBIG + 1];
+
+static const char *expect[] = {
+   PROG, "child", "", "a", "odd-length", "0123456789abcdef", NULL
+};
+
+static
+int
+child(int argc, char **argv)
+{
+   int i;
+
+   if (argc != (int)(sizeof(expect) / sizeof(expect[0])) - 1) {
+     return 1;
+   }
+   if (((unsigned long)argv & 3) != 0) {
+     return 2;
+   }
+   for (i=0; i<argc; i++) {
+     if (strcmp(argv[i], expect[i]) != 0) {
+       return 3;
+     }
+   }
+   if (argv[argc] != NULL) {
+     return 4;
+   }
+   return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+   int i, rc, status;
+   pid_t pid;
+   char *badargs[3];
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   if (argc > 1 && strcmp(argv[1], "child") == 0) {
+     return child(argc, argv);
+   }
+
+   /* argv itself points into the kernel */
+   rc = execv(PROG, (char **)0x80000000);
+   TEST_NEGATIVE(rc, "execv with a kernel argv succeeded");
+   TEST_EQUAL(errno, EFAULT, "expected EFAULT for a bad argv");
+
+   /* one of the strings is bad */
+   badargs[0] = (char *)PROG;
+   badargs[1] = (char *)0x40000000;
+   badargs[2] = NULL;
+   rc = execv(PROG, badargs);
+   TEST_NEGATIVE(rc, "execv with a bad argument succeeded");
+   TEST_EQUAL(errno, EFAULT, "expected EFAULT for a bad argument");
+
+   /* more than ARG_MAX bytes of arguments */
+   memset(big, 'x', BIGLEN - 1);
+   for (i=0; i<NBIG; i++) {
+     bigargs[i] = big;
+   }
+   bigargs[NBIG] = NULL;
+   rc = execv(PROG, bigargs);
+   TEST_NEGATIVE(rc, "execv with oversized arguments succeeded");
+   TEST_EQUAL(errno, E2BIG, "expected E2BIG for oversized arguments");
+
+   /* still here: now a good exec */
+   pid = fork();
+   if (pid == 0) {
+     execv(PROG, (char **)expect);
+     _exit(100);
+   }
+   TEST_POSITIVE(pid, "fork failed");
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid failed");
+   TEST_EQUAL(WEXITSTATUS(status), 0, "child saw the wrong arguments");
+
+   TEST_STATS();
+
+   exit(0);
+}
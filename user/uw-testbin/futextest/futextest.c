@@ -0,0 +1,139 @@
+/*
+ * futextest - user-space locks built on futex.
+ *
+ * Several threads increment a shared counter under a mutex that only
+ * enters the kernel when it is contended (the usual three-state
+ * futex mutex), then check the total. Also checks the EAGAIN and
+ * wake-count results of futex itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <futex.h>
+#include "../lib/testutils.h"
+
+#define NTHREADS    (6)
+#define NLOOPS      (20000)
+
+/* 0: unlocked, 1: locked, 2: locked with (maybe) waiters */
+static volatile int mutex;
+static volatile int counter;
+
+/* atomically: if *p == old, set *p = new; return the old *p */
+static
+int
+cas(volatile int *p, int old, int new)
+{
+   int prev, ok;
+
+   do {
+     /* ok is only meaningful if prev == old, when the sc ran */
+     __asm volatile(
+       ".set push;"
+       ".set mips32;"
+       ".set noreorder;"
+       "ll %0, 0(%2);"
+       "bne %0, %3, 1f;"
+       "move %1, %4;"          /* branch delay slot */
+       "sc %1, 0(%2);"
+       "1:"
+       ".set pop"
+       : "=&r" (prev), "=&r" (ok)
+       : "r" (p), "r" (old), "r" (new)
+       : "memory");
+   } while (prev == old && ok == 0);
+   return prev;
+}
+
+static
+void
+mutex_lock(void)
+{
+   int c;
+
+   c = cas(&mutex, 0, 1);
+   if (c == 0) {
+     /* uncontended: no syscall */
+     return;
+   }
+   do {
+     if (c == 2 || cas(&mutex, 1, 2) != 0) {
+       futex((int *)&mutex, FUTEX_WAIT, 2);
+     }
+   } while ((c = cas(&mutex, 0, 2)) != 0);
+}
+
+static
+void
+mutex_unlock(void)
+{
+   int c;
+
+   do {
+     c = mutex;
+   } while (cas(&mutex, c, c - 1) != c);
+   if (c != 1) {
+     mutex = 0;
+     futex((int *)&mutex, FUTEX_WAKE, 1);
+   }
+}
+
+static
+void *
+worker(void *arg)
+{
+   int i, tmp;
+
+   (void)arg;
+   for (i=0; i<NLOOPS; i++) {
+     mutex_lock();
+     tmp = counter;
+     if (i % 64 == 0) {
+       /* widen the window so the lock is contended sometimes */
+       getpid();
+     }
+     counter = tmp + 1;
+     mutex_unlock();
+   }
+   return NULL;
+}
+
+int
+main()
+{
+   int i, rc;
+   int tids[NTHREADS];
+   int word = 5;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   /* waiting on a word that does not match returns at once */
+   rc = futex(&word, FUTEX_WAIT, 6);
+   TEST_NEGATIVE(rc, "FUTEX_WAIT on a changed word slept");
+   TEST_EQUAL(errno, EAGAIN, "expected EAGAIN");
+
+   /* nobody to wake */
+   rc = futex(&word, FUTEX_WAKE, 1);
+   TEST_EQUAL(rc, 0, "FUTEX_WAKE woke a sleeper that does not exist");
+
+   /* misaligned */
+   rc = futex((int *)((char *)&word + 1), FUTEX_WAKE, 1);
+   TEST_NEGATIVE(rc, "futex on a misaligned address succeeded");
+
+   for (i=0; i<NTHREADS; i++) {
+     tids[i] = thread_create(worker, NULL);
+     TEST_POSITIVE(tids[i], "thread_create failed");
+   }
+   for (i=0; i<NTHREADS; i++) {
+     thread_join(tids[i], NULL);
+   }
+   TEST_EQUAL(counter, NTHREADS * NLOOPS, "lost updates under the mutex");
+   TEST_EQUAL(mutex, 0, "mutex left locked");
+
+   TEST_STATS();
+
+   exit(0);
+}
@@ -0,0 +1,87 @@
+/*
+ * pipetest - stream data through a pipe between two processes.
+ *
+ * The child writes a known pattern into the pipe in odd-sized pieces,
+ * larger in total than the pipe's buffer, and the parent reads it back
+ * and checks it, then checks for end of file once the child has
+ * closed its end. Finally, a write with no reader must fail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../lib/testutils.h"
+
+#define TOTAL       (64*1024)
+#define WRITE_CHUNK (1000)
+#define READ_CHUNK  (777)
+
+static char buf[WRITE_CHUNK];
+
+int
+main()
+{
+   int i, rc, status;
+   int fds[2];
+   int total;
+   pid_t pid;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   rc = pipe(fds);
+   TEST_EQUAL(rc, 0, "pipe failed");
+
+   pid = fork();
+   TEST_NOT_EQUAL(pid, -1, "fork failed");
+   if (pid == 0) {
+     close(fds[0]);
+     for (total = 0; total < TOTAL; total += rc) {
+       rc = TOTAL - total < WRITE_CHUNK ? TOTAL - total : WRITE_CHUNK;
+       for (i=0; i<rc; i++) {
+         buf[i] = (char)(total + i);
+       }
+       rc = write(fds[1], buf, rc);
+       if (rc <= 0) {
+         _exit(1);
+       }
+     }
+     close(fds[1]);
+     _exit(0);
+   }
+
+   close(fds[1]);
+   total = 0;
+   while ((rc = read(fds[0], buf, READ_CHUNK)) > 0) {
+     for (i=0; i<rc; i++) {
+       if (buf[i] != (char)(total + i)) {
+         TEST_EQUAL(buf[i], (char)(total + i), "Value read not equal to value written");
+         break;
+       }
+     }
+     total += rc;
+   }
+   TEST_EQUAL(rc, 0, "read did not end with EOF");
+   TEST_EQUAL(total, TOTAL, "did not read everything written");
+
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid failed");
+   TEST_EQUAL(WEXITSTATUS(status), 0, "writer failed");
+   close(fds[0]);
+
+   /* nobody will read this */
+   rc = pipe(fds);
+   TEST_EQUAL(rc, 0, "pipe failed");
+   close(fds[0]);
+   rc = write(fds[1], buf, 1);
+   TEST_NEGATIVE(rc, "write with no reader succeeded");
+   TEST_EQUAL(errno, EPIPE, "write with no reader did not fail with EPIPE");
+   close(fds[1]);
+
+   TEST_STATS();
+
+   exit(0);
+}
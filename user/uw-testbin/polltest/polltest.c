@@ -0,0 +1,89 @@
+/*
+ * polltest - wait on several pipes at once with poll.
+ *
+ * Checks that poll times out when nothing is ready, wakes up for the
+ * one pipe a child writes to out of several, reports POLLHUP when
+ * the writer goes away, and flags descriptors that are not open.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../lib/testutils.h"
+
+#define NPIPES  (4)
+#define WHICH   (2)
+
+int
+main()
+{
+   int i, rc, status;
+   int fds[NPIPES][2];
+   struct pollfd pfds[NPIPES];
+   char ch;
+   pid_t pid;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   for (i=0; i<NPIPES; i++) {
+     rc = pipe(fds[i]);
+     TEST_EQUAL(rc, 0, "pipe failed");
+     pfds[i].fd = fds[i][0];
+     pfds[i].events = POLLIN;
+   }
+
+   /* nothing written yet */
+   rc = poll(pfds, NPIPES, 0);
+   TEST_EQUAL(rc, 0, "poll found an empty pipe ready");
+   rc = poll(pfds, NPIPES, 100);
+   TEST_EQUAL(rc, 0, "poll did not time out");
+
+   pid = fork();
+   TEST_NOT_EQUAL(pid, -1, "fork failed");
+   if (pid == 0) {
+     /* give the parent time to go to sleep in poll */
+     for (i=0; i<100000; i++) {
+       getpid();
+     }
+     ch = 'x';
+     write(fds[WHICH][1], &ch, 1);
+     _exit(0);
+   }
+
+   rc = poll(pfds, NPIPES, -1);
+   TEST_EQUAL(rc, 1, "poll did not return exactly one ready pipe");
+   for (i=0; i<NPIPES; i++) {
+     TEST_EQUAL(pfds[i].revents, i == WHICH ? POLLIN : 0, "wrong revents");
+   }
+   rc = read(fds[WHICH][0], &ch, 1);
+   TEST_EQUAL(rc, 1, "read of the ready pipe failed");
+   TEST_EQUAL(ch, 'x', "read the wrong byte");
+
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid failed");
+
+   /* writer closed: hangup */
+   close(fds[0][1]);
+   rc = poll(pfds, 1, -1);
+   TEST_EQUAL(rc, 1, "poll after close did not return");
+   TEST_EQUAL(pfds[0].revents & POLLHUP, POLLHUP, "no POLLHUP after close");
+
+   /* write end with space is writable; a closed descriptor is invalid */
+   pfds[0].fd = fds[1][1];
+   pfds[0].events = POLLOUT;
+   close(fds[1][0]);
+   pfds[1].fd = fds[1][0];
+   pfds[1].events = POLLIN;
+   rc = poll(pfds, 2, 0);
+   TEST_EQUAL(rc, 2, "poll did not report both descriptors");
+   TEST_EQUAL(pfds[0].revents, POLLERR, "no POLLERR with reader closed");
+   TEST_EQUAL(pfds[1].revents, POLLNVAL, "no POLLNVAL for closed descriptor");
+
+   TEST_STATS();
+
+   exit(0);
+}
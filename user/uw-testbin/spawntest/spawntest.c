@@ -0,0 +1,81 @@
+/*
+ * spawntest - start programs with vfork and spawn.
+ *
+ * Runs itself as a child through vfork+execv and through spawn and
+ * checks the exit status, checks that a vforked child that exits
+ * directly hands the address space back, and that spawning a missing
+ * program fails in the parent with no child left behind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../lib/testutils.h"
+
+#define PROG        "/uw-testbin/spawntest"
+#define NSPAWN      (64)
+
+static char *childargs[] = { (char *)PROG, (char *)"child", (char *)"5", NULL };
+
+int
+main(int argc, char **argv)
+{
+   int i, rc, status;
+   pid_t pid;
+   char *noargs[] = { (char *)"/no/such/program", NULL };
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   if (argc == 3 && strcmp(argv[1], "child") == 0) {
+     _exit(atoi(argv[2]));
+   }
+
+   /* vfork + execv */
+   pid = vfork();
+   if (pid == 0) {
+     execv(PROG, childargs);
+     _exit(100);
+   }
+   TEST_POSITIVE(pid, "vfork failed");
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid after vfork failed");
+   TEST_EQUAL(WEXITSTATUS(status), 5, "vforked child did not exec");
+
+   /* vfork + _exit: we must get our address space back intact */
+   pid = vfork();
+   if (pid == 0) {
+     _exit(9);
+   }
+   TEST_POSITIVE(pid, "vfork failed");
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid after vfork failed");
+   TEST_EQUAL(WEXITSTATUS(status), 9, "wrong exit status from vfork child");
+
+   /* spawn, many times over */
+   for (i=0; i<NSPAWN; i++) {
+     pid = spawn(PROG, childargs);
+     if (pid < 0) {
+       TEST_POSITIVE(pid, "spawn failed");
+       break;
+     }
+     rc = waitpid(pid, &status, 0);
+     if (rc != pid || WEXITSTATUS(status) != 5) {
+       TEST_EQUAL(rc, pid, "waitpid after spawn failed");
+       TEST_EQUAL(WEXITSTATUS(status), 5, "spawned child got wrong args");
+     }
+   }
+
+   /* a missing program fails in the parent */
+   pid = spawn(noargs[0], noargs);
+   TEST_NEGATIVE(pid, "spawn of a missing program succeeded");
+   TEST_EQUAL(errno, ENOENT, "expected ENOENT");
+
+   TEST_STATS();
+
+   exit(0);
+}
@@ -0,0 +1,131 @@
+/*
+ * uthreads - several threads in one process.
+ *
+ * Sums an array with one thread per slice and checks the total and
+ * each thread's return value, so the threads must share memory but
+ * have their own stacks. Reuses stack slots by creating more threads
+ * than can exist at once, checks joining errors, and checks that
+ * _exit from one thread ends a process whose other thread is still
+ * running.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../lib/testutils.h"
+
+#define NTHREADS    (8)
+#define NROUNDS     (8)
+#define SLICE       (1024)
+
+static int data[NTHREADS * SLICE];
+static int sums[NTHREADS];
+
+static
+void *
+summer(void *arg)
+{
+   int which = (int)arg;
+   int local[64];   /* make sure the stack is really ours */
+   int i, sum = 0;
+
+   for (i=0; i<64; i++) {
+     local[i] = which;
+   }
+   for (i=0; i<SLICE; i++) {
+     sum += data[which * SLICE + i];
+   }
+   for (i=0; i<64; i++) {
+     if (local[i] != which) {
+       return (void *)-1;
+     }
+   }
+   sums[which] = sum;
+   return (void *)(which + 1);
+}
+
+static
+void *
+exiter(void *arg)
+{
+   thread_exit(arg);
+}
+
+static
+void *
+spinner(void *arg)
+{
+   (void)arg;
+   while (1) {
+     /* spin until the process goes away */
+   }
+   return NULL;
+}
+
+int
+main()
+{
+   int i, r, tid, rc, status, total, expect;
+   int tids[NTHREADS];
+   void *rv;
+   pid_t pid;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   expect = 0;
+   for (i=0; i<NTHREADS * SLICE; i++) {
+     data[i] = i % 97;
+     expect += i % 97;
+   }
+
+   for (r=0; r<NROUNDS; r++) {
+     for (i=0; i<NTHREADS; i++) {
+       sums[i] = 0;
+       tids[i] = thread_create(summer, (void *)i);
+       if (tids[i] < 0) {
+         TEST_POSITIVE(tids[i], "thread_create failed");
+         exit(1);
+       }
+     }
+     total = 0;
+     for (i=0; i<NTHREADS; i++) {
+       rc = thread_join(tids[i], &rv);
+       if (rc != 0 || rv != (void *)(i + 1)) {
+         TEST_EQUAL(rc, 0, "thread_join failed");
+         TEST_EQUAL((int)rv, i + 1, "wrong thread return value");
+       }
+       total += sums[i];
+     }
+     if (total != expect) {
+       TEST_EQUAL(total, expect, "threads computed the wrong sum");
+     }
+   }
+
+   /* thread_exit, and joining twice */
+   tid = thread_create(exiter, (void *)42);
+   TEST_POSITIVE(tid, "thread_create failed");
+   rc = thread_join(tid, &rv);
+   TEST_EQUAL(rc, 0, "thread_join failed");
+   TEST_EQUAL((int)rv, 42, "wrong thread_exit value");
+   rc = thread_join(tid, &rv);
+   TEST_NEGATIVE(rc, "joined the same thread twice");
+
+   /* _exit in one thread ends the whole process */
+   pid = fork();
+   if (pid == 0) {
+     thread_create(spinner, NULL);
+     _exit(3);
+   }
+   TEST_POSITIVE(pid, "fork failed");
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid failed");
+   TEST_EQUAL(WEXITSTATUS(status), 3, "wrong exit status");
+
+   TEST_STATS();
+
+   exit(0);
+}
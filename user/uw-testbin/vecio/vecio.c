@@ -0,0 +1,91 @@
+/*
+ * vecio - exercise pread/pwrite and readv/writev.
+ *
+ * Writes a file as a vector of fragments with writev, reads it back
+ * with readv into differently-sized fragments, and checks that pread
+ * and pwrite work at explicit offsets without moving the seek pointer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "../lib/testutils.h"
+
+#define NUM_INTS    (1024)
+#define NUM_FRAGS   (16)
+
+static int write_array[NUM_INTS];
+static int read_array[NUM_INTS];
+
+int
+main()
+{
+   int i, rc, fd, val;
+   struct iovec iov[NUM_FRAGS];
+   int fraglen = NUM_INTS / NUM_FRAGS;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   for (i=0; i<NUM_INTS; i++) {
+     write_array[i] = i;
+   }
+
+   fd = open("VECIO_FILE", O_RDWR | O_CREAT | O_TRUNC);
+   TEST_POSITIVE(fd, "Open file named VECIO_FILE failed\n");
+
+   /* Write the array as NUM_FRAGS equal fragments */
+   for (i=0; i<NUM_FRAGS; i++) {
+     iov[i].iov_base = &write_array[i * fraglen];
+     iov[i].iov_len = fraglen * sizeof(int);
+   }
+   rc = writev(fd, iov, NUM_FRAGS);
+   TEST_EQUAL(rc, sizeof(write_array), "writev did not write everything");
+
+   /* Read it back as one small fragment, one empty one, and the rest */
+   rc = lseek(fd, 0, SEEK_SET);
+   TEST_EQUAL(rc, 0, "lseek to start failed");
+   iov[0].iov_base = &read_array[0];
+   iov[0].iov_len = sizeof(int);
+   iov[1].iov_base = &read_array[1];
+   iov[1].iov_len = 0;
+   iov[2].iov_base = &read_array[1];
+   iov[2].iov_len = sizeof(read_array) - sizeof(int);
+   rc = readv(fd, iov, 3);
+   TEST_EQUAL(rc, sizeof(read_array), "readv did not read everything");
+   for (i=0; i<NUM_INTS; i++) {
+     TEST_EQUAL(read_array[i], write_array[i], "readv value not equal to value written");
+   }
+
+   /* The seek pointer is at end of file; pread/pwrite must not use it */
+   rc = pread(fd, &val, sizeof(val), 10 * sizeof(int));
+   TEST_EQUAL(rc, sizeof(val), "pread failed");
+   TEST_EQUAL(val, 10, "pread read the wrong value");
+
+   val = -1;
+   rc = pwrite(fd, &val, sizeof(val), 20 * sizeof(int));
+   TEST_EQUAL(rc, sizeof(val), "pwrite failed");
+   rc = pread(fd, &val, sizeof(val), 20 * sizeof(int));
+   TEST_EQUAL(val, -1, "pread did not see the pwrite");
+
+   rc = lseek(fd, 0, SEEK_CUR);
+   TEST_EQUAL(rc, sizeof(write_array), "pread/pwrite moved the seek pointer");
+
+   /* Bad arguments */
+   rc = pread(fd, &val, sizeof(val), -1);
+   TEST_NEGATIVE(rc, "pread at a negative offset succeeded");
+   rc = readv(fd, iov, 0);
+   TEST_NEGATIVE(rc, "readv with no iovecs succeeded");
+   rc = pread(STDIN_FILENO, &val, sizeof(val), 0);
+   TEST_EQUAL(errno, ESPIPE, "pread on the console did not fail with ESPIPE");
+
+   close(fd);
+
+   TEST_STATS();
+
+   exit(0);
+}
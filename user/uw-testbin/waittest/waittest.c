@@ -0,0 +1,116 @@
+/*
+ * waittest - fork and reap many children.
+ *
+ * Forks more children than there are PID table slots, in batches,
+ * reaping each batch, so a leak of PIDs or child records makes fork
+ * fail. Also checks WNOHANG, the errors for waiting on a pid that is
+ * gone (ESRCH) or not a child (ECHILD), and that a process may exit
+ * without waiting for its children.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../lib/testutils.h"
+
+#define BATCH       (16)
+#define NBATCHES    (128)
+
+int
+main()
+{
+   int i, j, rc, status;
+   pid_t pids[BATCH];
+   pid_t pid;
+
+   /* Uncomment this when having failures and for debugging */
+   // TEST_VERBOSE_ON();
+
+   for (i=0; i<NBATCHES; i++) {
+     for (j=0; j<BATCH; j++) {
+       pids[j] = fork();
+       if (pids[j] == 0) {
+         _exit(j);
+       }
+       if (pids[j] < 0) {
+         TEST_POSITIVE(pids[j], "fork failed");
+         exit(1);
+       }
+     }
+     /* reap in reverse order, to exercise removal from the middle */
+     for (j=BATCH-1; j>=0; j--) {
+       rc = waitpid(pids[j], &status, 0);
+       if (rc != pids[j] || WEXITSTATUS(status) != j) {
+         TEST_EQUAL(rc, pids[j], "waitpid returned the wrong pid");
+         TEST_EQUAL(WEXITSTATUS(status), j, "wrong exit status");
+       }
+     }
+   }
+
+   /* a child that is still running: WNOHANG returns 0 */
+   pid = fork();
+   if (pid == 0) {
+     for (i=0; i<100000; i++) {
+       getpid();
+     }
+     _exit(7);
+   }
+   rc = waitpid(pid, &status, WNOHANG);
+   TEST_EQUAL(rc, 0, "WNOHANG on a running child did not return 0");
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid failed");
+   TEST_EQUAL(WEXITSTATUS(status), 7, "wrong exit status");
+
+   /* it has been reaped, so that pid no longer exists */
+   rc = waitpid(pid, &status, 0);
+   TEST_NEGATIVE(rc, "waitpid succeeded twice on the same child");
+   TEST_EQUAL(errno, ESRCH, "waitpid on a reaped child: wrong error");
+
+   /* we exist, but we are not our own child */
+   rc = waitpid(getpid(), &status, 0);
+   TEST_NEGATIVE(rc, "waitpid on ourselves succeeded");
+   TEST_EQUAL(errno, ECHILD, "waitpid on a non-child: wrong error");
+
+   /* nor is our sibling, even while it is running */
+   pid = fork();
+   if (pid == 0) {
+     for (i=0; i<100000; i++) {
+       getpid();
+     }
+     _exit(0);
+   }
+   pids[0] = fork();
+   if (pids[0] == 0) {
+     rc = waitpid(pid, &status, 0);
+     _exit(rc < 0 && errno == ECHILD ? 0 : 1);
+   }
+   rc = waitpid(pids[0], &status, 0);
+   TEST_EQUAL(rc, pids[0], "waitpid failed");
+   TEST_EQUAL(WEXITSTATUS(status), 0, "waitpid on a sibling: wrong error");
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid failed");
+
+   /* leave a zombie and a running child behind; exit must clean up */
+   pid = fork();
+   if (pid == 0) {
+     if (fork() == 0) {
+       _exit(0);
+     }
+     if (fork() == 0) {
+       for (i=0; i<100000; i++) {
+         getpid();
+       }
+       _exit(0);
+     }
+     _exit(0);
+   }
+   rc = waitpid(pid, &status, 0);
+   TEST_EQUAL(rc, pid, "waitpid on the orphaning child failed");
+
+   TEST_STATS();
+
+   exit(0);
+}